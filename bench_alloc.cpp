@@ -0,0 +1,273 @@
+#include "server.hpp"
+#include "log.hpp"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+/* counts the heap allocations of a root and a child server per MSG and
+ * PRIVMSG. Clients are plain sockets in the same thread that read into a
+ * fixed buffer, so every allocation counted is made by the servers. */
+
+#define USAGE "usage: bench_alloc [-c clients per server] [-g members per channel] [-m messages] [-p base port]"
+
+static size_t allocations = 0;
+
+static size_t allocated_bytes = 0;
+
+// not inlined, gcc would pair free with the callers' new and warn
+__attribute__((noinline)) void *operator new(size_t n)
+{
+	allocations++;
+	allocated_bytes += n;
+	void *p = malloc(n == 0 ? 1 : n);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+__attribute__((noinline)) void *operator new[](size_t n)
+{
+	return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+struct bench_client
+{
+	int sock;
+
+	std::string host;
+
+	std::string nick;
+
+	std::string chan;
+};
+
+struct bench
+{
+	std::vector<server*> servers;
+
+	std::vector<bench_client> clients;
+
+	/* lines read by the clients */
+	uint64_t received;
+
+	/* time spent inside the servers */
+	std::chrono::duration<double> server_time;
+
+	bench() : received(0), server_time(0) {}
+
+	/* runs the servers and reads the clients until nothing moves for a
+	 * while */
+	void settle()
+	{
+		char buf[65536];
+		unsigned idle = 0;
+		while (idle < 200) {
+			bool moved = false;
+			auto begin = std::chrono::steady_clock::now();
+			for (auto s : servers) {
+				s->run_once(0);
+				moved = moved || s->busy();
+			}
+			server_time += std::chrono::steady_clock::now() - begin;
+			for (auto &c : clients) {
+				ssize_t n;
+				while ((n = recv(c.sock, buf, sizeof buf, MSG_DONTWAIT)) > 0) {
+					for (ssize_t i = 0; i < n; i++) {
+						received += buf[i] == '\n';
+					}
+					moved = true;
+				}
+			}
+			idle = moved ? 0 : idle + 1;
+		}
+	}
+
+	void send_line(const bench_client &c, const char *line, size_t len)
+	{
+		while (len > 0) {
+			ssize_t n = send(c.sock, line, len, 0);
+			if (n <= 0) {
+				perror("send");
+				exit(EXIT_FAILURE);
+			}
+			line += n;
+			len -= static_cast<size_t>(n);
+		}
+	}
+};
+
+static int dial(const std::string &port)
+{
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo("localhost", port.c_str(), &hints, &res) != 0) {
+		return -1;
+	}
+	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock != -1 && connect(sock, res->ai_addr, res->ai_addrlen) == -1) {
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t n_clients = 50;
+	size_t members = 8;
+	size_t n_messages = 20000;
+	unsigned base = 6600;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:g:m:p:")) != -1) {
+		switch (opt) {
+			case 'c':
+				n_clients = std::stoul(optarg);
+				break;
+			case 'g':
+				members = std::stoul(optarg);
+				break;
+			case 'm':
+				n_messages = std::stoul(optarg);
+				break;
+			case 'p':
+				base = static_cast<unsigned>(std::stoul(optarg));
+				break;
+			default:
+				std::cerr << USAGE << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (n_clients == 0 || members < 2) {
+		std::cerr << USAGE << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	logger::set_level(LOG_WARN);
+
+	bench b;
+	std::string root_port = std::to_string(base), child_port = std::to_string(base + 1);
+	b.servers.push_back(new server(root_port));
+	b.servers.push_back(new server(child_port));
+	for (auto s : b.servers) {
+		s->set_presence_window(0);
+	}
+	b.servers[0]->set_name("root");
+	b.servers[1]->set_name("child");
+	if (!b.servers[1]->connect_parent("localhost", root_port)) {
+		std::cerr << "bench_alloc: failed to link the servers" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	b.settle();
+
+	// half the clients of a channel on each server
+	for (size_t i = 0; i < 2 * n_clients; i++) {
+		bench_client c;
+		c.sock = dial(i % 2 == 0 ? root_port : child_port);
+		if (c.sock == -1) {
+			std::cerr << "bench_alloc: failed to connect" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		c.host = "h" + std::to_string(i);
+		c.nick = "n" + std::to_string(i);
+		c.chan = "c" + std::to_string(i / members);
+		b.clients.push_back(c);
+		b.settle();
+	}
+	for (const char *cmd : { "CONNECT", "NICK", "JOIN" }) {
+		for (auto &c : b.clients) {
+			std::string line = std::string(cmd) + " " + c.host;
+			if (cmd[0] == 'N') {
+				line += " " + c.nick;
+			} else if (cmd[0] == 'J') {
+				line += " " + c.chan;
+			}
+			line += "\n";
+			b.send_line(c, line.data(), line.size());
+		}
+		b.settle();
+	}
+
+	// the lines are built before counting starts
+	std::vector<std::string> lines;
+	for (size_t i = 0; i < n_messages; i++) {
+		size_t k = i % b.clients.size();
+		bench_client &c = b.clients[k];
+		// with request ids like ibrcc sends them
+		std::string tag = "@" + std::to_string(i + 1) + " ";
+		if (i % 2 == 0) {
+			lines.push_back(tag + "MSG " + c.host + " " + c.nick + " " + c.chan + " hello there " + std::to_string(i) + "\n");
+		} else {
+			// a member of the same channel on the other server
+			size_t other = k % members + 1 < members && k + 1 < b.clients.size() ? k + 1 : k - 1;
+			lines.push_back(tag + "PRIVMSG " + c.host + " " + c.nick + " " + c.chan + " "
+				+ b.clients[other].nick + " hello you " + std::to_string(i) + "\n");
+		}
+	}
+
+	uint64_t received_before = b.received;
+	size_t allocations_before = allocations, bytes_before = allocated_bytes;
+	b.server_time = std::chrono::duration<double>(0);
+	for (size_t i = 0; i < n_messages; i++) {
+		b.send_line(b.clients[i % b.clients.size()], lines[i].data(), lines[i].size());
+		if (i % 64 == 63) {
+			b.settle();
+		}
+	}
+	b.settle();
+	size_t allocs = allocations - allocations_before;
+	size_t bytes = allocated_bytes - bytes_before;
+	uint64_t received = b.received - received_before;
+
+	double n = static_cast<double>(n_messages);
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "clients " << b.clients.size() << " members per channel " << members
+		<< " messages " << n_messages << " (MSG and PRIVMSG)" << std::endl;
+	std::cout << "lines delivered to clients: " << received << std::endl;
+	std::cout << "allocations: " << allocs << ", " << static_cast<double>(allocs) / n
+		<< " per message, " << static_cast<double>(allocs) / static_cast<double>(received ? received : 1)
+		<< " per line delivered" << std::endl;
+	std::cout << "bytes allocated: " << static_cast<double>(bytes) / n << " per message" << std::endl;
+	std::cout << "server time: " << b.server_time.count() * 1e6 / n << " us per message" << std::endl;
+
+	for (auto &c : b.clients) {
+		close(c.sock);
+	}
+	b.settle();
+	for (auto s : b.servers) {
+		delete s;
+	}
+	return 0;
+}
@@ -0,0 +1,186 @@
+#include "flat_map.hpp"
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <stdlib.h>
+
+/* compares flat_map with the std::unordered_map registries it replaced */
+
+static size_t allocated_bytes = 0;
+
+/* counts what the node based map allocates */
+template <typename T>
+struct counting_allocator
+{
+	typedef T value_type;
+
+	counting_allocator() {}
+
+	template <typename U>
+	counting_allocator(const counting_allocator<U> &) {}
+
+	T *allocate(size_t n)
+	{
+		allocated_bytes += n * sizeof(T);
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		allocated_bytes -= n * sizeof(T);
+		::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const counting_allocator<U> &) const { return true; }
+
+	template <typename U>
+	bool operator!=(const counting_allocator<U> &) const { return false; }
+};
+
+struct result
+{
+	double insert_mops;
+
+	double lookup_mops;
+
+	double erase_mops;
+
+	double bytes_per_entry;
+};
+
+static double mops(size_t ops, std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+	return static_cast<double>(ops) / d.count() / 1e6;
+}
+
+template <typename Map, typename Keys>
+static result run_unordered(const Keys &keys, const Keys &order)
+{
+	result r;
+	size_t before = allocated_bytes;
+	size_t sum = 0;
+	{
+		Map m;
+		auto start = std::chrono::steady_clock::now();
+		for (auto &k : keys) {
+			m.emplace(k, &m);
+		}
+		r.insert_mops = mops(keys.size(), start);
+		r.bytes_per_entry = static_cast<double>(allocated_bytes - before) / static_cast<double>(keys.size());
+
+		start = std::chrono::steady_clock::now();
+		for (auto &k : order) {
+			sum += m.find(k) != m.end();
+		}
+		r.lookup_mops = mops(order.size(), start);
+
+		start = std::chrono::steady_clock::now();
+		for (auto &k : order) {
+			sum += m.erase(k);
+		}
+		r.erase_mops = mops(order.size(), start);
+	}
+	if (sum != 2 * keys.size()) {
+		std::cerr << "bench_map: unordered_map lost entries" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return r;
+}
+
+template <typename Map, typename Keys>
+static result run_flat(const Keys &keys, const Keys &order)
+{
+	result r;
+	size_t sum = 0;
+	Map m;
+	auto start = std::chrono::steady_clock::now();
+	for (auto &k : keys) {
+		m.emplace(k, &m);
+	}
+	r.insert_mops = mops(keys.size(), start);
+	r.bytes_per_entry = static_cast<double>(m.memory_usage()) / static_cast<double>(keys.size());
+
+	start = std::chrono::steady_clock::now();
+	for (auto &k : order) {
+		sum += m.find(k) != m.end();
+	}
+	r.lookup_mops = mops(order.size(), start);
+
+	start = std::chrono::steady_clock::now();
+	for (auto &k : order) {
+		sum += m.erase(k);
+	}
+	r.erase_mops = mops(order.size(), start);
+
+	if (sum != 2 * keys.size()) {
+		std::cerr << "bench_map: flat_map lost entries" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	return r;
+}
+
+static void print(const std::string &name, size_t n, const result &r)
+{
+	std::cout << std::left << std::setw(34) << name
+		<< std::right << std::setw(9) << n
+		<< std::fixed << std::setprecision(2)
+		<< std::setw(10) << r.insert_mops
+		<< std::setw(10) << r.lookup_mops
+		<< std::setw(10) << r.erase_mops
+		<< std::setprecision(1)
+		<< std::setw(12) << r.bytes_per_entry << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<size_t> sizes = { 10000, 100000, 1000000 };
+	std::mt19937 rng(42);
+
+	std::cout << std::left << std::setw(34) << "map"
+		<< std::right << std::setw(9) << "entries"
+		<< std::setw(10) << "ins Mop/s"
+		<< std::setw(10) << "get Mop/s"
+		<< std::setw(10) << "del Mop/s"
+		<< std::setw(12) << "bytes/entry" << std::endl;
+
+	for (size_t n : sizes) {
+		std::vector<std::string> names;
+		std::vector<uint32_t> ids;
+		for (size_t i = 0; i < n; i++) {
+			names.push_back("host" + std::to_string(rng() % 10000) + "-" + std::to_string(i) + ".ibr.cs.tu-bs.de");
+			ids.push_back(static_cast<uint32_t>(i + 1));
+		}
+		std::vector<std::string> name_order = names;
+		std::vector<uint32_t> id_order = ids;
+		std::shuffle(name_order.begin(), name_order.end(), rng);
+		std::shuffle(id_order.begin(), id_order.end(), rng);
+
+		// the views point into names and name_order, like the symbol table
+		std::vector<std::string_view> refs(names.begin(), names.end());
+		std::vector<std::string_view> ref_order(name_order.begin(), name_order.end());
+
+		print("unordered_map<string, T*>", n,
+			run_unordered<std::unordered_map<std::string, void*, std::hash<std::string>,
+				std::equal_to<std::string>,
+				counting_allocator<std::pair<const std::string, void*>>>>(names, name_order));
+		print("flat_map<string_view, T*>", n,
+			run_flat<flat_map<std::string_view, void*>>(refs, ref_order));
+		print("unordered_map<symbol_id, T*>", n,
+			run_unordered<std::unordered_map<uint32_t, void*, std::hash<uint32_t>,
+				std::equal_to<uint32_t>,
+				counting_allocator<std::pair<const uint32_t, void*>>>>(ids, id_order));
+		print("flat_map<symbol_id, T*>", n,
+			run_flat<flat_map<uint32_t, void*>>(ids, id_order));
+	}
+
+	std::cout << "bytes/entry excludes heap storage of the key strings" << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# compares loopback tcp with unix sockets: a root and a child linked over
+# the transport, load clients on both nodes over the same transport. Each
+# round runs tcp and unix in turns and prints lines received, latency and
+# the cpu time of the two servers per line.
+# usage: bench_unix.sh [seconds] [clients per node] [base port]
+# RATE=n msgs/s per client, ROUNDS=n runs of each transport
+
+set -u
+set -e
+
+seconds=${1:-5}
+clients=${2:-50}
+base=${3:-6700}
+rate=${RATE:-20}
+rounds=${ROUNDS:-3}
+
+dir=`mktemp -d`
+servers=()
+
+cleanup() {
+  kill ${servers[@]} 2>/dev/null || true
+  rm -rf ${dir}
+}
+trap cleanup EXIT
+
+# runs the workload with the listen addresses of root and child
+workload() {
+  local root=$1 child=$2 root_host=$3 child_host=$4
+  servers=()
+  ./ibrcd -k ${root} -l warn & servers+=($!)
+  sleep 0.3
+  ./ibrcd -k ${child} -h ${root_host} -p ${root} -l warn & servers+=($!)
+  sleep 0.5
+  local loads=()
+  ./ibrcload -h ${root_host} -p ${root} -i 0 -c ${clients} -r ${rate} -d ${seconds} > ${dir}/load-0.txt &
+  loads+=($!)
+  ./ibrcload -h ${child_host} -p ${child} -i 1 -c ${clients} -r ${rate} -d ${seconds} > ${dir}/load-1.txt &
+  loads+=($!)
+  wait ${loads[@]}
+  local user=0 sys=0 stat
+  for pid in ${servers[@]}; do
+    read -a stat < /proc/${pid}/stat
+    user=$((user + stat[13]))
+    sys=$((sys + stat[14]))
+  done
+  kill ${servers[@]}
+  wait ${servers[@]} 2>/dev/null || true
+  servers=()
+  # fields of ibrcload: recv at 10, recv/s at 12, mean at 17, p99 at 23
+  awk -v user=${user} -v sys=${sys} -v hz=`getconf CLK_TCK` '{
+    recv += $10; rate += $12; mean += $17 * $10; if ($23 > p99) p99 = $23 } END {
+    cpu = (user + sys) / hz
+    printf "%d lines received, %d per s, latency mean %.1f us p99 %.1f us, servers %.2f cpu s, %.2f us per line\n",
+      recv, rate, (recv > 0 ? mean / recv : 0), p99, cpu, (recv > 0 ? cpu * 1e6 / recv : 0) }' ${dir}/load-*.txt
+}
+
+make -s ibrcd ibrcload
+
+for round in `seq ${rounds}`; do
+  echo "tcp:  `workload ${base} $((base + 1)) localhost localhost`"
+  echo "unix: `workload unix:${dir}/root.sock unix:${dir}/child.sock unix:${dir}/root.sock unix:${dir}/child.sock`"
+done
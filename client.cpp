@@ -1,6 +1,7 @@
 #include "client.hpp"
 #include "helpers.hpp"
 #include "data.hpp"
+#include "log.hpp"
 #include <iostream>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -12,8 +13,15 @@
 #include <sstream>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
 
-#define USAGE "usage: ibrcc <hostname>"
+#define USAGE "usage: ibrcc [-s script|-] [-r commands/s] [-v] <hostname|unix:path> [port]"
+
+/* a script gives up when its requests stay unanswered this long */
+#define SCRIPT_TIMEOUT_NS 5000000000ULL
 
 int main(int argc, char* argv[])
 {
@@ -24,20 +32,72 @@ int main(int argc, char* argv[])
 
 	std::string port = DEFAULT_PORT;
 	std::string host;
-	if (argc < 2) {
-		std::cerr << "ibrcc: too few arguments provided" << USAGE << std::endl;
+	std::string script_name;
+	double rate = 0;
+
+	int opt;
+	// the protocol log goes to stderr and is off unless asked for
+	logger::set_output(STDERR_FILENO);
+	logger::set_level(LOG_WARN);
+
+	while ((opt = getopt(argc, argv, "s:r:v")) != -1) {
+		switch (opt) {
+			case 'v':
+				logger::set_level(LOG_TRACE);
+				break;
+			case 's':
+				script_name = optarg;
+				break;
+			case 'r':
+				rate = std::stod(optarg);
+				break;
+			default:
+				std::cerr << USAGE << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	int args = argc - optind;
+	if (args < 1) {
+		std::cerr << "ibrcc: too few arguments provided" << std::endl << USAGE << std::endl;
 		exit(EXIT_FAILURE);
-	} else if (argc > 2) {
+	} else if (args > 2) {
 		std::cerr << "ibrcc: excess arguments" << std::endl << USAGE << std::endl;
 		exit(EXIT_FAILURE);
 	} else {
-		host = argv[1];
+		host = argv[optind];
+		if (args == 2) {
+			port = argv[optind + 1];
+		}
 	}
 
-	the_client = new client();
+	int script_fd = -1;
+	if (script_name == "-") {
+		script_fd = STDIN_FILENO;
+	} else if (script_name != "") {
+		script_fd = open(script_name.c_str(), O_RDONLY);
+		if (script_fd == -1) {
+			perror("open script");
+			exit(EXIT_FAILURE);
+		}
+	}
+	bool headless = script_fd != -1;
+
+	// in headless mode only the report goes to stdout
+	std::ostream out(std::cout.rdbuf());
+	if (headless) {
+		std::cout.setstate(std::ios::badbit);
+	}
+
+	the_client = new client(headless);
 
 	if (the_client->connect_client(host, port)) {
-		if (!(the_client->run())) {
+		if (headless) {
+			if (!(the_client->run_script(script_fd, rate))) {
+				std::cerr << "ibrcc: script aborted" << std::endl;
+			}
+			the_client->print_rtt(out);
+		} else if (!(the_client->run())) {
 			std::cerr << "oopsi" << std::endl;
 		}
 	} else {
@@ -55,9 +115,14 @@ void client::cleanup(int signum)
 	}
 }
 
-client::client()
+client::client(bool headless_mode)
 {
 	quit_bit = false;
+	headless = headless_mode;
+	script_eof = false;
+	commands_run = 0;
+	next_request_id = 1;
+	last_activity = 0;
 	sockfd = -1; // not 0, that would be stdout
 	current_channel = ""; // empty channel is no channel
 
@@ -67,7 +132,9 @@ client::client()
 	hostname = std::string(hostn);
 
 	conman = new connection_manager();
-	conman->add_socket(STDIN_FILENO, EPOLLFLAGS);
+	if (!headless) {
+		conman->add_socket(STDIN_FILENO, EPOLLFLAGS);
+	}
 }
 
 const char* client_exception::what() const throw()
@@ -89,10 +156,22 @@ bool client::send_message(std::string msg_name, std::string msg_payload)
 
 	std::stringstream msg;
 
-	msg << msg_name << " " << hostname << " " << msg_payload << std::endl;
+	uint64_t id = next_request_id++;
+	msg << "@" << id << " " << msg_name << " " << hostname << " " << msg_payload << std::endl;
 
 	const std::string msg_str = msg.str();
-	return conman->add_message(sockfd, msg_str);
+	if (!conman->add_message(sockfd, msg_str)) {
+		return false;
+	}
+
+	// PRIVMSG and SETTOPIC are only answered on failure, QUIT never
+	if (msg_name != "PRIVMSG" && msg_name != "SETTOPIC" && msg_name != "QUIT") {
+		last_activity = monotonic_ns();
+		pending_request &req = pending[id];
+		req.command = msg_name;
+		req.sent = last_activity;
+	}
+	return true;
 }
 
 bool client::set_nick(std::string new_nick)
@@ -175,29 +254,246 @@ bool client::run()
 					std::cerr << "invalid command. see HELP" << std::endl;
 				}
 			} else if (ev.data.fd == sockfd) {
+				process_socket_event(ev);
+			}
+		}
+		logger::flush();
+	}
+	return true;
+}
 
-				if (ev.events & EPOLLIN) {
-					if (conman->receive_messages(ev.data.fd)) {
-						std::string msg;
-						while (conman->fetch_message(ev.data.fd, msg)) {
-							process_message(msg);
-						}
-					} else {
-						conman->remove_socket(ev.data.fd);
-						std::cerr << "connection closed" << std::endl;
-					}
+bool client::process_socket_event(struct epoll_event &ev)
+{
+	if (ev.events & EPOLLIN) {
+		bool more;
+		if (conman->receive_messages(ev.data.fd, SIZE_MAX, more)) {
+			std::string msg;
+			while (conman->fetch_message(ev.data.fd, msg)) {
+				process_message(msg);
+			}
+		} else {
+			conman->remove_socket(ev.data.fd);
+			std::cerr << "connection closed" << std::endl;
+			return false;
+		}
+	}
+	// with edge triggering a write event that comes along with a read is not repeated
+	if (ev.events & EPOLLOUT) {
+		if (!conman->send_messages(ev.data.fd)) {
+			std::cerr << "failed to send messages from queue" << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
 
-				} else if (ev.events & EPOLLOUT) {
-					if (!conman->send_messages(ev.data.fd)) {
-						std::cerr << "failed to send messages from queue" << std::endl;
-					}
+void client::read_script(int fd)
+{
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		script_partial.append(buf, static_cast<size_t>(n));
+		size_t start = 0;
+		size_t end;
+		while ((end = script_partial.find('\n', start)) != std::string::npos) {
+			script.push_back(script_partial.substr(start, end - start));
+			start = end + 1;
+		}
+		script_partial.erase(0, start);
+	}
+
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		if (n == -1) {
+			perror("read script");
+		}
+		if (script_partial != "") {
+			script.push_back(script_partial);
+			script_partial.clear();
+		}
+		script_eof = true;
+	}
+}
+
+bool client::run_script(int fd, double rate)
+{
+	// regular files can not be polled, they are read at once
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		while (!script_eof) {
+			read_script(fd);
+		}
+	} else if (conman->add_socket(fd, EPOLLFLAGS) < 0) {
+		return false;
+	}
+
+	uint64_t interval = rate > 0 ? static_cast<uint64_t>(1e9 / rate) : 0;
+	uint64_t next_send = monotonic_ns();
+	last_activity = next_send;
+
+	while (!quit_bit) {
+		uint64_t now = monotonic_ns();
+		while (!quit_bit && !script.empty() && !waiting() && now >= next_send) {
+			std::string cmd = script.front();
+			script.pop_front();
+			commands_run++;
+			if (cmd != "" && !process_command(cmd)) {
+				std::cerr << "invalid command: " << cmd << std::endl;
+			}
+			// a late start may catch up one interval, not more
+			next_send = std::max(next_send + interval, now);
+		}
+
+		if (script_eof && script.empty() && pending_requests() == 0) {
+			break;
+		}
+		if (pending_requests() > 0 && monotonic_ns() > last_activity + SCRIPT_TIMEOUT_NS) {
+			std::cerr << "ibrcc: " << pending_requests() << " requests unanswered" << std::endl;
+			break;
+		}
+
+		int timeout = 100;
+		if (!script.empty() && !waiting()) {
+			uint64_t wait = next_send > now ? next_send - now : 0;
+			timeout = static_cast<int>(std::min<uint64_t>(wait / 1000000, 100));
+		}
+
+		if (conman->wait_events(timeout) == -1) {
+			return false;
+		}
+
+		struct epoll_event ev;
+		while (conman->next_event(ev)) {
+			if (ev.data.fd == fd) {
+				read_script(fd);
+				if (script_eof) {
+					conman->remove_socket(fd);
 				}
+			} else if (ev.events & EPOLLRDHUP || ev.events & EPOLLERR || ev.events & EPOLLHUP) {
+				conman->remove_socket(ev.data.fd);
+				return false;
+			} else if (ev.data.fd == sockfd && !process_socket_event(ev)) {
+				return false;
 			}
 		}
+		logger::flush();
+	}
+
+	if (!quit_bit) {
+		quit();
 	}
 	return true;
 }
 
+void client::track_reply(uint64_t id, const std::string &msg)
+{
+	std::istringstream msg_stream(msg);
+	std::string type, host;
+	if (!(msg_stream >> type >> host) || host != hostname) {
+		return;
+	}
+
+	if (type == "LISTPAGE") { // the LISTRES after the pages closes the request
+		return;
+	}
+
+	int code = 0;
+	if (type == "STATUS" && msg_stream >> code
+			&& (code == nick_unique || code == join_known_success || code == join_new_success)) {
+		// the NICKRES or CHANNEL that comes along closes the request
+		return;
+	}
+
+	if (id != 0) {
+		complete_request(id);
+		return;
+	}
+
+	// servers without request ids, match by command
+	if (type == "NICKRES") {
+		complete_oldest("NICK");
+	} else if (type == "CHANNEL") {
+		complete_oldest("JOIN");
+	} else if (type == "LISTRES") {
+		complete_oldest("LIST");
+	} else if (type == "TOPIC") {
+		complete_oldest("GETTOPIC");
+	} else if (type == "STATUS") {
+		switch (code) {
+			case connect_success:
+			case connect_error:
+				complete_oldest("CONNECT");
+				break;
+			case nick_not_unique:
+				complete_oldest("NICK");
+				break;
+			case nick_not_set:
+			case already_in_channel:
+				complete_oldest("JOIN");
+				break;
+			case leave_successful:
+				complete_oldest("LEAVE");
+				break;
+			case msg_delivered:
+				complete_oldest("MSG");
+				break;
+			case not_in_channel:
+			case no_such_channel:
+				// several commands fail this way, blame the oldest
+				complete_oldest("");
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+void client::complete_request(uint64_t id)
+{
+	auto found = pending.find(id);
+	if (found == pending.end()) {
+		return;
+	}
+	last_activity = monotonic_ns();
+	rtt[found->second.command].record(last_activity - found->second.sent);
+	pending.erase(found);
+}
+
+void client::complete_oldest(const std::string &cmd)
+{
+	for (auto &p : pending) {
+		if (cmd == "" || p.second.command == cmd) {
+			complete_request(p.first);
+			return;
+		}
+	}
+}
+
+size_t client::pending_requests() const
+{
+	return pending.size();
+}
+
+bool client::waiting() const
+{
+	for (auto &p : pending) {
+		const std::string &cmd = p.second.command;
+		if (cmd == "CONNECT" || cmd == "NICK" || cmd == "JOIN") {
+			return true;
+		}
+	}
+	return false;
+}
+
+void client::print_rtt(std::ostream &out) const
+{
+	out << "commands " << commands_run << " unanswered " << pending_requests() << std::endl;
+	for (auto &r : rtt) {
+		out << r.first << " rtt_us ";
+		r.second.print(out, 1000.0);
+		out << std::endl;
+	}
+}
+
 bool client::process_command(std::string &command)
 {
 	std::istringstream cmd_stream(command);
@@ -229,7 +525,7 @@ bool client::process_command(std::string &command)
 					std::cerr << "must be joined to channel";
 					return false;
 				} else {
-					return (leave_channel(current_channel) == 0);
+					return leave_channel(current_channel);
 				}
 				break;
 			case GETTOPIC:
@@ -265,7 +561,8 @@ bool client::process_command(std::string &command)
 				}
 				break;
 			case LIST:
-				return send_list();
+				cmd_stream >> par1 >> par2;
+				return send_list(par1, par2);
 				break;
 			case QUIT:
 				quit();
@@ -295,9 +592,9 @@ bool client::process_command(std::string &command)
 
 void client::process_message(std::string& msg)
 {
-	// TODO remove
-	std::cout << "receiving: " << msg;
-	//
+	uint64_t id = take_request_id(msg);
+	track_reply(id, msg);
+	LOG(LOG_TRACE, LOG_NET, "receiving: ", msg);
 	std::istringstream msg_stream(msg);
 	msg_type cmd;
 	std::string par1, par2, par3, par4;
@@ -313,6 +610,7 @@ void client::process_message(std::string& msg)
 						std::cout << "status: " << status << std::endl;
 					}
 					break;
+				case LISTPAGE:
 				case LISTRES:
 					std::cout << "listres: ";
 					while (msg_stream >> par2) {
@@ -360,7 +658,10 @@ void client::process_message(std::string& msg)
 	}
 }
 
-bool client::send_list()
+bool client::send_list(std::string prefix, std::string min_members)
 {
-	return send_message("LIST", "");
+	if (prefix.empty() && !min_members.empty()) {
+		prefix = "*";
+	}
+	return send_message("LIST", prefix + (min_members.empty() ? "" : " " + min_members));
 }
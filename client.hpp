@@ -4,6 +4,8 @@
 #include <string>
 #include <exception>
 #include <queue>
+#include <deque>
+#include <map>
 #include <istream>
 #include <sstream>
 #include <unistd.h>
@@ -41,12 +43,77 @@ class client
 		/* send queue */
 		std::queue<std::string> net_output;
 
+		/* no printing, commands come from a script instead of the terminal */
+		bool headless;
+
+		/* script lines not run yet */
+		std::deque<std::string> script;
+
+		/* script bytes after the last newline */
+		std::string script_partial;
+
+		/* the whole script has been read */
+		bool script_eof;
+
+		/* commands taken from the script */
+		uint64_t commands_run;
+
+		/* a request that waits for its reply */
+		struct pending_request
+		{
+			std::string command;
+
+			uint64_t sent;
+		};
+
+		/* id of the next request */
+		uint64_t next_request_id;
+
+		/* requests waiting for their reply by id, oldest first */
+		std::map<uint64_t, pending_request> pending;
+
+		/* round trip times per command in ns */
+		std::map<std::string, histogram> rtt;
+
+		/* last request sent or reply received */
+		uint64_t last_activity;
+
+		/* handles an event on the server socket */
+		bool process_socket_event(struct epoll_event &ev);
+
+		/* reads what is available of the script on fd */
+		void read_script(int fd);
+
+		/* matches a reply to the request it answers, by id if the
+		 * reply has one */
+		void track_reply(uint64_t id, const std::string &msg);
+
+		/* records the round trip of a request */
+		void complete_request(uint64_t id);
+
+		/* completes the oldest request of a command, of any command if
+		 * cmd is empty */
+		void complete_oldest(const std::string &cmd);
+
+		/* requests without reply */
+		size_t pending_requests() const;
+
+		/* the script has to wait for the reply to CONNECT, NICK or JOIN */
+		bool waiting() const;
+
 	public:
-		client();
+		client(bool headless_mode = false);
 
 		/* run the client */
 		bool run();
 
+		/* runs the commands read from fd without interaction, paced at
+		 * rate commands per second, 0 runs them as fast as possible */
+		bool run_script(int fd, double rate);
+
+		/* prints the round trip times of the script */
+		void print_rtt(std::ostream &out) const;
+
 		/* connects to a server */
 		bool connect_client(std::string host, std::string port);
 
@@ -77,8 +144,9 @@ class client
 		/* sends a private message to a client (nick) in a channel */
 		bool send_private_message(std::string recipient, std::string channel, std::string message);
 
-		/* sends a request for a list of all channels */
-		bool send_list();
+		/* sends a request for the channels whose names start with prefix
+		 * and that have at least min_members, all if both are empty */
+		bool send_list(std::string prefix = "", std::string min_members = "");
 
 		/* leaves the current channel, disconnects from the newtwork, stops the client */
 		void quit();
@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# starts a tree of ibrcd on localhost, puts ibrcload on every node and
+# prints one report line per node
+# usage: cluster.sh [depth] [fan-out] [clients per node] [seconds] [base port]
+# TRACE=n traces one in n client lines and writes trace.json
+
+set -u
+set -e
+
+depth=${1:-2}
+fanout=${2:-2}
+clients=${3:-10}
+seconds=${4:-5}
+base=${5:-6000}
+rate=${RATE:-10}
+trace=${TRACE:-}
+
+dir=`mktemp -d`
+servers=()
+loads=()
+
+cleanup() {
+  kill ${servers[@]} 2>/dev/null || true
+  rm -rf ${dir}
+}
+trap cleanup EXIT
+
+# node n listens on base+n, its parent is (n-1)/fanout
+first=0
+width=1
+for level in `seq 0 ${depth}`; do
+  for n in `seq ${first} $((first + width - 1))`; do
+    opts=""
+    if [ -n "${trace}" ]; then
+      opts="-t ${dir}/trace-${n}.json -T ${trace}"
+    fi
+    if [ ${n} -eq 0 ]; then
+      ./ibrcd -k ${base} ${opts} > ${dir}/ibrcd-${n}.log 2>&1 &
+    else
+      ./ibrcd -k $((base + n)) -h localhost -p $((base + (n - 1) / fanout)) ${opts} > ${dir}/ibrcd-${n}.log 2>&1 &
+    fi
+    servers+=($!)
+  done
+  sleep 0.5 # let the level listen before its children connect
+  first=$((first + width))
+  width=$((width * fanout))
+done
+nodes=${first}
+
+for n in `seq 0 $((nodes - 1))`; do
+  ./ibrcload -p $((base + n)) -i ${n} -c ${clients} -r ${rate} -d ${seconds} > ${dir}/load-${n}.txt &
+  loads+=($!)
+done
+wait ${loads[@]}
+
+echo "tree depth ${depth} fan-out ${fanout}, ${nodes} nodes, ${clients} clients per node at ${rate} msgs/s"
+cat ${dir}/load-*.txt | sort -n -k 2
+awk '{ sent += $8; recv += $10; rate += $12; n++ } END { printf "total sent %d received %d recv/s %d over %d nodes\n", sent, recv, rate, n }' ${dir}/load-*.txt
+
+if [ -n "${trace}" ]; then
+  sh trace_merge.sh ${dir}/trace-*.json > trace.json
+  echo "trace written to trace.json"
+fi
@@ -1,32 +1,118 @@
 #include "data.hpp"
 #include <unordered_map>
+#include <cstdlib>
+#include <sstream>
+#include <cctype>
+#include <algorithm>
 
-std::unordered_map<std::string, peer*> peer::nick_to_peer;
+flat_map<std::string_view, symbol_id> symbol::name_to_id;
 
-std::unordered_map<std::string, peer*> peer::host_to_peer;
+std::deque<std::string> symbol::names = { "" };
 
-std::unordered_map<std::string, channel*> channel::name_to_channel;
+std::vector<uint32_t> symbol::refs = { 0 };
 
-peer::peer(const int r, std::string name)
-	: route(r), host(name)
+std::vector<symbol_id> symbol::free_ids;
+
+symbol_id symbol::acquire(std::string_view name)
 {
-	host_to_peer[name] = this;
+	if (name.empty()) {
+		return 0;
+	}
+
+	auto found = name_to_id.find(name);
+	if (found != name_to_id.end()) {
+		refs[found->second]++;
+		return found->second;
+	}
+
+	symbol_id id;
+	if (!free_ids.empty()) {
+		id = free_ids.back();
+		free_ids.pop_back();
+	} else {
+		id = static_cast<symbol_id>(names.size());
+		names.push_back("");
+		refs.push_back(0);
+	}
+
+	names[id] = name;
+	name_to_id.emplace(std::string_view(names[id]), id);
+	refs[id] = 1;
+	return id;
 }
 
-peer::~peer()
+void symbol::release(symbol_id id)
 {
-	nick_to_peer.erase(nick);
+	if (id == 0 || id >= refs.size() || refs[id] == 0) {
+		return;
+	}
 
-	host_to_peer.erase(host);
+	if (--refs[id] == 0) {
+		name_to_id.erase(std::string_view(names[id]));
+		names[id].clear();
+		names[id].shrink_to_fit();
+		free_ids.push_back(id);
+	}
+}
+
+symbol_id symbol::find(std::string_view name)
+{
+	auto found = name_to_id.find(name);
+	if (found != name_to_id.end()) {
+		return found->second;
+	} else {
+		return 0;
+	}
+}
+
+const std::string &symbol::name(symbol_id id)
+{
+	if (id >= names.size()) {
+		return names[0];
+	}
+	return names[id];
+}
 
-	for (auto chan : channel::channel_list()) {
-		if (chan->in_channel(this)) {
-			chan->leave(this);
+size_t symbol::count()
+{
+	return names.size() - free_ids.size() - 1;
+}
+
+size_t symbol::memory_usage()
+{
+	size_t bytes = name_to_id.memory_usage()
+		+ names.size() * sizeof(std::string)
+		+ refs.capacity() * sizeof(uint32_t)
+		+ free_ids.capacity() * sizeof(symbol_id);
+	for (auto &n : names) {
+		if (n.capacity() > 15) { // longer names leave the small string buffer
+			bytes += n.capacity() + 1;
 		}
 	}
+	return bytes;
+}
+
+registry::registry()
+	: tracking(false), journaling(false)
+{
+}
+
+registry::~registry()
+{
+	for (auto chan : channel_list()) {
+		delete chan;
+	}
+
+	std::vector<peer*> peers;
+	for (auto p : host_to_peer) {
+		peers.push_back(p.second);
+	}
+	for (auto p : peers) {
+		delete p;
+	}
 }
 
-peer* peer::get(std::string name)
+peer* registry::get_peer(symbol_id name)
 {
 	auto found = nick_to_peer.find(name);
 	if (found != nick_to_peer.end()) {
@@ -36,7 +122,7 @@ peer* peer::get(std::string name)
 	}
 }
 
-peer* peer::get_by_host(std::string name)
+peer* registry::get_peer_by_host(symbol_id name)
 {
 	auto found = host_to_peer.find(name);
 	if (found != host_to_peer.end()) {
@@ -46,53 +132,352 @@ peer* peer::get_by_host(std::string name)
 	}
 }
 
-channel::channel(const std::string channel_name, peer *channel_op)
-	: name(channel_name), op(channel_op->host)
+std::set<peer*> registry::get_peers(int sock)
 {
-	name_to_channel[channel_name] = this;
+	std::set<peer*> peers;
+	for (auto a : host_to_peer) {
+		if (a.second->route == sock) {
+			peers.insert(a.second);
+		}
+	}
+	return peers;
+}
+
+channel* registry::get_channel(symbol_id chan_name)
+{
+	auto found = name_to_channel.find(chan_name);
+	if (found != name_to_channel.end()) {
+		return (*found).second;
+	} else {
+		return nullptr;
+	}
+}
+
+std::vector<channel*> registry::channel_list()
+{
+	std::vector<channel*> chan_names;
+
+	for (auto c : name_to_channel) {
+		chan_names.push_back(c.second);
+	}
+
+	return chan_names;
+}
+
+std::vector<peer*> registry::peer_list() const
+{
+	std::vector<peer*> peers;
+	for (auto p : host_to_peer) {
+		peers.push_back(p.second);
+	}
+	return peers;
+}
+
+void registry::memory_report(std::ostream &out) const
+{
+	// tree nodes of std::set and the hash nodes are estimated at 48 bytes
+	const size_t node = 48;
+	size_t peer_bytes = host_to_peer.memory_usage() + nick_to_peer.memory_usage();
+	for (auto p : host_to_peer) {
+		peer_bytes += sizeof(peer) + p.second->get_channels().capacity() * sizeof(channel*);
+	}
+	size_t channel_bytes = name_to_channel.memory_usage();
+	size_t members = 0;
+	for (auto c : name_to_channel) {
+		const channel *chan = c.second;
+		members += chan->members.size();
+		channel_bytes += sizeof(channel) + chan->topic.capacity()
+			+ (chan->members.size() + chan->routes.size() + chan->route_members.size()) * node
+			+ chan->route_members.bucket_count() * sizeof(void*);
+	}
+	out << "peers " << host_to_peer.size() << " (" << peer_bytes << " B)"
+		<< " channels " << name_to_channel.size() << " members " << members
+		<< " (" << channel_bytes << " B)"
+		<< " symbols " << symbol::count() << " (" << symbol::memory_usage() << " B)";
+}
+
+bool registry::is_in_channel(peer *p)
+{
+	return !p->get_channels().empty();
+}
+
+void registry::touch(symbol_id chan_name)
+{
+	if (tracking) {
+		changed.insert(symbol::name(chan_name));
+	}
+}
+
+void registry::track_channels(bool on)
+{
+	if (on && !tracking) {
+		for (auto c : name_to_channel) {
+			changed.insert(c.second->name());
+		}
+	} else if (!on) {
+		changed.clear();
+	}
+	tracking = on;
+}
+
+bool registry::tracks_channels() const
+{
+	return tracking;
+}
+
+bool registry::has_changes() const
+{
+	return !changed.empty();
+}
+
+std::set<std::string, std::less<>> registry::take_changes()
+{
+	std::set<std::string, std::less<>> taken;
+	taken.swap(changed);
+	return taken;
+}
+
+static void append_repl(std::string &out, const char *op, std::string_view a, std::string_view b,
+		std::string_view rest)
+{
+	out += "REPL ";
+	out += op;
+	out += ' ';
+	out += a;
+	if (!b.empty()) {
+		out += ' ';
+		out += b;
+	}
+	if (!rest.empty()) {
+		out += ' ';
+		out += rest;
+	}
+	out += '\n';
+}
+
+static std::string_view name_or_dash(symbol_id id)
+{
+	return id != 0 ? std::string_view(symbol::name(id)) : std::string_view("-");
+}
+
+void registry::record(const char *op, std::string_view a, std::string_view b, std::string_view rest)
+{
+	if (journaling) {
+		append_repl(journal, op, a, b, rest);
+	}
+}
+
+void registry::journal_changes(bool on)
+{
+	journal.clear();
+	journaling = on;
+}
+
+bool registry::has_journal() const
+{
+	return !journal.empty();
+}
+
+std::string registry::take_journal()
+{
+	std::string taken;
+	taken.swap(journal);
+	return taken;
+}
+
+std::string registry::snapshot()
+{
+	// the same lines the changes would have written, peers first
+	std::string out;
+	for (auto p : host_to_peer) {
+		const peer *known = p.second;
+		append_repl(out, "PEER", known->host(), name_or_dash(known->origin), {});
+		if (known->get_nick_id() != 0) {
+			append_repl(out, "NICK", known->host(), known->get_nick(), {});
+		}
+	}
+	for (auto c : name_to_channel) {
+		const channel *chan = c.second;
+		append_repl(out, "CHAN", chan->name(), name_or_dash(chan->op), chan->get_topic());
+		for (auto m : chan->get_members()) {
+			append_repl(out, "JOIN", chan->name(), m->host(), {});
+		}
+	}
+	return out;
+}
+
+void channel_directory::set(std::string_view name, size_t members, std::string_view topic)
+{
+	auto found = entries.find(name);
+	if (members == 0) {
+		if (found != entries.end()) {
+			entries.erase(found);
+		}
+		return;
+	}
+	if (found == entries.end()) {
+		found = entries.emplace_hint(found, std::string(name), directory_entry());
+	}
+	found->second.members = members;
+	found->second.topic = topic;
+}
+
+void channel_directory::clear()
+{
+	entries.clear();
+}
+
+size_t channel_directory::size() const
+{
+	return entries.size();
+}
+
+const std::map<std::string, directory_entry, std::less<>> &channel_directory::get_entries() const
+{
+	return entries;
+}
+
+bool channel_directory::page(std::string_view prefix, size_t min_members, std::string &after,
+		size_t limit, std::string &out) const
+{
+	auto e = after.empty() ? entries.lower_bound(prefix) : entries.upper_bound(after);
+	size_t n = 0;
+	for (; e != entries.end() && e->first.compare(0, prefix.size(), prefix) == 0; ++e) {
+		if (e->second.members < min_members) {
+			continue;
+		}
+		if (n == limit) {
+			return true;
+		}
+		out += ' ';
+		out += e->first;
+		after = e->first;
+		n++;
+	}
+	return false;
+}
+
+size_t channel_directory::memory_usage() const
+{
+	// map nodes are estimated at 48 bytes like in registry::memory_report
+	size_t bytes = 0;
+	for (auto &e : entries) {
+		bytes += 48 + sizeof(e) + e.first.capacity() + e.second.topic.capacity();
+	}
+	return bytes;
+}
+
+peer::peer(registry &known, const int r, std::string_view name, symbol_id origin_server)
+	: nick(0), reg(known), route(r), host_id(symbol::acquire(name)), origin(origin_server)
+{
+	reg.host_to_peer[host_id] = this;
+	if (origin != 0) {
+		symbol::acquire(symbol::name(origin));
+	}
+	reg.record("PEER", host(), name_or_dash(origin));
+}
+
+peer::~peer()
+{
+	if (nick != 0) {
+		reg.nick_to_peer.erase(nick);
+		symbol::release(nick);
+	}
+
+	reg.host_to_peer.erase(host_id);
+
+	while (!channels.empty()) {
+		channels.back()->leave(this);
+	}
+	reg.record("QUIT", host());
+
+	symbol::release(host_id);
+	if (origin != 0) {
+		symbol::release(origin);
+	}
+}
+
+const std::string &peer::host() const
+{
+	return symbol::name(host_id);
+}
+
+channel::channel(registry &known, std::string_view channel_name, peer *channel_op)
+	: reg(known), name_id(symbol::acquire(channel_name)), op(symbol::acquire(channel_op->host()))
+{
+	reg.name_to_channel[name_id] = this;
+	reg.touch(name_id);
+	reg.record("CHAN", name(), channel_op->host());
 	join(channel_op);
 	topic = "";
 }
 
 void channel::join(peer *member)
 {
-	members.insert(member);
+	if (members.insert(member).second) {
+		member->channels.push_back(this);
+		route_members[member->route]++;
+		changes++;
+		reg.touch(name_id);
+		reg.record("JOIN", name(), member->host());
+	}
 	routes.insert(member->route);
 }
 
 void channel::leave(peer *p)
 {
-	members.erase(p);
-
-	bool route_done = true;
-
-	for (auto m : members) {
-		if (m->route == p->route) {
-			route_done = false;
-			break;
-		}
+	if (members.erase(p) == 0) {
+		return;
+	}
+	reg.touch(name_id);
+	reg.record("LEAVE", name(), p->host());
+	changes++;
+
+	auto self = std::find(p->channels.begin(), p->channels.end(), this);
+	if (self != p->channels.end()) {
+		*self = p->channels.back();
+		p->channels.pop_back();
 	}
-	
-	if (route_done) {
+
+	auto count = route_members.find(p->route);
+	if (count != route_members.end() && --count->second == 0) {
+		route_members.erase(count);
 		routes.erase(p->route);
 	}
 }
 
-std::string channel::get_topic() const
+const std::string &channel::name() const
+{
+	return symbol::name(name_id);
+}
+
+const std::string &channel::get_topic() const
 {
 	return topic;
 }
 
-void channel::set_topic(std::string topic_text)
+void channel::set_topic(std::string_view topic_text)
 {
 	topic = topic_text;
+	reg.touch(name_id);
+	reg.record("TOPIC", name(), {}, topic);
 }
 
-std::set<int> channel::get_routes() const
+const std::set<int> &channel::get_routes() const
 {
 	return routes;
 }
 
+const std::set<peer*> &channel::get_members() const
+{
+	return members;
+}
+
+uint64_t channel::generation() const
+{
+	return changes;
+}
+
 void channel::subscribe(int peersock)
 {
 	routes.insert(peersock);
@@ -128,6 +513,15 @@ std::istream &operator>>(std::istream &in, msg_type &cmd) {
                         {"NICKRES", NICKRES},
                         {"CHANNEL", CHANNEL},
                         {"DELCHANNEL", DELCHANNEL},
+                        {"SERVER", SERVER},
+                        {"CONNECTS", CONNECTS},
+                        {"QUITS", QUITS},
+                        {"NETSPLIT", NETSPLIT},
+                        {"BURST", BURST},
+                        {"BURSTCHAN", BURSTCHAN},
+                        {"BURSTEND", BURSTEND},
+                        {"CHANINFO", CHANINFO},
+                        {"LISTPAGE", LISTPAGE},
 			{"connect", CONNECT},
 			{"disconnect", DISCONNECT},
                         {"nick", NICK},
@@ -152,6 +546,207 @@ std::istream &operator>>(std::istream &in, msg_type &cmd) {
 	return in;
 }
 
+bool parse_msg_type(std::string_view name, msg_type &cmd)
+{
+	static flat_map<std::string_view, msg_type> names;
+	static std::vector<std::string> lower;
+	if (names.empty()) {
+		lower.reserve(command_names.size());
+		for (size_t i = 0; i < command_names.size(); i++) {
+			std::string l = command_names[i];
+			for (auto &c : l) {
+				c = static_cast<char>(std::tolower(c));
+			}
+			lower.push_back(l);
+			names.emplace(std::string_view(command_names[i]), static_cast<msg_type>(i));
+			names.emplace(std::string_view(lower.back()), static_cast<msg_type>(i));
+		}
+	}
+	auto found = names.find(name);
+	if (found == names.end()) {
+		return false;
+	}
+	cmd = found->second;
+	return true;
+}
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+line_reader::line_reader(std::string_view line)
+	: begin(line.data()), pos(line.data()), end(line.data() + line.size())
+{
+}
+
+bool line_reader::next(std::string_view &field)
+{
+	while (pos < end && is_space(*pos)) {
+		pos++;
+	}
+	const char *start = pos;
+	while (pos < end && !is_space(*pos)) {
+		pos++;
+	}
+	field = std::string_view(start, static_cast<size_t>(pos - start));
+	return pos > start;
+}
+
+std::string_view line_reader::rest()
+{
+	const char *start = pos;
+	while (pos < end && *pos != '\n') {
+		pos++;
+	}
+	std::string_view line(start, static_cast<size_t>(pos - start));
+	if (pos < end) {
+		pos++;
+	}
+	return line;
+}
+
+size_t line_reader::offset() const
+{
+	return static_cast<size_t>(pos - begin);
+}
+
+uint64_t take_request_id(std::string &line)
+{
+	if (line.empty() || line[0] != '@') {
+		return 0;
+	}
+	size_t end = line.find(' ');
+	if (end == std::string::npos) {
+		return 0;
+	}
+	uint64_t id = std::strtoull(line.c_str() + 1, nullptr, 10);
+	line.erase(0, end + 1);
+	return id;
+}
+
+uint64_t trace_id_of(std::string_view line)
+{
+	if (line.empty() || line[0] != '@') {
+		return 0;
+	}
+	size_t end = line.find(' ');
+	size_t mark = line.find('~');
+	if (end == std::string_view::npos || mark == std::string_view::npos || mark > end) {
+		return 0;
+	}
+	// the id ends at the space, strtoull stops there
+	return std::strtoull(line.data() + mark + 1, nullptr, 16);
+}
+
+std::string add_trace_id(const std::string &line, uint64_t trace)
+{
+	std::ostringstream tag;
+	tag << "~" << std::hex << trace;
+	if (line.empty() || line[0] != '@') {
+		return "@0" + tag.str() + " " + line;
+	}
+	size_t end = line.find(' ');
+	if (end == std::string::npos || line.find('~') < end) {
+		return line;
+	}
+	std::string traced = line;
+	traced.insert(end, tag.str());
+	return traced;
+}
+
+/* the tag up to the first space, empty if the line has none */
+static std::string_view tag_of(std::string_view line)
+{
+	if (line.empty() || line[0] != '@') {
+		return {};
+	}
+	return line.substr(0, line.find(' '));
+}
+
+std::string_view msg_id_of(std::string_view line)
+{
+	std::string_view tag = tag_of(line);
+	size_t mark = tag.find('^');
+	if (mark == std::string_view::npos) {
+		return {};
+	}
+	tag.remove_prefix(mark + 1);
+	return tag.substr(0, tag.find('='));
+}
+
+std::string_view served_of(std::string_view line)
+{
+	std::string_view tag = tag_of(line);
+	size_t mark = tag.find('^');
+	size_t served = tag.find('=');
+	if (mark == std::string_view::npos || served == std::string_view::npos) {
+		return {};
+	}
+	return tag.substr(served + 1);
+}
+
+std::string add_msg_id(std::string_view line, std::string_view id, std::string_view served)
+{
+	std::string tagged;
+	tagged.reserve(line.size() + id.size() + served.size() + 5);
+	std::string_view tag = tag_of(line);
+	if (tag.empty()) {
+		tagged += "@0";
+	} else {
+		tagged += tag;
+		line.remove_prefix(tag.size() + 1);
+	}
+	tagged += '^';
+	tagged += id;
+	if (!served.empty()) {
+		tagged += '=';
+		tagged += served;
+	}
+	tagged += ' ';
+	tagged += line;
+	return tagged;
+}
+
+std::string without_served(std::string_view line, std::string_view name)
+{
+	std::string_view served = served_of(line);
+	std::string rest;
+	while (!served.empty()) {
+		std::string_view s = served.substr(0, served.find(','));
+		served.remove_prefix(std::min(served.size(), s.size() + 1));
+		if (s != name) {
+			rest += rest.empty() ? "" : ",";
+			rest += s;
+		}
+	}
+	std::string_view tag = tag_of(line);
+	size_t mark = tag.find('=');
+	std::string out(tag.substr(0, rest.empty() ? mark : mark + 1));
+	out += rest;
+	out += line.substr(tag.size());
+	return out;
+}
+
+std::string_view client_tag_of(std::string_view tag)
+{
+	std::string_view id = tag.substr(0, tag.find_first_of("~^"));
+	if (id == "@0" && id.size() < tag.size()) {
+		return {};
+	}
+	return id;
+}
+
+std::string client_reply(std::string_view line)
+{
+	std::string_view tag = tag_of(line);
+	std::string_view id = client_tag_of(tag);
+	std::string out(id);
+	// the space after the tag goes with it
+	out += line.substr(std::min(line.size(), tag.size() + (id.empty() && !tag.empty() ? 1 : 0)));
+	return out;
+}
+
 std::ostream &operator<<(std::ostream &out, const status_code &code)
 {
 	switch (code) {
@@ -209,6 +804,9 @@ std::ostream &operator<<(std::ostream &out, const status_code &code)
 		case privmsg_delivered:
 			out << "successfully delivered private message";
 			break;
+		case rate_limited:
+			out << "message dropped, sending too fast";
+			break;
 		case nick_not_set:
 			out << "nick not set. try NICK <name>";
 			break;
@@ -229,13 +827,37 @@ std::istream &operator>>(std::istream &in, status_code &status)
 	return in;
 }
 
+const std::string &peer::get_nick() const
+{
+	return symbol::name(nick);
+}
 
-std::string peer::get_nick() const
+symbol_id peer::get_nick_id() const
 {
 	return nick;
 }
 
-bool peer::set_nick(std::string nick_name)
+const std::vector<channel*> &peer::get_channels() const
+{
+	return channels;
+}
+
+void peer::reroute(int r)
+{
+	for (auto chan : channels) {
+		auto count = chan->route_members.find(route);
+		if (count != chan->route_members.end() && --count->second == 0) {
+			chan->route_members.erase(count);
+			chan->routes.erase(route);
+		}
+		chan->route_members[r]++;
+		chan->routes.insert(r);
+		chan->changes++;
+	}
+	route = r;
+}
+
+bool peer::set_nick(std::string_view nick_name)
 {
 	if (nick_name.size() > 9) {
 		return false;
@@ -246,22 +868,53 @@ bool peer::set_nick(std::string nick_name)
 		}
 	}
 
-	auto found = nick_to_peer.find(nick);
-	if (found != nick_to_peer.end()) {
-		nick_to_peer.erase(found);
+	symbol_id id = symbol::acquire(nick_name);
+
+	if (nick != 0) {
+		auto found = reg.nick_to_peer.find(nick);
+		if (found != reg.nick_to_peer.end() && found->second == this) {
+			reg.nick_to_peer.erase(found);
+		}
+		symbol::release(nick);
 	}
 
-	nick_to_peer[nick_name] = this;
-	nick = nick_name;
+	reg.nick_to_peer[id] = this;
+	nick = id;
+	reg.record("NICK", host(), nick_name);
 	return true;
 }
 
+void peer::clear_nick()
+{
+	if (nick == 0) {
+		return;
+	}
+	auto found = reg.nick_to_peer.find(nick);
+	if (found != reg.nick_to_peer.end() && found->second == this) {
+		reg.nick_to_peer.erase(found);
+	}
+	symbol::release(nick);
+	nick = 0;
+	reg.record("NICK", host(), "-");
+}
+
 channel::~channel()
 {
-	auto found = name_to_channel.find(name);
-	if (found != name_to_channel.end()) {
-		name_to_channel.erase(found);
+	for (auto m : members) {
+		auto self = std::find(m->channels.begin(), m->channels.end(), this);
+		if (self != m->channels.end()) {
+			*self = m->channels.back();
+			m->channels.pop_back();
+		}
+	}
+	auto found = reg.name_to_channel.find(name_id);
+	if (found != reg.name_to_channel.end() && found->second == this) {
+		reg.name_to_channel.erase(found);
+		reg.touch(name_id);
+		reg.record("DELCHAN", name());
 	}
+	symbol::release(name_id);
+	symbol::release(op);
 }
 
 bool channel::check_subscribed(int sockfd)
@@ -274,63 +927,21 @@ void channel::unsubscribe(int sockfd)
 	routes.erase(sockfd);
 }
 
-std::vector<channel*> channel::channel_list()
-{
-	std::vector<channel*> chan_names;
-
-	for (auto c : name_to_channel) {
-		chan_names.push_back(c.second);
-	}
-
-	return chan_names;
-}
-
-channel::channel(std::string topic_string, const std::string channel_name, const std::string channel_op)
-	: topic(topic_string), name(channel_name), op(channel_op)
+channel::channel(registry &known, std::string_view topic_string, std::string_view channel_name, std::string_view channel_op)
+	: topic(topic_string), reg(known), name_id(symbol::acquire(channel_name)), op(symbol::acquire(channel_op))
 {
-	name_to_channel[channel_name] = this;
-	peer *op_peer = peer::get_by_host(channel_op);
+	reg.name_to_channel[name_id] = this;
+	reg.touch(name_id);
+	reg.record("CHAN", name(), name_or_dash(op), topic);
+	peer *op_peer = reg.get_peer_by_host(op);
 	if (op_peer != nullptr) {
 		join(op_peer);
 	}
 }
 
-channel * channel::get(std::string chan_name)
-{
-	auto found = name_to_channel.find(chan_name);
-	if (found != name_to_channel.end()) {
-		return (*found).second;
-	} else {
-		return nullptr;
-	}
-}
-
 bool channel::in_channel(peer *p)
 {
 	auto found = members.find(p);
 
 	return found != members.end();
 }
-
-std::set<peer*> peer::get_peers(int sock)
-{
-	std::set<peer*> peers;
-	for (auto a : host_to_peer) {
-		if (a.second->route == sock) {
-			peers.insert(a.second);
-		}
-	}
-	return peers;
-}
-
-bool channel::is_in_channel(peer *p)
-{
-	for (auto c : name_to_channel) {
-		for (auto a : c.second->members) {
-			if (a == p) {
-				return true;
-			}
-		}
-	}
-	return false;
-}
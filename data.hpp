@@ -2,41 +2,181 @@
 #define DATA_HPP
 
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <exception>
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <set>
+#include <cstdint>
+#include <deque>
+#include "flat_map.hpp"
 
 #define DEFAULT_PORT "5001"
 
+/* id of an interned name, 0 is the empty name */
+typedef uint32_t symbol_id;
+
+/* global table of interned hostnames, nicks and channel names */
+class symbol
+{
+	private:
+		/* keys point into names */
+		static flat_map<std::string_view, symbol_id> name_to_id;
+
+		/* indexed by id, a deque so the strings never move */
+		static std::deque<std::string> names;
+
+		static std::vector<uint32_t> refs;
+
+		static std::vector<symbol_id> free_ids;
+
+	public:
+		/* interns name and takes a reference on it */
+		static symbol_id acquire(std::string_view name);
+
+		/* drops a reference, the id is reused when none are left */
+		static void release(symbol_id id);
+
+		/* returns the id of name without interning it, 0 if unknown */
+		static symbol_id find(std::string_view name);
+
+		static const std::string &name(symbol_id id);
+
+		/* names in use and bytes held by the table */
+		static size_t count();
+
+		static size_t memory_usage();
+};
+
+class peer;
+
+class channel;
+
+/* the peers and channels known to one server */
+class registry
+{
+	private:
+		flat_map<symbol_id, peer*> nick_to_peer;
+
+		flat_map<symbol_id, peer*> host_to_peer;
+
+		flat_map<symbol_id, channel*> name_to_channel;
+
+		/* names of channels created, deleted or changed since the last
+		 * take_changes, kept while tracking */
+		std::set<std::string, std::less<>> changed;
+
+		bool tracking;
+
+		/* REPL lines of the changes since the last take_journal, kept
+		 * while journaling */
+		std::string journal;
+
+		bool journaling;
+
+		void touch(symbol_id chan_name);
+
+		/* appends "REPL <op> <a> [<b>] [<rest>]" to the journal */
+		void record(const char *op, std::string_view a, std::string_view b = {},
+				std::string_view rest = {});
+
+		friend class peer;
+
+		friend class channel;
+
+	public:
+		registry();
+
+		/* deletes all peers and channels still registered */
+		~registry();
+
+		registry(const registry &) = delete;
+
+		registry &operator=(const registry &) = delete;
+
+		peer* get_peer(symbol_id nick_name);
+
+		peer* get_peer_by_host(symbol_id host);
+
+		std::set<peer*> get_peers(int sock);
+
+		channel* get_channel(symbol_id name);
+
+		std::vector<channel*> channel_list();
+
+		std::vector<peer*> peer_list() const;
+
+		bool is_in_channel(peer *p);
+
+		/* starts or stops collecting changed channels, starting marks
+		 * every known channel as changed */
+		void track_channels(bool on);
+
+		bool tracks_channels() const;
+
+		bool has_changes() const;
+
+		/* changed channels since the last call */
+		std::set<std::string, std::less<>> take_changes();
+
+		/* starts or stops writing every change of a peer or channel to
+		 * the journal, both clear it */
+		void journal_changes(bool on);
+
+		bool has_journal() const;
+
+		/* REPL lines of the changes since the last call */
+		std::string take_journal();
+
+		/* REPL lines that build all peers and channels known here */
+		std::string snapshot();
+
+		/* writes counts and estimated bytes of peers, channels and symbols */
+		void memory_report(std::ostream &out) const;
+};
+
 class peer
 {
 	private:
-		std::string nick;
+		symbol_id nick;
+
+		registry &reg;
 
-		static std::unordered_map<std::string, peer*> nick_to_peer;
+		/* channels the peer is in, kept by channel::join and leave */
+		std::vector<channel*> channels;
 
-		static std::unordered_map<std::string, peer*> host_to_peer;
+		friend class channel;
 
 	public:
-		const int route;
+		/* changed only by reroute */
+		int route;
 
-		const std::string host;
+		const symbol_id host_id;
 
-		peer(const int route_to_next_hop, std::string hostname);
+		/* name of the server the client is attached to, 0 if unknown */
+		const symbol_id origin;
+
+		peer(registry &known, const int route_to_next_hop, std::string_view hostname, symbol_id origin_server = 0);
 
 		~peer();
 
-		std::string get_nick() const;
+		const std::string &host() const;
+
+		const std::string &get_nick() const;
+
+		symbol_id get_nick_id() const;
 
-		bool set_nick(std::string nick_name);
+		bool set_nick(std::string_view nick_name);
 
-		static peer* get(std::string nick_name);
+		/* the peer has no nick any more */
+		void clear_nick();
 
-		static peer* get_by_host(std::string host);
+		const std::vector<channel*> &get_channels() const;
 
-		static std::set<peer*> get_peers(int sock);
+		/* moves the peer to another route, its channels follow */
+		void reroute(int route_to_next_hop);
 };
 
 std::ostream& operator <<(std::ostream& outs, const peer &a);
@@ -50,22 +190,40 @@ class channel
 
 		std::set<peer*> members = {};
 
-		static std::unordered_map<std::string, channel*> name_to_channel;
+		/* members behind each route, a route is dropped with its last member */
+		std::unordered_map<int, size_t> route_members;
+
+		/* counts joins, leaves and reroutes of members */
+		uint64_t changes = 0;
+
+		friend class registry;
+
+		friend class peer;
+
+		registry &reg;
 	public:
-		const std::string name;
-		const std::string op; // host of op
+		const symbol_id name_id;
+		const symbol_id op; // host of op
+
+		const std::string &name() const;
 
-		channel(const std::string channel_name, peer *channel_op);
+		channel(registry &known, std::string_view channel_name, peer *channel_op);
 
-		channel(const std::string channel_name, const std::string channel_op, std::string topic);
+		/* a channel announced by the parent, op is a host */
+		channel(registry &known, std::string_view topic, std::string_view channel_name, std::string_view channel_op);
 
 		~channel();
 
-		std::string get_topic() const;
+		const std::string &get_topic() const;
+
+		void set_topic(std::string_view topic);
 
-		void set_topic(std::string topic);
+		const std::set<int> &get_routes() const;
 
-		std::set<int> get_routes() const;
+		const std::set<peer*> &get_members() const;
+
+		/* changes whenever a member comes, goes or moves to another route */
+		uint64_t generation() const;
 
 		void join(peer *p);
 
@@ -78,12 +236,42 @@ class channel
 		void unsubscribe(int sockfd);
 
 		bool check_subscribed(int sockfd);
+};
+
+/* size and topic of a channel as the root announced them */
+struct directory_entry
+{
+	size_t members;
+
+	std::string topic;
+};
+
+/* every channel in the network by name, kept by each server so LIST is
+ * answered without asking the root */
+class channel_directory
+{
+	private:
+		/* std::less<> finds names by std::string_view */
+		std::map<std::string, directory_entry, std::less<>> entries;
+
+	public:
+		/* adds or updates a channel, 0 members removes it */
+		void set(std::string_view name, size_t members, std::string_view topic);
+
+		void clear();
 
-		static bool is_in_channel(peer *p);
+		size_t size() const;
 
-		static channel* get(std::string);
+		const std::map<std::string, directory_entry, std::less<>> &get_entries() const;
 
-		static std::vector<channel*> channel_list();
+		/* appends " <name>" for at most limit channels after the name in
+		 * after that start with prefix and have at least min_members, after
+		 * is moved to the last one. true if more follow */
+		bool page(std::string_view prefix, size_t min_members, std::string &after,
+				size_t limit, std::string &out) const;
+
+		/* estimated bytes, like registry::memory_report */
+		size_t memory_usage() const;
 };
 
 enum status_code
@@ -107,6 +295,7 @@ enum status_code
 	no_such_client = 601,
 	no_such_client_in_channel = 603,
 	privmsg_delivered = 604,
+	rate_limited = 605,
 };
 
 std::ostream &operator<<(std::ostream &out, const status_code &code);
@@ -139,6 +328,25 @@ enum msg_type
 	TOPIC,
 	NICKRES,
 	DELCHANNEL,
+	SERVER,
+	CONNECTS,
+	QUITS,
+	NETSPLIT,
+	BURST,
+	BURSTCHAN,
+	BURSTEND,
+	CHANINFO,
+	LISTPAGE,
+	STANDBY,
+	REPL,
+	REPLACK,
+	LINKPING,
+	LINKPONG,
+	TOPO,
+	PLACE,
+	PLACERES,
+	MOVED,
+	SHORTCUT,
 };
 
 static std::vector<std::string> command_names = {
@@ -156,15 +364,95 @@ static std::vector<std::string> command_names = {
 		"QUIT",
 		"HELP",
 		"STATUS",
+		"CHANNEL",
 		"TOPIC",
 		"NICKRES",
-		"CHANNEL",
 		"DELCHANNEL",
+		"SERVER",
+		"CONNECTS",
+		"QUITS",
+		"NETSPLIT",
+		"BURST",
+		"BURSTCHAN",
+		"BURSTEND",
+		"CHANINFO",
+		"LISTPAGE",
+		"STANDBY",
+		"REPL",
+		"REPLACK",
+		"LINKPING",
+		"LINKPONG",
+		"TOPO",
+		"PLACE",
+		"PLACERES",
+		"MOVED",
+		"SHORTCUT",
 		};
 
 std::ostream &operator<<(std::ostream &out, const msg_type &cmd);
 
 std::istream &operator>>(std::istream &in, msg_type &cmd);
 
+/* looks up a message type by name, false for unknown names */
+bool parse_msg_type(std::string_view name, msg_type &cmd);
+
+/* reads the fields of a line in place, like operator>> on a stream but
+ * without copying the line. The line must outlive the reader. */
+class line_reader
+{
+	private:
+		const char *begin;
+
+		const char *pos;
+
+		const char *end;
+
+	public:
+		line_reader(std::string_view line);
+
+		/* next whitespace separated field, false at the end of the line */
+		bool next(std::string_view &field);
+
+		/* the rest of the line up to the newline, like std::getline */
+		std::string_view rest();
+
+		/* bytes read so far */
+		size_t offset() const;
+};
+
+/* a line may start with "@<id> ", the id a client gave its request. Replies
+ * to the request start with the same id. Removes the id from line and
+ * returns it, 0 if the line has none. */
+uint64_t take_request_id(std::string &line);
+
+/* sampled lines carry a trace id after the request id, "@<id>~<trace> ",
+ * so every server on their way can record them. Returns 0 if the line has
+ * no trace id. */
+uint64_t trace_id_of(std::string_view line);
+
+/* line with the trace id added to its request id */
+std::string add_trace_id(const std::string &line, uint64_t trace);
+
+/* MSG lines of servers with shortcuts carry a message id after the request
+ * and trace id, "@<id>^<server>/<seq>", and the servers that got the line
+ * over a shortcut, "=<server>,<server>". Both are empty if the line has
+ * none, views into line. */
+std::string_view msg_id_of(std::string_view line);
+
+std::string_view served_of(std::string_view line);
+
+/* line with a message id and servers served added to its request id */
+std::string add_msg_id(std::string_view line, std::string_view id, std::string_view served);
+
+/* line with name removed from the servers served */
+std::string without_served(std::string_view line, std::string_view name);
+
+/* the request id of a tag as the client sent it, without trace and message
+ * id. Empty if the client sent none, the servers use @0 then */
+std::string_view client_tag_of(std::string_view tag);
+
+/* line as a client gets it, the tag cut to the request id */
+std::string client_reply(std::string_view line);
+
 
 #endif /* DATA_HPP */
@@ -0,0 +1,370 @@
+#include "fanout.hpp"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define WORKER_EVENTS 64
+
+fanout_worker::fanout_worker(unsigned worker_id, unsigned n_workers, int notify)
+	: id(worker_id), count(n_workers), notify_fd(notify), sleeping(false),
+	jobs(FANOUT_MAILBOX), reports(FANOUT_MAILBOX)
+{
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1) {
+		perror("epoll_create1");
+	}
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1) {
+		perror("eventfd");
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = wake_fd;
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wake_fd, &ev) != 0) {
+		perror("epoll_ctl: add wake fd failed.");
+	}
+}
+
+fanout_worker::~fanout_worker()
+{
+	::close(wake_fd);
+	::close(epollfd);
+}
+
+void fanout_worker::start()
+{
+	thread = std::thread(&fanout_worker::run, this);
+}
+
+void fanout_worker::join()
+{
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+void fanout_worker::wake()
+{
+	// pairs with the fence in run, one of both sees the other
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) {
+		uint64_t one = 1;
+		if (write(wake_fd, &one, sizeof one) == -1) {
+			perror("write");
+		}
+	}
+}
+
+void fanout_worker::report(int sock, bool closed)
+{
+	fanout_report r;
+	r.sock = sock;
+	r.closed = closed;
+	while (!reports.push(std::move(r))) {
+		std::this_thread::yield();
+	}
+	uint64_t one = 1;
+	if (write(notify_fd, &one, sizeof one) == -1) {
+		perror("write");
+	}
+}
+
+void fanout_worker::append(int sock, const std::string &line, traffic_class cls, uint64_t now)
+{
+	buffer &b = pending[sock];
+	if (b.failed) {
+		return;
+	}
+	if (b.lines.empty() && !b.blocked) {
+		b.lines.weighted = links.count(sock) != 0;
+		dirty.push_back(sock);
+	}
+	b.lines.push(line, cls, now);
+}
+
+void fanout_worker::flush(int sock)
+{
+	auto found = pending.find(sock);
+	if (found == pending.end()) {
+		return;
+	}
+	buffer &b = found->second;
+	if (b.blocked || b.failed) {
+		return;
+	}
+
+	int err;
+	{
+		std::lock_guard<std::mutex> hold(delays_lock);
+		err = b.lines.flush(sock, delays, nullptr);
+	}
+	if (err == 0) {
+		pending.erase(found);
+	} else if (err == EAGAIN || err == EWOULDBLOCK) {
+		b.lines.compact();
+		b.blocked = true;
+		struct epoll_event ev;
+		ev.events = EPOLLOUT | EPOLLET;
+		ev.data.fd = sock;
+		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) != 0 && errno != EEXIST) {
+			perror("epoll_ctl: add sockfd failed.");
+		}
+	} else {
+		// the reader closes the socket, its lines are dropped until then
+		b.failed = true;
+		b.lines = out_queue();
+		report(sock, false);
+	}
+}
+
+void fanout_worker::add_delays(histogram *merged) const
+{
+	std::lock_guard<std::mutex> hold(delays_lock);
+	for (int cls = 0; cls < TRAFFIC_CLASSES; cls++) {
+		merged[cls].merge(delays[cls]);
+	}
+}
+
+void fanout_worker::add_unsent(std::unordered_map<int, std::string> &unsent) const
+{
+	for (auto &p : pending) {
+		if (!p.second.failed && !p.second.lines.empty()) {
+			unsent[p.first] += p.second.lines.unsent();
+		}
+	}
+}
+
+bool fanout_worker::handle(fanout_job &job)
+{
+	switch (job.kind) {
+		case fanout_job::SEND:
+			append(job.sock, *job.line, job.cls, monotonic_ns());
+			break;
+		case fanout_job::BROADCAST: {
+			uint64_t now = monotonic_ns();
+			for (int sock : *job.socks) {
+				if (static_cast<unsigned>(sock) % count == id) {
+					append(sock, *job.line, job.cls, now);
+				}
+			}
+			break;
+		}
+		case fanout_job::LINK: {
+			links.insert(job.sock);
+			auto found = pending.find(job.sock);
+			if (found != pending.end()) {
+				found->second.lines.weighted = true;
+			}
+			break;
+		}
+		case fanout_job::CLOSE:
+			flush(job.sock); // once, what does not fit is lost like before
+			if (pending.find(job.sock) != pending.end()) {
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, job.sock, nullptr);
+				pending.erase(job.sock);
+			}
+			links.erase(job.sock);
+			if (::close(job.sock) == -1) {
+				perror("close");
+			}
+			report(job.sock, true);
+			break;
+		case fanout_job::STOP:
+			return false;
+	}
+	return true;
+}
+
+void fanout_worker::run()
+{
+	struct epoll_event events[WORKER_EVENTS];
+	fanout_job job;
+	bool running = true;
+
+	while (running) {
+		while (running && jobs.pop(job)) {
+			running = handle(job);
+		}
+		// one send per socket for all lines of the round
+		for (int sock : dirty) {
+			flush(sock);
+		}
+		dirty.clear();
+		if (!running) {
+			break;
+		}
+
+		sleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!jobs.empty()) {
+			sleeping.store(false);
+			continue;
+		}
+		int n = epoll_wait(epollfd, events, WORKER_EVENTS, -1);
+		sleeping.store(false);
+		for (int i = 0; i < n; i++) {
+			int sock = events[i].data.fd;
+			if (sock == wake_fd) {
+				uint64_t value;
+				while (read(wake_fd, &value, sizeof value) > 0) {
+				}
+				continue;
+			}
+			auto found = pending.find(sock);
+			if (found != pending.end() && found->second.blocked) {
+				found->second.blocked = false;
+				dirty.push_back(sock);
+			}
+		}
+	}
+}
+
+fanout_pool::fanout_pool(unsigned n_workers)
+{
+	notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notify_fd == -1) {
+		perror("eventfd");
+	}
+	for (unsigned i = 0; i < n_workers; i++) {
+		workers.push_back(new fanout_worker(i, n_workers, notify_fd));
+	}
+	for (auto w : workers) {
+		w->start();
+	}
+}
+
+void fanout_pool::hand_over(std::unordered_map<int, std::string> &unsent)
+{
+	for (unsigned i = 0; i < workers.size(); i++) {
+		fanout_job stop;
+		stop.kind = fanout_job::STOP;
+		stop.sock = -1;
+		push(i, std::move(stop));
+	}
+	for (auto w : workers) {
+		w->join();
+		w->add_unsent(unsent);
+		delete w;
+	}
+	workers.clear();
+}
+
+fanout_pool::~fanout_pool()
+{
+	for (unsigned i = 0; i < workers.size(); i++) {
+		fanout_job stop;
+		stop.kind = fanout_job::STOP;
+		stop.sock = -1;
+		push(i, std::move(stop));
+	}
+	for (auto w : workers) {
+		w->join();
+		delete w;
+	}
+	::close(notify_fd);
+}
+
+unsigned fanout_pool::size() const
+{
+	return static_cast<unsigned>(workers.size());
+}
+
+int fanout_pool::notify_socket() const
+{
+	return notify_fd;
+}
+
+void fanout_pool::push(unsigned worker, fanout_job &&job)
+{
+	fanout_worker *w = workers[worker];
+	while (!w->jobs.push(std::move(job))) {
+		// the worker may wait for its reports to be taken
+		fanout_report r;
+		for (auto other : workers) {
+			while (other->reports.pop(r)) {
+				backlog.push_back(r);
+			}
+		}
+		w->wake();
+		std::this_thread::yield();
+	}
+	w->wake();
+}
+
+void fanout_pool::send(int sock, std::string line, traffic_class cls)
+{
+	fanout_job job;
+	job.kind = fanout_job::SEND;
+	job.sock = sock;
+	job.cls = cls;
+	job.line = std::make_shared<const std::string>(std::move(line));
+	push(static_cast<unsigned>(sock) % size(), std::move(job));
+}
+
+void fanout_pool::broadcast(std::vector<int> socks, std::string line, traffic_class cls)
+{
+	std::vector<bool> owns(workers.size(), false);
+	for (int sock : socks) {
+		owns[static_cast<unsigned>(sock) % size()] = true;
+	}
+	auto shared_socks = std::make_shared<const std::vector<int>>(std::move(socks));
+	auto shared_line = std::make_shared<const std::string>(std::move(line));
+	for (unsigned i = 0; i < workers.size(); i++) {
+		if (owns[i]) {
+			fanout_job job;
+			job.kind = fanout_job::BROADCAST;
+			job.sock = -1;
+			job.cls = cls;
+			job.line = shared_line;
+			job.socks = shared_socks;
+			push(i, std::move(job));
+		}
+	}
+}
+
+void fanout_pool::close(int sock)
+{
+	fanout_job job;
+	job.kind = fanout_job::CLOSE;
+	job.sock = sock;
+	push(static_cast<unsigned>(sock) % size(), std::move(job));
+}
+
+void fanout_pool::set_link(int sock)
+{
+	fanout_job job;
+	job.kind = fanout_job::LINK;
+	job.sock = sock;
+	push(static_cast<unsigned>(sock) % size(), std::move(job));
+}
+
+void fanout_pool::delays(histogram *merged) const
+{
+	for (auto w : workers) {
+		w->add_delays(merged);
+	}
+}
+
+bool fanout_pool::next_report(fanout_report &r)
+{
+	if (backlog.empty()) {
+		uint64_t value;
+		while (read(notify_fd, &value, sizeof value) > 0) {
+		}
+		for (auto w : workers) {
+			fanout_report got;
+			while (w->reports.pop(got)) {
+				backlog.push_back(got);
+			}
+		}
+	}
+	if (backlog.empty()) {
+		return false;
+	}
+	r = backlog.front();
+	backlog.pop_front();
+	return true;
+}
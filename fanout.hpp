@@ -0,0 +1,182 @@
+#ifndef FANOUT_HPP
+#define FANOUT_HPP
+
+#include "mailbox.hpp"
+#include "helpers.hpp"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define FANOUT_MAILBOX 4096 // jobs waiting per worker
+
+/* work for one writer thread */
+struct fanout_job
+{
+	enum job_kind
+	{
+		SEND, // line to sock
+		BROADCAST, // line to each socket in socks that the worker owns
+		CLOSE, // close sock after the lines before
+		LINK, // sock leads to another server
+		STOP,
+	};
+
+	job_kind kind;
+
+	int sock;
+
+	traffic_class cls;
+
+	std::shared_ptr<const std::string> line;
+
+	std::shared_ptr<const std::vector<int>> socks;
+};
+
+/* from a writer thread: sending to sock failed, or sock is closed */
+struct fanout_report
+{
+	int sock;
+
+	bool closed;
+};
+
+/* one writer thread with its own epoll set for sockets it has to wait on */
+class fanout_worker
+{
+	private:
+		struct buffer
+		{
+			out_queue lines;
+
+			/* waiting for EPOLLOUT */
+			bool blocked;
+
+			/* send failed, lines are dropped until CLOSE */
+			bool failed;
+		};
+
+		const unsigned id;
+
+		const unsigned count;
+
+		int epollfd;
+
+		/* wakes the thread when jobs arrive */
+		int wake_fd;
+
+		/* shared with the pool, written when reports arrive */
+		const int notify_fd;
+
+		/* lines not yet sent, per socket */
+		std::unordered_map<int, buffer> pending;
+
+		/* sockets with new lines in this round */
+		std::vector<int> dirty;
+
+		/* sockets with weighted queues */
+		std::unordered_set<int> links;
+
+		/* time from queued to sent by traffic class */
+		histogram delays[TRAFFIC_CLASSES];
+
+		mutable std::mutex delays_lock;
+
+		/* set while the thread waits in epoll_wait */
+		std::atomic<bool> sleeping;
+
+		std::thread thread;
+
+		void append(int sock, const std::string &line, traffic_class cls, uint64_t now);
+
+		/* sends what is pending for sock */
+		void flush(int sock);
+
+		void report(int sock, bool closed);
+
+		/* handles one job, false for STOP */
+		bool handle(fanout_job &job);
+
+		void run();
+
+	public:
+		mailbox<fanout_job> jobs;
+
+		mailbox<fanout_report> reports;
+
+		fanout_worker(unsigned worker_id, unsigned n_workers, int notify);
+
+		~fanout_worker();
+
+		/* starts the thread */
+		void start();
+
+		/* producer side, wakes the thread if it sleeps */
+		void wake();
+
+		/* waits for the thread after a STOP job */
+		void join();
+
+		/* adds the queueing delays so far to merged */
+		void add_delays(histogram *merged) const;
+
+		/* the lines not sent by sock, once the thread has stopped */
+		void add_unsent(std::unordered_map<int, std::string> &unsent) const;
+};
+
+/* threads that write to sockets. Socket s belongs to worker s % n, which
+ * does every write to it, so the lines of a class to one socket keep their order and
+ * the thread that reads never blocks on a large fan-out. All calls come
+ * from one thread. */
+class fanout_pool
+{
+	private:
+		std::vector<fanout_worker*> workers;
+
+		/* readable while workers have reports */
+		int notify_fd;
+
+		/* reports taken while waiting for a full mailbox */
+		std::deque<fanout_report> backlog;
+
+		/* worker to hand jobs to, waits while its mailbox is full */
+		void push(unsigned worker, fanout_job &&job);
+
+	public:
+		explicit fanout_pool(unsigned n_workers);
+
+		~fanout_pool();
+
+		unsigned size() const;
+
+		/* fd to poll for reports */
+		int notify_socket() const;
+
+		void send(int sock, std::string line, traffic_class cls);
+
+		/* line to every socket in socks, one job per worker with sockets */
+		void broadcast(std::vector<int> socks, std::string line, traffic_class cls);
+
+		/* weighted queue for sock, see out_queue */
+		void set_link(int sock);
+
+		/* adds the queueing delays of all workers to merged */
+		void delays(histogram *merged) const;
+
+		/* closes sock once its lines are written */
+		void close(int sock);
+
+		/* reports queued by the workers */
+		bool next_report(fanout_report &r);
+
+		/* stops the workers after the jobs queued so far and returns the
+		 * lines they could not send by socket */
+		void hand_over(std::unordered_map<int, std::string> &unsent);
+};
+
+#endif /* FANOUT_HPP */
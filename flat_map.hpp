@@ -0,0 +1,362 @@
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <functional>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* hash used by flat_map, mixes integers so ids that are dense still spread
+ * over the control bytes */
+template <typename K>
+struct flat_hash
+{
+	size_t operator()(K key) const
+	{
+		uint64_t h = static_cast<uint64_t>(key);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return static_cast<size_t>(h);
+	}
+};
+
+/* names are looked up by std::string_view, so tables are searched
+ * without building a std::string first */
+template <>
+struct flat_hash<std::string_view>
+{
+	size_t operator()(std::string_view key) const
+	{
+		// eight bytes per round, the tail is zero padded
+		uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+		size_t i = 0;
+		for (; i + 8 <= key.size(); i += 8) {
+			uint64_t word;
+			std::memcpy(&word, key.data() + i, 8);
+			h = (h ^ word) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 29;
+		}
+		if (i < key.size()) {
+			uint64_t word = 0;
+			std::memcpy(&word, key.data() + i, key.size() - i);
+			h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		}
+		return flat_hash<uint64_t>()(h);
+	}
+};
+
+/* open addressing hash map in the style of swiss tables: one control byte per
+ * slot holds 7 bits of the hash, groups of 16 control bytes are matched at
+ * once with SSE2. Slots live in one flat array, there is no allocation per
+ * entry. Lookups may use any type Q that Hash and Eq accept. */
+template <typename K, typename V, typename Hash = flat_hash<K>, typename Eq = std::equal_to<K>>
+class flat_map
+{
+	public:
+		typedef std::pair<K, V> value_type;
+
+		static const size_t GROUP = 16;
+
+	private:
+		static const int8_t EMPTY = -128;
+
+		static const int8_t DELETED = -2;
+
+		/* capacity + GROUP bytes, the first GROUP bytes are mirrored at
+		 * the end so a group can be loaded at any position */
+		int8_t *ctrl;
+
+		value_type *slots;
+
+		size_t capacity;
+
+		size_t count;
+
+		size_t tombstones;
+
+		Hash hasher;
+
+		Eq equal;
+
+		static size_t h1(size_t hash) { return hash >> 7; }
+
+		static int8_t h2(size_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+
+		/* bitmask of positions in the group at pos whose control byte is b */
+		uint32_t match(size_t pos, int8_t b) const
+		{
+#ifdef __SSE2__
+			__m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl + pos));
+			return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(b), group)));
+#else
+			uint32_t mask = 0;
+			for (size_t i = 0; i < GROUP; i++) {
+				if (ctrl[pos + i] == b) {
+					mask |= 1u << i;
+				}
+			}
+			return mask;
+#endif
+		}
+
+		/* bitmask of positions in the group at pos that are empty or deleted */
+		uint32_t match_free(size_t pos) const
+		{
+#ifdef __SSE2__
+			__m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl + pos));
+			return static_cast<uint32_t>(_mm_movemask_epi8(group));
+#else
+			uint32_t mask = 0;
+			for (size_t i = 0; i < GROUP; i++) {
+				if (ctrl[pos + i] < 0) {
+					mask |= 1u << i;
+				}
+			}
+			return mask;
+#endif
+		}
+
+		static unsigned lowest_bit(uint32_t mask)
+		{
+			return static_cast<unsigned>(__builtin_ctz(mask));
+		}
+
+		void set_ctrl(size_t i, int8_t b)
+		{
+			ctrl[i] = b;
+			if (i < GROUP) {
+				ctrl[capacity + i] = b;
+			}
+		}
+
+		template <typename Q>
+		size_t find_index(const Q &key) const
+		{
+			if (capacity == 0) {
+				return capacity;
+			}
+			size_t hash = hasher(key);
+			size_t mask = capacity - 1;
+			size_t pos = h1(hash) & mask;
+			int8_t tag = h2(hash);
+			for (size_t step = GROUP; ; step += GROUP) {
+				for (uint32_t m = match(pos, tag); m != 0; m &= m - 1) {
+					size_t i = (pos + lowest_bit(m)) & mask;
+					if (equal(slots[i].first, key)) {
+						return i;
+					}
+				}
+				if (match(pos, EMPTY) != 0) {
+					return capacity;
+				}
+				pos = (pos + step) & mask;
+			}
+		}
+
+		/* first free slot on the probe sequence of hash */
+		size_t find_free(size_t hash) const
+		{
+			size_t mask = capacity - 1;
+			size_t pos = h1(hash) & mask;
+			for (size_t step = GROUP; ; step += GROUP) {
+				uint32_t m = match_free(pos);
+				if (m != 0) {
+					return (pos + lowest_bit(m)) & mask;
+				}
+				pos = (pos + step) & mask;
+			}
+		}
+
+		void rehash(size_t new_capacity)
+		{
+			int8_t *old_ctrl = ctrl;
+			value_type *old_slots = slots;
+			size_t old_capacity = capacity;
+
+			capacity = new_capacity;
+			ctrl = new int8_t[capacity + GROUP];
+			std::memset(ctrl, EMPTY, capacity + GROUP);
+			slots = static_cast<value_type*>(::operator new(capacity * sizeof(value_type)));
+			tombstones = 0;
+
+			for (size_t i = 0; i < old_capacity; i++) {
+				if (old_ctrl[i] >= 0) {
+					size_t hash = hasher(old_slots[i].first);
+					size_t j = find_free(hash);
+					set_ctrl(j, h2(hash));
+					new (&slots[j]) value_type(std::move(old_slots[i]));
+					old_slots[i].~value_type();
+				}
+			}
+
+			delete[] old_ctrl;
+			::operator delete(old_slots);
+		}
+
+		/* makes room for one more entry, keeps the load below 7/8 */
+		void grow()
+		{
+			if (capacity == 0) {
+				rehash(GROUP);
+			} else if ((count + tombstones + 1) * 8 > capacity * 7) {
+				rehash(count * 2 + 2 > capacity ? capacity * 2 : capacity);
+			}
+		}
+
+	public:
+		class iterator
+		{
+			private:
+				const flat_map *map;
+
+				size_t i;
+
+				void skip()
+				{
+					while (i < map->capacity && map->ctrl[i] < 0) {
+						i++;
+					}
+				}
+
+			public:
+				iterator(const flat_map *m, size_t pos) : map(m), i(pos) { skip(); }
+
+				value_type &operator*() const { return map->slots[i]; }
+
+				value_type *operator->() const { return &map->slots[i]; }
+
+				iterator &operator++() { i++; skip(); return *this; }
+
+				bool operator==(const iterator &o) const { return i == o.i; }
+
+				bool operator!=(const iterator &o) const { return i != o.i; }
+
+				size_t index() const { return i; }
+		};
+
+		flat_map() : ctrl(nullptr), slots(nullptr), capacity(0), count(0), tombstones(0) {}
+
+		flat_map(const flat_map &) = delete;
+
+		flat_map &operator=(const flat_map &) = delete;
+
+		~flat_map()
+		{
+			clear();
+			delete[] ctrl;
+			::operator delete(slots);
+		}
+
+		iterator begin() const { return iterator(this, 0); }
+
+		iterator end() const { return iterator(this, capacity); }
+
+		size_t size() const { return count; }
+
+		bool empty() const { return count == 0; }
+
+		template <typename Q>
+		iterator find(const Q &key) const
+		{
+			return iterator(this, find_index(key));
+		}
+
+		/* inserts key if it is missing, returns the entry and whether it
+		 * was inserted */
+		std::pair<iterator, bool> emplace(const K &key, const V &value)
+		{
+			size_t i = find_index(key);
+			if (i != capacity) {
+				return std::make_pair(iterator(this, i), false);
+			}
+			grow();
+			size_t hash = hasher(key);
+			i = find_free(hash);
+			if (ctrl[i] == DELETED) {
+				tombstones--;
+			}
+			set_ctrl(i, h2(hash));
+			new (&slots[i]) value_type(key, value);
+			count++;
+			return std::make_pair(iterator(this, i), true);
+		}
+
+		V &operator[](const K &key)
+		{
+			return emplace(key, V()).first->second;
+		}
+
+		void erase(iterator it)
+		{
+			size_t i = it.index();
+			if (i < capacity && ctrl[i] >= 0) {
+				slots[i].~value_type();
+				set_ctrl(i, DELETED);
+				count--;
+				tombstones++;
+			}
+		}
+
+		template <typename Q>
+		size_t erase(const Q &key)
+		{
+			size_t i = find_index(key);
+			if (i == capacity) {
+				return 0;
+			}
+			erase(iterator(this, i));
+			return 1;
+		}
+
+		void clear()
+		{
+			for (size_t i = 0; i < capacity; i++) {
+				if (ctrl[i] >= 0) {
+					slots[i].~value_type();
+				}
+			}
+			if (ctrl != nullptr) {
+				std::memset(ctrl, EMPTY, capacity + GROUP);
+			}
+			count = 0;
+			tombstones = 0;
+		}
+
+		void reserve(size_t n)
+		{
+			size_t want = GROUP;
+			while (want * 7 < n * 8) {
+				want *= 2;
+			}
+			if (want > capacity) {
+				rehash(want);
+			}
+		}
+
+		/* bytes held by the table */
+		size_t memory_usage() const
+		{
+			return capacity == 0 ? 0 : capacity * sizeof(value_type) + capacity + GROUP;
+		}
+};
+
+template <typename K, typename V, typename Hash, typename Eq>
+const size_t flat_map<K, V, Hash, Eq>::GROUP;
+
+template <typename K, typename V, typename Hash, typename Eq>
+const int8_t flat_map<K, V, Hash, Eq>::EMPTY;
+
+template <typename K, typename V, typename Hash, typename Eq>
+const int8_t flat_map<K, V, Hash, Eq>::DELETED;
+
+#endif /* FLAT_MAP_HPP */
@@ -1,5 +1,8 @@
 #include "helpers.hpp"
 #include "data.hpp"
+#include "log.hpp"
+#include "fanout.hpp"
+#include "probes.hpp"
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -7,8 +10,11 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <cstring>
+#include <time.h>
+#include <algorithm>
 
 int set_socket_non_blocking(int sockfd)
 {
@@ -60,64 +66,661 @@ int unset_socket_opt(int sockfd, int opt)
 	return 0;
 }
 
-ssize_t sockfd_in(int sock, std::queue<std::string> &in_queue)
+ssize_t sockfd_in(int sock, std::string &in, size_t budget)
 {
-	bool partial = false;
-	if (!in_queue.empty()) {
-		auto &back = in_queue.back();
-		if (back.back() != '\n') {
-			partial = true;
+	char msgbuf[READ_CHUNK];
+	ssize_t bytes_read = 1;
+	size_t total = 0;
+	while (bytes_read > 0 && total < budget) {
+		bytes_read = recv(sock, &msgbuf, READ_CHUNK, 0);
+		if (bytes_read > 0) {
+			in.append(msgbuf, static_cast<size_t>(bytes_read));
+			total += static_cast<size_t>(bytes_read);
 		}
 	}
+	return bytes_read;
+}
 
-	char msgbuf[BUFLEN];
-	ssize_t bytes_read = 1;
-	while (bytes_read > 0) {
-		bytes_read = recv(sock, &msgbuf, BUFLEN - 1, 0);
-		if (bytes_read > 0) {
-			msgbuf[bytes_read] = '\0';
-			std::stringstream in;
-			in << msgbuf;
-			std::string msg;
-			while (getline(in, msg, '\n')) {
-				if (msg.size() > 0) {
-					if (partial) {
-						in_queue.back() += msg + "\n";
-					} else {
-						in_queue.push(msg + "\n");
-					}
-					partial = in.eof();
+static bool unix_sockaddr(const std::string &path, struct sockaddr_un &addr)
+{
+	std::memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path) {
+		std::cerr << "socket path too long: " << path << std::endl;
+		return false;
+	}
+	std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+bool unix_address(std::string_view address, std::string &path)
+{
+	std::string_view prefix = UNIX_PREFIX;
+	if (address.substr(0, prefix.size()) != prefix) {
+		return false;
+	}
+	path = address.substr(prefix.size());
+	return true;
+}
+
+int unix_listen(const std::string &path, int backlog)
+{
+	struct sockaddr_un addr;
+	if (!unix_sockaddr(path, addr)) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path.c_str());
+	if (bind(sock, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(sock, backlog) != 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int unix_connect(const std::string &path)
+{
+	struct sockaddr_un addr;
+	if (!unix_sockaddr(path, addr)) {
+		return -1;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *) &addr, sizeof addr) != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static bool write_all(int sock, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n < 1) {
+			perror("send");
+			return false;
+		}
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+static bool read_all(int sock, char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = recv(sock, data, size, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n < 1) {
+			return false;
+		}
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+bool send_with_fds(int sock, const std::string &data, const std::vector<int> &fds)
+{
+	uint64_t header[2] = { data.size(), fds.size() };
+	if (!write_all(sock, reinterpret_cast<const char*>(header), sizeof header)
+			|| !write_all(sock, data.data(), data.size())) {
+		return false;
+	}
+
+	// one byte carries each batch
+	for (size_t i = 0; i < fds.size(); i += HANDOFF_FDS) {
+		size_t n = std::min<size_t>(HANDOFF_FDS, fds.size() - i);
+		char byte = 0;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		std::vector<char> control(CMSG_SPACE(n * sizeof(int)), 0);
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fds[i], n * sizeof(int));
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+			perror("sendmsg");
+			return false;
+		}
+	}
+	return true;
+}
+
+bool receive_with_fds(int sock, std::string &data, std::vector<int> &fds)
+{
+	uint64_t header[2];
+	if (!read_all(sock, reinterpret_cast<char*>(header), sizeof header)) {
+		return false;
+	}
+	data.resize(header[0]);
+	if (!read_all(sock, &data[0], data.size())) {
+		return false;
+	}
+
+	fds.clear();
+	std::vector<char> control(CMSG_SPACE(HANDOFF_FDS * sizeof(int)), 0);
+	while (fds.size() < header[1]) {
+		char byte;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+			perror("recvmsg");
+			return false;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				const unsigned char *from = CMSG_DATA(cmsg);
+				for (size_t i = 0; i < n; i++) {
+					int fd;
+					std::memcpy(&fd, from + i * sizeof(int), sizeof fd);
+					fds.push_back(fd);
 				}
 			}
 		}
+		if (msg.msg_flags & MSG_CTRUNC) {
+			std::cerr << "too many descriptors in one message" << std::endl;
+			return false;
+		}
 	}
-	return bytes_read;
+	return fds.size() == header[1];
 }
 
-int sockfd_out(int sock, std::queue<std::string> &out_queue)
-{	
-	while (!out_queue.empty()) {
-		auto &msg = out_queue.front();
-		//TODO remove
-		std::cout << "sending: " << msg;
-		//
-		ssize_t bytes_written = send(sock, msg.c_str(), msg.size(), 0);
-		int err = errno;
-		
+bool token_bucket::take(double rate, double burst, uint64_t now)
+{
+	if (last == 0) {
+		tokens = burst;
+	} else {
+		tokens += static_cast<double>(now - last) * rate / 1e9;
+		if (tokens > burst) {
+			tokens = burst;
+		}
+	}
+	last = now;
+	if (tokens < 1) {
+		return false;
+	}
+	tokens -= 1;
+	return true;
+}
+
+traffic_class line_class(std::string_view line)
+{
+	size_t start = 0;
+	if (!line.empty() && line[0] == '@') {
+		start = line.find(' ');
+		if (start == std::string_view::npos) {
+			return CONTROL;
+		}
+		start++;
+	}
+	if (line.compare(start, 4, "MSG ") == 0 || line.compare(start, 8, "PRIVMSG ") == 0) {
+		return BULK;
+	}
+	return CONTROL;
+}
+
+out_queue::out_queue()
+	: weighted(false)
+{
+	for (lane &l : lanes) {
+		l.pos = 0;
+		l.queued = 0;
+		l.sent = 0;
+		l.first_stamp = 0;
+		l.partial = false;
+	}
+}
+
+void out_queue::stamp_queued(lane &l, size_t bytes, uint64_t now)
+{
+	l.queued += bytes;
+	if (l.first_stamp < l.stamps.size() && now - l.stamps.back().time < DELAY_STAMP_NS) {
+		l.stamps.back().end = l.queued;
+	} else {
+		stamp st;
+		st.time = now;
+		st.end = l.queued;
+		l.stamps.push_back(st);
+	}
+}
+
+void out_queue::push(std::string &&line, traffic_class cls, uint64_t now)
+{
+	lane &l = lanes[cls];
+	size_t bytes = line.size();
+	if (l.data.empty()) {
+		l.data.swap(line);
+	} else {
+		l.data += line;
+	}
+	stamp_queued(l, bytes, now);
+}
+
+void out_queue::push(std::string_view line, traffic_class cls, uint64_t now)
+{
+	lane &l = lanes[cls];
+	l.data += line;
+	stamp_queued(l, line.size(), now);
+}
+
+bool out_queue::empty() const
+{
+	for (const lane &l : lanes) {
+		if (l.pos < l.data.size()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t out_queue::memory() const
+{
+	size_t bytes = sizeof(out_queue);
+	for (const lane &l : lanes) {
+		bytes += l.data.capacity() + l.stamps.capacity() * sizeof(stamp);
+	}
+	return bytes;
+}
+
+size_t out_queue::gather(struct iovec *iov, traffic_class *cls) const
+{
+	size_t count = 0;
+	size_t next[TRAFFIC_CLASSES];
+	for (int c = 0; c < TRAFFIC_CLASSES; c++) {
+		next[c] = lanes[c].pos;
+	}
+
+	// up to max_lines lines of a lane, all for 0
+	auto take = [&](traffic_class c, size_t max_lines) {
+		const lane &l = lanes[c];
+		size_t start = next[c];
+		if (start >= l.data.size() || count == FLUSH_IOV) {
+			return false;
+		}
+		size_t end = l.data.size();
+		if (max_lines > 0) {
+			end = start;
+			for (size_t i = 0; i < max_lines && end < l.data.size(); i++) {
+				size_t nl = l.data.find('\n', end);
+				end = nl == std::string::npos ? l.data.size() : nl + 1;
+			}
+		}
+		iov[count].iov_base = const_cast<char*>(l.data.data() + start);
+		iov[count].iov_len = end - start;
+		cls[count] = c;
+		count++;
+		next[c] = end;
+		return true;
+	};
+
+	// the rest of a line sent in part goes first
+	for (int c = 0; c < TRAFFIC_CLASSES; c++) {
+		if (lanes[c].partial) {
+			take(static_cast<traffic_class>(c), 1);
+		}
+	}
+	if (!weighted) {
+		take(CONTROL, 0);
+		take(BULK, 0);
+	} else {
+		bool more = true;
+		while (more) {
+			more = take(CONTROL, LINK_CONTROL_WEIGHT);
+			more = take(BULK, 1) || more;
+		}
+	}
+	return count;
+}
+
+void out_queue::advance(const struct iovec *iov, const traffic_class *cls, size_t count,
+		size_t sent, histogram *delays, size_t *lines)
+{
+	for (size_t i = 0; i < count && sent > 0; i++) {
+		lane &l = lanes[cls[i]];
+		size_t done = std::min(iov[i].iov_len, sent);
+		if (lines != nullptr) {
+			const char *from = l.data.data() + l.pos;
+			*lines += static_cast<size_t>(std::count(from, from + done, '\n'));
+		}
+		l.pos += done;
+		l.sent += done;
+		sent -= done;
+		l.partial = l.data[l.pos - 1] != '\n';
+	}
+
+	uint64_t now = monotonic_ns();
+	for (int c = 0; c < TRAFFIC_CLASSES; c++) {
+		lane &l = lanes[c];
+		while (l.first_stamp < l.stamps.size() && l.stamps[l.first_stamp].end <= l.sent) {
+			if (delays != nullptr) {
+				delays[c].record(now - l.stamps[l.first_stamp].time);
+			}
+			l.first_stamp++;
+		}
+		if (l.pos == l.data.size()) {
+			l.data.clear();
+			l.pos = 0;
+			l.stamps.clear();
+			l.first_stamp = 0;
+		}
+	}
+}
+
+int out_queue::flush(int sock, histogram *delays, size_t *lines)
+{
+	struct iovec iov[FLUSH_IOV];
+	traffic_class cls[FLUSH_IOV];
+	size_t count;
+
+	if (lines != nullptr) {
+		*lines = 0;
+	}
+	while ((count = gather(iov, cls)) > 0) {
+		// all queued segments in one call
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t bytes_written = sendmsg(sock, &msg, MSG_NOSIGNAL);
 		if (bytes_written < 1) {
-			return err;
-		} else if (static_cast<unsigned long>(bytes_written) < msg.size()) {
-			out_queue.front() = msg.substr(bytes_written, msg.size());
-		} else {
-			out_queue.pop();
+			return errno;
 		}
+		PROBE3(flush, sock, bytes_written, count);
+		advance(iov, cls, count, static_cast<size_t>(bytes_written), delays, lines);
 	}
 	return 0;
 }
 
-connection_manager::connection_manager()
+std::string out_queue::unsent() const
+{
+	traffic_class first = lanes[BULK].partial ? BULK : CONTROL;
+	traffic_class second = first == BULK ? CONTROL : BULK;
+	std::string rest(lanes[first].data, lanes[first].pos);
+	rest.append(lanes[second].data, lanes[second].pos, std::string::npos);
+	return rest;
+}
+
+void out_queue::reset()
+{
+	for (lane &l : lanes) {
+		l.data.clear();
+		l.pos = 0;
+		l.queued = 0;
+		l.sent = 0;
+		l.stamps.clear();
+		l.first_stamp = 0;
+		l.partial = false;
+	}
+	weighted = false;
+}
+
+void out_queue::compact()
+{
+	for (lane &l : lanes) {
+		if (l.pos > l.data.size() / 2) {
+			l.data.erase(0, l.pos);
+			l.pos = 0;
+		}
+		if (l.first_stamp > 0) {
+			l.stamps.erase(l.stamps.begin(), l.stamps.begin() + static_cast<std::ptrdiff_t>(l.first_stamp));
+			l.first_stamp = 0;
+		}
+	}
+}
+
+size_t resident_bytes()
+{
+	std::ifstream statm("/proc/self/statm");
+	size_t pages = 0, resident = 0;
+	if (!(statm >> pages >> resident)) {
+		return 0;
+	}
+	return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+histogram::histogram()
+	: buckets(1024, 0), total(0), sum(0), max_value(0)
+{
+}
+
+size_t histogram::bucket(uint64_t value)
+{
+	if (value < 16) {
+		return static_cast<size_t>(value);
+	}
+	unsigned exp = 63 - static_cast<unsigned>(__builtin_clzll(value));
+	uint64_t sub = (value >> (exp - 4)) & 15;
+	return static_cast<size_t>((exp - 3) * 16 + sub);
+}
+
+uint64_t histogram::bucket_value(size_t index)
+{
+	if (index < 16) {
+		return index;
+	}
+	unsigned exp = static_cast<unsigned>(index / 16 + 3);
+	uint64_t low = (16 + index % 16) << (exp - 4);
+	uint64_t width = 1ULL << (exp - 4);
+	return low + width / 2;
+}
+
+void histogram::record(uint64_t value)
+{
+	buckets[bucket(value)]++;
+	total++;
+	sum += value;
+	if (value > max_value) {
+		max_value = value;
+	}
+}
+
+void histogram::merge(const histogram &other)
+{
+	for (size_t i = 0; i < buckets.size(); i++) {
+		buckets[i] += other.buckets[i];
+	}
+	total += other.total;
+	sum += other.sum;
+	if (other.max_value > max_value) {
+		max_value = other.max_value;
+	}
+}
+
+uint64_t histogram::count() const
+{
+	return total;
+}
+
+uint64_t histogram::max() const
+{
+	return max_value;
+}
+
+double histogram::mean() const
+{
+	return total == 0 ? 0 : static_cast<double>(sum) / static_cast<double>(total);
+}
+
+uint64_t histogram::percentile(double p) const
+{
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(total));
+	if (rank >= total) {
+		rank = total - 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < buckets.size(); i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			uint64_t v = bucket_value(i);
+			return v < max_value ? v : max_value;
+		}
+	}
+	return max_value;
+}
+
+void histogram::print(std::ostream &out, double scale) const
+{
+	out << "count " << total
+		<< " mean " << mean() / scale
+		<< " p50 " << static_cast<double>(percentile(50)) / scale
+		<< " p90 " << static_cast<double>(percentile(90)) / scale
+		<< " p99 " << static_cast<double>(percentile(99)) / scale
+		<< " max " << static_cast<double>(max_value) / scale;
+}
+
+tracer::tracer(const std::string &file, const std::string &name, unsigned sample)
+	: out(file.c_str(), std::ios::out | std::ios::trunc), pid(static_cast<int>(getpid())),
+	sample_every(sample > 0 ? sample : 1), ingress_seen(0),
+	rng(std::random_device()()), dirty(false), current(0)
+{
+	// the closing bracket is optional in the trace format, so a file of a
+	// killed process stays readable
+	out << "[" << std::endl;
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+		<< ",\"args\":{\"name\":\"" << name << "\"}}," << std::endl;
+	out.flush();
+}
+
+tracer::~tracer()
+{
+	flush();
+}
+
+bool tracer::good() const
+{
+	return out.good();
+}
+
+uint64_t tracer::now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000ULL + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+}
+
+uint64_t tracer::sample()
 {
+	if (ingress_seen++ % sample_every != 0) {
+		return 0;
+	}
+	uint64_t id;
+	do {
+		id = rng();
+	} while (id == 0);
+	return id;
+}
+
+void tracer::begin_event(const std::string &name, char phase, uint64_t ts)
+{
+	out << "{\"name\":\"" << name << "\",\"cat\":\"ibrc\",\"ph\":\"" << phase
+		<< "\",\"ts\":" << ts << ",\"pid\":" << pid << ",\"tid\":0";
+	dirty = true;
+}
+
+void tracer::span(const std::string &name, uint64_t trace, uint64_t start, uint64_t end)
+{
+	begin_event(name, 'X', start);
+	out << ",\"dur\":" << (end > start ? end - start : 0)
+		<< ",\"args\":{\"trace\":\"" << std::hex << trace << std::dec << "\"}}," << std::endl;
+}
+
+void tracer::hop(uint64_t trace, bool first, uint64_t ts)
+{
+	begin_event("hop", first ? 's' : 't', ts);
+	out << ",\"id\":\"0x" << std::hex << trace << std::dec << "\",\"bp\":\"e\"}," << std::endl;
+}
+
+void tracer::handling(uint64_t trace)
+{
+	current = trace;
+}
+
+void tracer::enqueued(int sock, std::string_view line)
+{
+	socket_lines &lines = sockets[sock];
+	uint64_t trace = current != 0 ? current : trace_id_of(line);
+	if (trace != 0) {
+		queued_line q;
+		q.position = lines.enqueued;
+		q.trace = trace;
+		q.enqueued = now_us();
+		lines.traced.push_back(q);
+	}
+	lines.enqueued++;
+}
+
+void tracer::flushed(int sock, size_t count)
+{
+	auto found = sockets.find(sock);
+	if (found == sockets.end()) {
+		return;
+	}
+	socket_lines &lines = found->second;
+	lines.flushed += count;
+	while (!lines.traced.empty() && lines.traced.front().position < lines.flushed) {
+		span("send", lines.traced.front().trace, lines.traced.front().enqueued, now_us());
+		lines.traced.pop_front();
+	}
+}
+
+void tracer::closed(int sock)
+{
+	sockets.erase(sock);
+}
+
+void tracer::flush()
+{
+	if (dirty) {
+		out.flush();
+		dirty = false;
+	}
+}
+
+connection_manager::connection_manager(int listen_backlog, bool reuse)
+	: open_count(0), backlog(listen_backlog), reuse_port(reuse), writers(nullptr), n_writers(0)
+{
+	trace = nullptr;
 	epollfd = epoll_create1(0);
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
 	events = new struct epoll_event[MAX_EVENTS];
 
@@ -128,21 +731,45 @@ connection_manager::connection_manager()
 
 connection_manager::~connection_manager()
 {
+	delete writers; // finishes the closes handed to the threads
 	delete[] events;
-	for (auto s : socks) {
-		if (close(s) == -1) {
-			perror("close");
+	if (reserve_fd != -1) {
+		close(reserve_fd);
+	}
+	for (auto b : spare_in) {
+		delete b;
+	}
+	for (auto q : spare_out) {
+		delete q;
+	}
+	for (size_t fd = 0; fd < conns.size(); fd++) {
+		if (conns[fd].open) {
+			delete conns[fd].in;
+			delete conns[fd].out;
+			if (close(static_cast<int>(fd)) == -1) {
+				perror("close");
+			}
 		}
 	}
 }
 
-int connection_manager::wait_events()
+connection_manager::connection *connection_manager::find(int sock)
+{
+	if (sock < 0 || static_cast<size_t>(sock) >= conns.size() || !conns[sock].open) {
+		return nullptr;
+	}
+	return &conns[sock];
+}
+
+int connection_manager::wait_events(int timeout)
 {
 	next_event_pos = 0;
 
-	count_events = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+	count_events = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
 
-	if (count_events == -1) {
+	if (count_events == -1 && errno == EINTR) {
+		count_events = 0;
+	} else if (count_events == -1) {
 		perror("epoll_wait");
 		return -1;
 	}
@@ -150,21 +777,80 @@ int connection_manager::wait_events()
 	return count_events;
 }
 
+bool connection_manager::start_writers(unsigned n)
+{
+	if (n == 0 || writers != nullptr) {
+		return false;
+	}
+	writers = new fanout_pool(n);
+	n_writers = n;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = writers->notify_socket();
+	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ev.data.fd, &ev) != 0) {
+		perror("epoll_ctl: add notify fd failed.");
+		return false;
+	}
+	return true;
+}
+
+void connection_manager::collect_reports()
+{
+	fanout_report r;
+	while (writers->next_report(r)) {
+		if (r.closed) {
+			conns[r.sock].closing--;
+		} else if (find(r.sock) != nullptr && conns[r.sock].closing == 0) {
+			// the server closes it like a connection the peer closed
+			struct epoll_event ev;
+			ev.events = EPOLLRDHUP;
+			ev.data.fd = r.sock;
+			hangups.push_back(ev);
+		}
+	}
+}
+
 bool connection_manager::next_event(struct epoll_event &ev)
 {
-	if (next_event_pos < count_events && next_event_pos < MAX_EVENTS) {
+	while (!hangups.empty()) {
+		ev = hangups.front();
+		hangups.pop_front();
+		if (find(ev.data.fd) != nullptr) {
+			return true;
+		}
+	}
+	while (next_event_pos < count_events && next_event_pos < MAX_EVENTS) {
 		ev = events[next_event_pos];
 		next_event_pos++;
-		if (socks.find(ev.data.fd) == socks.end()) {
-			return false;
+		if (writers != nullptr && ev.data.fd == writers->notify_socket()) {
+			collect_reports();
+			return next_event(ev);
+		}
+		// skips sockets closed by an earlier event of this round
+		if (find(ev.data.fd) != nullptr) {
+			return true;
 		}
-		return true;
 	}
 	return false;
 }
 
 int connection_manager::add_accepting(std::string port)
 {
+	std::string path;
+	if (unix_address(port, path)) {
+		// one socket per path, the kernel cannot spread them
+		if (reuse_port) {
+			std::cerr << "a unix socket takes one acceptor" << std::endl;
+			return -1;
+		}
+		int listen_s = unix_listen(path, backlog);
+		if (listen_s == -1 || add_socket(listen_s, EPOLLFLAGS) < 0) {
+			return -1;
+		}
+		return listen_s;
+	}
+
 	struct addrinfo *ainfo;
 	struct addrinfo hints;
 	std::memset(&hints, 0, sizeof hints);
@@ -178,7 +864,8 @@ int connection_manager::add_accepting(std::string port)
 		return -1;
 	}
 
-	int listen_s = socket(ainfo->ai_family, ainfo->ai_socktype, ainfo->ai_protocol);
+	int listen_s = socket(ainfo->ai_family, ainfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ainfo->ai_protocol);
 
 	if (listen_s == -1) {
 		perror("socket");
@@ -192,19 +879,26 @@ int connection_manager::add_accepting(std::string port)
 		return -1;
 	}
 
+	// the kernel spreads new connections over all sockets on the port
+	if (reuse_port && setsockopt(listen_s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1) {
+		perror("setsockopt");
+		remove_socket(listen_s);
+		return -1;
+	}
+
 	if (bind(listen_s, ainfo->ai_addr, ainfo->ai_addrlen) != 0) {
 		perror("bind");
 		remove_socket(listen_s);
 		return -1;
 	}
 
-	if (listen(listen_s, 5) != 0) {
+	if (listen(listen_s, backlog) != 0) {
 		perror("listen");
 		remove_socket(listen_s);
 		return -1;
 	}
 
-	if (add_socket(listen_s, EPOLLFLAGS) < 0) {
+	if (watch_socket(listen_s, EPOLLFLAGS) < 0) {
 		return -1;
 	}
 
@@ -217,19 +911,32 @@ int connection_manager::add_socket(int sockfd, int flags)
 	if (set_socket_non_blocking(sockfd) != 0) {
 		return -1;
 	}
-	
+	return watch_socket(sockfd, static_cast<uint32_t>(flags));
+}
+
+int connection_manager::watch_socket(int sockfd, uint32_t flags)
+{
 	struct epoll_event ev;
 
 	ev.events = flags;
 	ev.data.fd = sockfd;
 
 	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) != 0) {
-		remove_socket(sockfd);
 		perror("epoll_ctl: add sockfd failed.");
+		close(sockfd);
 		return -1;
 	}
 
-	socks.insert(sockfd);
+	if (static_cast<size_t>(sockfd) >= conns.size()) {
+		conns.resize(static_cast<size_t>(sockfd) * 2 + 16, connection());
+	}
+	connection &c = conns[sockfd];
+	c.in = nullptr;
+	c.out = nullptr;
+	c.flags = flags;
+	c.open = true;
+	c.link = false;
+	open_count++;
 
 	return sockfd;
 }
@@ -240,32 +947,71 @@ int connection_manager::accept_client(int sock)
 	struct sockaddr_storage addr;
 	socklen_t addrlen = sizeof addr;
 
-	int conn_s = accept(sock, (struct sockaddr *) &addr, &addrlen);
+	// the listener is edge triggered, callers accept until this fails
+	int conn_s;
+	bool retry;
+	do { // a connection reset while queued is skipped
+		addrlen = sizeof addr;
+		conn_s = accept4(sock, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		// out of descriptors the connection would stay queued and the
+		// event not come again, it is closed instead
+		retry = conn_s == -1 && (errno == ECONNABORTED || errno == EINTR
+				|| ((errno == EMFILE || errno == ENFILE) && shed_connection(sock)));
+	} while (retry);
 	if (conn_s == -1) {
-		perror("accept");
-		return -1;
-	}
-
-	if (set_socket_non_blocking(conn_s) == -1) {
-		remove_socket(conn_s);
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept4");
+		}
 		return -1;
 	}
 
-	if (add_socket(conn_s, EPOLLFLAGS | EPOLLOUT) < 0) {
+	if (watch_socket(conn_s, EPOLLFLAGS | EPOLLOUT) < 0) {
 		return -1;
 	}
 
 	return conn_s;
 }
 
+bool connection_manager::shed_connection(int sock)
+{
+	if (reserve_fd == -1) {
+		return false;
+	}
+	close(reserve_fd);
+	int conn_s = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+	if (conn_s != -1) {
+		close(conn_s);
+	}
+	// the freed descriptor is taken again before anything else gets it
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (conn_s == -1) {
+		return false;
+	}
+	LOG(LOG_WARN, LOG_NET, "accept: ", "out of file descriptors, connection closed");
+	return true;
+}
+
 bool connection_manager::remove_socket(int sock)
 {
-	in_queues.erase(sock);
-	out_queues.erase(sock);
-	socks.erase(sock);
+	if (trace != nullptr) {
+		trace->closed(sock);
+	}
+	connection *c = find(sock);
+	if (c != nullptr) {
+		give_back(c->in);
+		give_back(c->out);
+		c->in = nullptr;
+		c->out = nullptr;
+		c->open = false;
+		open_count--;
+	}
 	if (epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, nullptr) != 0) {
 		perror("epoll_ctl: mod sockfd failed.");
 		return false;
+	} else if (writers != nullptr && c != nullptr) {
+		// after the lines queued before, the fd stays taken until then
+		c->closing++;
+		writers->close(sock);
 	} else if (close(sock) == -1) {
 		perror("close");
 		return false;
@@ -285,6 +1031,15 @@ bool connection_manager::continue_write(int sock)
 
 bool connection_manager::epoll_mod(int sock, uint32_t event_flags)
 {
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return false;
+	}
+	if (c->flags == event_flags) { // one epoll_ctl per change, not per line
+		return true;
+	}
+	c->flags = event_flags;
+
 	struct epoll_event ev;
 	ev.data.fd = sock;
 	ev.events = event_flags;
@@ -296,41 +1051,139 @@ bool connection_manager::epoll_mod(int sock, uint32_t event_flags)
 	return true;
 }
 
-bool connection_manager::add_message(int sock, std::string message)
+bool connection_manager::add_message(int sock, std::string &&message)
 {
-	out_queues[sock].push(message);
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return false;
+	}
+	LOG(LOG_TRACE, LOG_NET, "sending: ", message);
+	traffic_class cls = line_class(message);
+	if (writers != nullptr) {
+		writers->send(sock, std::move(message), cls);
+		return true;
+	}
+	if (trace != nullptr) {
+		trace->enqueued(sock, message);
+	}
+	if (c->out == nullptr) {
+		c->out = take_out(c->link);
+	}
+	c->out->push(std::move(message), cls, monotonic_ns());
+	return continue_write(sock);
+}
+
+bool connection_manager::add_message(int sock, std::string_view message)
+{
+	if (writers != nullptr) {
+		return add_message(sock, std::string(message));
+	}
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return false;
+	}
+	LOG(LOG_TRACE, LOG_NET, "sending: ", message);
+	if (trace != nullptr) {
+		trace->enqueued(sock, message);
+	}
+	if (c->out == nullptr) {
+		c->out = take_out(c->link);
+	}
+	// appended to the lane, no string of its own
+	c->out->push(message, line_class(message), monotonic_ns());
 	return continue_write(sock);
 }
 
+bool connection_manager::add_broadcast(const std::vector<int> &socks, std::string_view message)
+{
+	if (writers == nullptr) {
+		return transport::add_broadcast(socks, message);
+	}
+	std::vector<int> open;
+	open.reserve(socks.size());
+	for (int sock : socks) {
+		if (find(sock) != nullptr) {
+			open.push_back(sock);
+		}
+	}
+	if (open.empty()) {
+		return false;
+	}
+	LOG(LOG_TRACE, LOG_NET, "broadcasting: ", message);
+	writers->broadcast(std::move(open), std::string(message), line_class(message));
+	return true;
+}
+
 bool connection_manager::fetch_message(int sock, std::string &msg)
 {
-	if (!in_queues[sock].empty()) {
-		msg = in_queues[sock].front();
-		if (msg.size() > 0 && msg.back() == '\n') {
-			in_queues[sock].pop();
+	connection *c = find(sock);
+	if (c == nullptr || c->in == nullptr) {
+		return false;
+	}
+	buffer &in = *c->in;
+	while (in.pos < in.data.size()) {
+		size_t nl = in.data.find('\n', in.pos);
+		if (nl == std::string::npos) {
+			return false;
+		}
+		size_t start = in.pos;
+		in.pos = nl + 1;
+		if (nl > start) { // empty lines are skipped
+			msg.assign(in.data, start, nl + 1 - start);
 			return true;
 		}
 	}
+	// everything fetched, an idle connection keeps no buffer
+	give_back(c->in);
+	c->in = nullptr;
 	return false;
 }
 
-bool connection_manager::receive_messages(int sock)
+bool connection_manager::receive_messages(int sock, size_t budget, bool &more)
 {
-	auto count = sockfd_in(sock, in_queues[sock]);
+	more = false;
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return false;
+	}
+	if (c->in == nullptr) {
+		c->in = take_in();
+	} else if (c->in->pos > 0) { // keeps only the unterminated tail
+		c->in->data.erase(0, c->in->pos);
+		c->in->pos = 0;
+	}
+	auto count = sockfd_in(sock, c->in->data, budget);
 	if (count == 0) {
 		remove_socket(sock);
 	}
+	more = count > 0;
 	return count != 0;
 }
 
 bool connection_manager::send_messages(int sock)
 {
-	int err = sockfd_out(sock, out_queues[sock]);
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return false;
+	}
+	if (c->out == nullptr) {
+		pause_write(sock);
+		return true;
+	}
+	size_t lines = 0;
+	int err = c->out->flush(sock, delays, trace != nullptr ? &lines : nullptr);
+	if (trace != nullptr) {
+		// control lines may overtake, the tracer only counts them
+		trace->flushed(sock, lines);
+	}
 
-	if (err == 0 && out_queues[sock].empty()) {
+	if (err == 0) {
+		give_back(c->out);
+		c->out = nullptr;
 		pause_write(sock);
 		return true;
 	} else if (err == EAGAIN || err == EWOULDBLOCK) {
+		c->out->compact();
 		continue_write(sock);
 		return true;
 	} else {
@@ -339,8 +1192,212 @@ bool connection_manager::send_messages(int sock)
 	}
 }
 
+connection_manager::buffer *connection_manager::take_in()
+{
+	if (spare_in.empty()) {
+		buffer *b = new buffer();
+		b->pos = 0;
+		return b;
+	}
+	buffer *b = spare_in.back();
+	spare_in.pop_back();
+	return b;
+}
+
+out_queue *connection_manager::take_out(bool link)
+{
+	out_queue *q;
+	if (spare_out.empty()) {
+		q = new out_queue();
+	} else {
+		q = spare_out.back();
+		spare_out.pop_back();
+	}
+	q->weighted = link;
+	return q;
+}
+
+void connection_manager::give_back(buffer *b)
+{
+	if (b == nullptr) {
+		return;
+	}
+	if (spare_in.size() < SPARE_BUFFERS && b->data.capacity() <= SPARE_BYTES) {
+		b->data.clear();
+		b->pos = 0;
+		spare_in.push_back(b);
+	} else {
+		delete b;
+	}
+}
+
+void connection_manager::give_back(out_queue *q)
+{
+	if (q == nullptr) {
+		return;
+	}
+	if (spare_out.size() < SPARE_BUFFERS && q->memory() <= SPARE_BYTES) {
+		q->reset();
+		spare_out.push_back(q);
+	} else {
+		delete q;
+	}
+}
+
+void connection_manager::memory_report(std::ostream &out) const
+{
+	size_t in_bytes = 0, out_bytes = 0, buffers = 0;
+	for (const connection &c : conns) {
+		if (c.in != nullptr) {
+			in_bytes += sizeof(buffer) + c.in->data.capacity();
+			buffers++;
+		}
+		if (c.out != nullptr) {
+			out_bytes += c.out->memory();
+			buffers++;
+		}
+	}
+	size_t spare_bytes = 0;
+	for (auto b : spare_in) {
+		spare_bytes += sizeof(buffer) + b->data.capacity();
+	}
+	for (auto q : spare_out) {
+		spare_bytes += q->memory();
+	}
+	out << "sockets " << open_count
+		<< " table " << conns.capacity() * sizeof(connection) << " B"
+		<< " buffers " << buffers
+		<< " in " << in_bytes << " B"
+		<< " out " << out_bytes << " B"
+		<< " spare " << spare_in.size() + spare_out.size() << " (" << spare_bytes << " B)";
+}
+
+void connection_manager::set_link(int sock)
+{
+	connection *c = find(sock);
+	if (c == nullptr) {
+		return;
+	}
+	c->link = true;
+	if (writers != nullptr) {
+		writers->set_link(sock);
+	} else if (c->out != nullptr) {
+		c->out->weighted = true;
+	}
+}
+
+void connection_manager::delay_report(std::ostream &out) const
+{
+	histogram merged[TRAFFIC_CLASSES];
+	for (int cls = 0; cls < TRAFFIC_CLASSES; cls++) {
+		merged[cls].merge(delays[cls]);
+	}
+	if (writers != nullptr) {
+		writers->delays(merged);
+	}
+	out << "control_us ";
+	merged[CONTROL].print(out, 1000.0);
+	out << " bulk_us ";
+	merged[BULK].print(out, 1000.0);
+}
+
+void connection_manager::set_tracer(tracer *t)
+{
+	trace = t;
+}
+
+bool connection_manager::hand_over(std::vector<socket_state> &sockets)
+{
+	// the writers send what they can and return the rest
+	std::unordered_map<int, std::string> unsent;
+	if (writers != nullptr) {
+		writers->hand_over(unsent);
+		// the closes handed to them are done
+		collect_reports();
+		delete writers;
+		writers = nullptr;
+	}
+	for (size_t fd = 0; fd < conns.size(); fd++) {
+		connection &c = conns[fd];
+		c.closing = 0;
+		if (!c.open) {
+			continue;
+		}
+		socket_state s;
+		s.fd = static_cast<int>(fd);
+		s.link = c.link;
+		if (c.in != nullptr) {
+			s.in.assign(c.in->data, c.in->pos, std::string::npos);
+		}
+		if (c.out != nullptr) {
+			s.out = c.out->unsent();
+		}
+		auto found = unsent.find(s.fd);
+		if (found != unsent.end()) {
+			s.out += found->second;
+		}
+		sockets.push_back(std::move(s));
+	}
+	return true;
+}
+
+bool connection_manager::adopt_socket(const socket_state &s)
+{
+	if (add_socket(s.fd, EPOLLFLAGS) < 0) {
+		return false;
+	}
+	if (!s.in.empty()) {
+		conns[s.fd].in = new buffer();
+		conns[s.fd].in->data = s.in;
+		conns[s.fd].in->pos = 0;
+	}
+	if (s.link) {
+		set_link(s.fd);
+	}
+	if (!s.out.empty()) {
+		add_message(s.fd, std::string_view(s.out));
+	}
+	return true;
+}
+
+void connection_manager::resume(const std::vector<socket_state> &sockets)
+{
+	if (n_writers > 0) {
+		start_writers(n_writers);
+	}
+	for (auto &s : sockets) {
+		connection *c = find(s.fd);
+		if (c == nullptr) {
+			continue;
+		}
+		// what is still queued here starts the bytes returned
+		std::string_view rest(s.out);
+		if (c->out != nullptr) {
+			rest.remove_prefix(std::min(rest.size(), c->out->unsent().size()));
+		}
+		if (!rest.empty()) {
+			add_message(s.fd, rest);
+		}
+	}
+}
+
 int connection_manager::create_connection(std::string host, std::string port)
 {
+	std::string path;
+	if (unix_address(host, path)) {
+		// no checksums, acks or nagle, the port is not used
+		int sock = unix_connect(path);
+		if (sock == -1) {
+			perror("connect");
+			return -1;
+		}
+		if (set_socket_non_blocking(sock) != 0) {
+			close(sock);
+			return -1;
+		}
+		return watch_socket(sock, EPOLLFLAGS);
+	}
+
 	struct addrinfo *ainfo;
 	struct addrinfo hints;
 	std::memset(&hints, 0, sizeof hints);
@@ -358,39 +1415,31 @@ int connection_manager::create_connection(std::string host, std::string port)
 
 	if (sock == -1) {
 		perror("socket");
+		freeaddrinfo(ainfo);
 		return -1;
 	}
 
+	// not watched yet, a failed socket is only closed
 	int yes = 1;
 	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1) {
 		perror("setsockopt");
-		remove_socket(sock);
+		close(sock);
+		freeaddrinfo(ainfo);
 		return -1;
 	}
 
 	if (connect(sock, ainfo->ai_addr, ainfo->ai_addrlen) == -1) {
 		perror("connect");
-		remove_socket(sock);
+		close(sock);
+		freeaddrinfo(ainfo);
 		return -1;
 	}
+	freeaddrinfo(ainfo);
 
 	if (set_socket_non_blocking(sock) != 0) {
-		remove_socket(sock);
+		close(sock);
 		return -1;
 	}
 
-	struct epoll_event ev;
-
-	ev.events = EPOLLFLAGS;
-	ev.data.fd = sock;
-
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) != 0) {
-		perror("epoll_ctl: add sockfd failed.");
-		remove_socket(sock);
-		return -1;
-	}
-
-	socks.insert(sock);
-
-	return sock;
+	return watch_socket(sock, EPOLLFLAGS);
 }
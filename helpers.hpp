@@ -6,11 +6,33 @@
 #include <queue>
 #include <set>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unordered_map>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <random>
+
+class fanout_pool;
 
 #define MAX_EVENTS 30
 #define BUFLEN 2056 // max size of message
+#define READ_CHUNK 16384 // bytes taken from a socket per recv
 #define EPOLLFLAGS EPOLLIN | EPOLLET | EPOLLRDHUP
+#define DEFAULT_BACKLOG SOMAXCONN // capped by net.core.somaxconn
+#define TRAFFIC_CLASSES 2
+#define LINK_CONTROL_WEIGHT 4 // control lines per bulk line on server links
+#define DELAY_STAMP_NS 100000 // lines queued closer together share a stamp
+#define FLUSH_IOV 64 // segments per sendmsg
+#define HANDOFF_FDS 250 // descriptors per SCM_RIGHTS message, the kernel takes 253
+#define SPARE_BUFFERS 64 // emptied buffers kept for reuse, of each direction
+#define SPARE_BYTES 65536 // larger buffers are freed instead
+#define UNIX_PREFIX "unix:" // addresses unix:/path name a unix stream socket
 
 int set_socket_opt(int sockfd, int opt);
 
@@ -20,24 +42,394 @@ int set_socket_blocking(int sockfd);
 
 int set_socket_non_blocking(int sockfd);
 
-/* read socket to msgbuf and process messages */
-ssize_t sockfd_in(int sock, std::queue<std::string> &in_queue);
+/* appends what is readable from sock to in, up to about budget bytes,
+ * returns the last result of recv, 0 if the peer closed the connection and
+ * more than 0 if bytes may be left */
+ssize_t sockfd_in(int sock, std::string &in, size_t budget);
+
+/* unix stream socket listening at path, a file left there by a dead
+ * process is replaced. -1 on failure */
+int unix_listen(const std::string &path, int backlog = 1);
+
+/* true if address has the form unix:/path, path is set without the prefix */
+bool unix_address(std::string_view address, std::string &path);
+
+/* blocking unix stream socket connected to path, -1 if nobody listens */
+int unix_connect(const std::string &path);
+
+/* writes data with its length, then passes fds in batches of HANDOFF_FDS
+ * by SCM_RIGHTS */
+bool send_with_fds(int sock, const std::string &data, const std::vector<int> &fds);
+
+/* reads what send_with_fds wrote, the received fds are in the same order */
+bool receive_with_fds(int sock, std::string &data, std::vector<int> &fds);
+
+/* resident set size of this process in bytes, 0 if unknown */
+size_t resident_bytes();
+
+/* CLOCK_MONOTONIC in nanoseconds */
+uint64_t monotonic_ns();
+
+/* latency histogram with logarithmic buckets, each power of two is split
+ * into 16 linear steps so percentiles are within about 6% */
+class histogram
+{
+	private:
+		std::vector<uint64_t> buckets;
+
+		uint64_t total;
+
+		uint64_t sum;
+
+		uint64_t max_value;
+
+		static size_t bucket(uint64_t value);
+
+		static uint64_t bucket_value(size_t index);
+
+	public:
+		histogram();
+
+		void record(uint64_t value);
+
+		void merge(const histogram &other);
+
+		uint64_t count() const;
+
+		uint64_t max() const;
+
+		double mean() const;
+
+		/* value below which p percent of the samples fall */
+		uint64_t percentile(double p) const;
+
+		/* prints count, mean, p50, p90, p99 and max, values divided by scale */
+		void print(std::ostream &out, double scale) const;
+};
+
+/* allows rate events per second on average and bursts of up to burst */
+struct token_bucket
+{
+	double tokens;
+
+	/* time of the last take, 0 for a new bucket */
+	uint64_t last;
+
+	token_bucket() : tokens(0), last(0) {}
+
+	/* takes a token at now if one is left */
+	bool take(double rate, double burst, uint64_t now);
+};
+
+/* what a transport holds for one socket, handed to a new process on
+ * upgrade */
+struct socket_state
+{
+	int fd;
+
+	/* leads to another server */
+	bool link;
+
+	/* read but not yet fetched */
+	std::string in;
+
+	/* queued but not yet sent, starting at a line */
+	std::string out;
+};
+
+/* control lines overtake bulk lines in an output queue */
+enum traffic_class
+{
+	CONTROL,
+	BULK, // channel and private messages
+};
+
+/* class of a line by its command, the request id is skipped */
+traffic_class line_class(std::string_view line);
+
+/* the lines waiting for one socket, one lane per traffic class. Queued
+ * control lines are sent before bulk ones, except on weighted queues
+ * (server links) where every LINK_CONTROL_WEIGHT control lines let one bulk
+ * line through, so a stream of control lines cannot starve chat. A line is
+ * never interleaved with another one. */
+class out_queue
+{
+	private:
+		/* lines queued until byte end of a lane, the first one at time */
+		struct stamp
+		{
+			uint64_t time;
+
+			uint64_t end;
+		};
+
+		struct lane
+		{
+			std::string data;
+
+			size_t pos;
+
+			/* bytes ever queued and sent, for the stamps */
+			uint64_t queued;
+
+			uint64_t sent;
+
+			std::vector<stamp> stamps;
+
+			size_t first_stamp;
+
+			/* the line at pos was sent in part */
+			bool partial;
+		};
+
+		lane lanes[TRAFFIC_CLASSES];
+
+		/* next segments to send, in order */
+		size_t gather(struct iovec *iov, traffic_class *cls) const;
+
+		/* bytes were queued to a lane at now */
+		void stamp_queued(lane &l, size_t bytes, uint64_t now);
+
+		/* moves the lanes past sent bytes of the segments */
+		void advance(const struct iovec *iov, const traffic_class *cls, size_t count,
+				size_t sent, histogram *delays, size_t *lines);
+
+	public:
+		bool weighted;
+
+		out_queue();
+
+		void push(std::string &&line, traffic_class cls, uint64_t now);
+
+		void push(std::string_view line, traffic_class cls, uint64_t now);
+
+		bool empty() const;
+
+		/* bytes held */
+		size_t memory() const;
+
+		/* sends until the socket is full or the queue empty, returns errno
+		 * of the failed send or 0. Queueing delays go to delays by class,
+		 * the number of lines written to *lines unless nullptr. */
+		int flush(int sock, histogram *delays, size_t *lines);
+
+		/* drops what was sent, after a flush stopped with EAGAIN */
+		void compact();
+
+		/* empties the queue for another socket, its buffers are kept */
+		void reset();
+
+		/* the bytes not yet sent, a line sent in part first */
+		std::string unsent() const;
+};
+
+/* writes spans in the chrome trace event format to a file, one file per
+ * process. Timestamps are wall clock microseconds, so the files of several
+ * nodes can be merged into one trace (see trace_merge.sh). */
+class tracer
+{
+	private:
+		struct queued_line
+		{
+			/* position in the output queue of its socket */
+			uint64_t position;
+
+			uint64_t trace;
+
+			uint64_t enqueued;
+		};
+
+		/* counts the lines of one output queue to find the traced ones */
+		struct socket_lines
+		{
+			uint64_t enqueued;
+
+			uint64_t flushed;
+
+			std::deque<queued_line> traced;
+		};
+
+		std::ofstream out;
+
+		int pid;
+
+		/* one in sample_every ingress lines is traced */
+		unsigned sample_every;
 
-/* read socket to msgbuf and process messages */
-int sockfd_out(int sock, std::queue<std::string> &out_queue);
+		uint64_t ingress_seen;
+
+		std::mt19937_64 rng;
+
+		std::unordered_map<int, socket_lines> sockets;
+
+		bool dirty;
+
+		/* trace of the line being handled, lines queued meanwhile belong to it */
+		uint64_t current;
+
+		/* starts an event line up to the fields that differ per phase */
+		void begin_event(const std::string &name, char phase, uint64_t ts);
+
+	public:
+		tracer(const std::string &file, const std::string &name, unsigned sample);
+
+		~tracer();
+
+		bool good() const;
+
+		/* CLOCK_REALTIME in microseconds */
+		static uint64_t now_us();
+
+		/* a new trace id for one in sample_every calls, 0 otherwise */
+		uint64_t sample();
+
+		/* a complete event from start to end */
+		void span(const std::string &name, uint64_t trace, uint64_t start, uint64_t end);
+
+		/* links the spans of a trace across nodes, first at the ingress */
+		void hop(uint64_t trace, bool first, uint64_t ts);
+
+		/* the line with this trace is being handled, 0 when done */
+		void handling(uint64_t trace);
+
+		/* a line was queued for sock */
+		void enqueued(int sock, std::string_view line);
+
+		/* the first lines of the queue of sock were written */
+		void flushed(int sock, size_t lines);
+
+		void closed(int sock);
+
+		/* writes buffered events to the file */
+		void flush();
+};
+
+/* moves messages between a server and its connections, the server only
+ * talks to its peers through this interface */
+class transport
+{
+	public:
+		virtual ~transport() {}
+
+		/* wait at most timeout ms for events, -1 blocks
+		 * returns number of events */
+		virtual int wait_events(int timeout) = 0;
+
+		/* gets next event */
+		virtual bool next_event(struct epoll_event &ev) = 0;
+
+		/* adds a socket on wich to listen for incomming connections, port
+		 * may be unix:/path */
+		virtual int add_accepting(std::string port) = 0;
+
+		/* opens a new connection to host:port, or to the unix socket if
+		 * host is unix:/path */
+		virtual int create_connection(std::string host, std::string port) = 0;
+
+		/* accepts and adds one pending connection, returns the new socket
+		 * or -1 once none is left */
+		virtual int accept_client(int sock) = 0;
+
+		/* removes a client socket */
+		virtual bool remove_socket(int sock) = 0;
+
+		/* add message to the output queue for socket, the transport takes
+		 * the string and its buffer */
+		virtual bool add_message(int sock, std::string &&message) = 0;
+
+		/* add a copy of message, for lines relayed from a read buffer */
+		virtual bool add_message(int sock, std::string_view message)
+		{
+			return add_message(sock, std::string(message));
+		}
+
+		/* add message to the output queues of all socks */
+		virtual bool add_broadcast(const std::vector<int> &socks, std::string_view message)
+		{
+			bool ok = true;
+			for (int sock : socks) {
+				ok = add_message(sock, message) && ok;
+			}
+			return ok;
+		}
+
+		/* fetch next message from incoming queue of socket */
+		virtual bool fetch_message(int sock, std::string &msg) = 0;
+
+		/* receives at most about budget bytes from sock and places them in
+		 * the queue, false if the connection is gone. more tells if bytes
+		 * may be left in the socket, its event does not come again then */
+		virtual bool receive_messages(int sock, size_t budget, bool &more) = 0;
+
+		/* sends as many messages as possible */
+		virtual bool send_messages(int sock) = 0;
+
+		/* records queued and flushed lines, nullptr stops it */
+		virtual void set_tracer(tracer *t) {}
+
+		/* writes the memory held for connections */
+		virtual void memory_report(std::ostream &out) const {}
+
+		/* sock leads to another server, control lines do not starve its
+		 * bulk lines */
+		virtual void set_link(int sock) {}
+
+		/* writes the time lines spent in output queues by class */
+		virtual void delay_report(std::ostream &out) const {}
+
+		/* stops sending and returns every open socket with its buffers,
+		 * false if the transport cannot hand its sockets over */
+		virtual bool hand_over(std::vector<socket_state> &sockets) { return false; }
+
+		/* polls a socket handed over by another process, with its buffers */
+		virtual bool adopt_socket(const socket_state &s) { return false; }
+
+		/* time in ns for the topology: link round trips, TOPO and LINKPING
+		 * timers. A simulated network counts its own steps */
+		virtual uint64_t clock_ns() const { return monotonic_ns(); }
+
+		/* sending goes on after a hand_over the new process did not take,
+		 * with the buffers hand_over returned */
+		virtual void resume(const std::vector<socket_state> &sockets) {}
+};
 
 /* manages connections with epoll */
-class connection_manager
+class connection_manager : public transport
 {
 	private:
-		/* input messages from network per socket */
-		std::unordered_map<int, std::queue<std::string>> in_queues;
+		/* bytes of one direction, from pos on */
+		struct buffer
+		{
+			std::string data;
+
+			size_t pos;
+		};
+
+		/* one entry per fd, idle connections hold no buffers */
+		struct connection
+		{
+			/* read but not yet fetched, nullptr when empty */
+			buffer *in;
+
+			/* queued but not yet sent, nullptr when empty */
+			out_queue *out;
+
+			/* flags registered with epoll */
+			uint32_t flags;
+
+			bool open;
+
+			/* closes handed to the writers and not yet done */
+			uint8_t closing;
 
-		/* output messages to network per socket */
-		std::unordered_map<int, std::queue<std::string>> out_queues;
+			/* leads to another server */
+			bool link;
+		};
 
-		/* set of all fds */
-		std::set<int> socks;
+		/* indexed by fd */
+		std::vector<connection> conns;
+
+		size_t open_count;
 
 		int epollfd;
 
@@ -49,29 +441,85 @@ class connection_manager
 
 		int next_event_pos;
 
+		/* nullptr unless tracing */
+		tracer *trace;
+
+		/* listen queue length for add_accepting */
+		int backlog;
+
+		/* lets several sockets listen on one port */
+		bool reuse_port;
+
+		/* spare descriptor given up to accept and close a connection when
+		 * the process is out of them, -1 if it could not be opened */
+		int reserve_fd;
+
+		/* accepts one queued connection on sock with the spare descriptor
+		 * and closes it, false if there was none */
+		bool shed_connection(int sock);
+
+		/* nullptr unless writer threads send the output queues */
+		fanout_pool *writers;
+
+		/* threads started by start_writers */
+		unsigned n_writers;
+
+		/* emptied buffers, taken before new ones are allocated so a
+		 * connection that goes idle after each line does not allocate
+		 * for the next one */
+		std::vector<buffer*> spare_in;
+
+		std::vector<out_queue*> spare_out;
+
+		buffer *take_in();
+
+		out_queue *take_out(bool link);
+
+		/* keeps b for reuse or frees it, b may be nullptr */
+		void give_back(buffer *b);
+
+		void give_back(out_queue *q);
+
+		/* failed sends reported by the writers, returned as hangups */
+		std::deque<struct epoll_event> hangups;
+
+		/* takes the reports of the writers */
+		void collect_reports();
+
+		/* time from queued to sent by traffic class */
+		histogram delays[TRAFFIC_CLASSES];
+
 		bool epoll_mod(int sock, uint32_t event_flags);
 
+		/* entry of an open socket, nullptr for others */
+		connection *find(int sock);
+
+		/* polls an already non blocking socket */
+		int watch_socket(int sockfd, uint32_t flags);
+
 	public:
-		connection_manager();
+		connection_manager(int listen_backlog = DEFAULT_BACKLOG, bool reuse = false);
 
 		~connection_manager();
 
 		/* wait for next event and write events to *events*
 		 * returns number of events */
-		int wait_events();
+		int wait_events(int timeout = -1);
 
 		/* gets next event from events */
 		bool next_event(struct epoll_event &ev);
 
-		/* adds a socket on wich to listen for incomming connections
+		/* adds a socket on wich to listen for incomming connections, a
+		 * tcp port or unix:/path
 		 * returns the new socket
 		 */
 		int add_accepting(std::string port);
 
-		/* opens a new connection to host:port */
+		/* opens a new connection to host:port or unix:/path */
 		int create_connection(std::string host, std::string port);
 
-		/* accepts and adds a client socket, returns the new socket*/
+		/* accepts and adds one pending connection, returns the new socket
+		 * or -1 once none is left */
 		int accept_client(int sock);
 
 		/* removes a client socket */
@@ -84,17 +532,38 @@ class connection_manager
 		bool continue_write(int socket);
 
 		/* add message to the output queue for socket */
-		bool add_message(int sock, std::string message);
+		bool add_message(int sock, std::string &&message);
+
+		bool add_message(int sock, std::string_view message);
+
+		bool add_broadcast(const std::vector<int> &socks, std::string_view message);
+
+		/* from now on n threads write to the sockets, false if n is 0 */
+		bool start_writers(unsigned n);
 
 		/* fetch next message from incoming queue of socket */
 		bool fetch_message(int sock, std::string &msg);
 
 		/* receives new messages from sock and places them in the queue */
-		bool receive_messages(int sock);
+		bool receive_messages(int sock, size_t budget, bool &more);
 
 		/* sends as many messages as possible */
 		bool send_messages(int sock);
 
+		void memory_report(std::ostream &out) const;
+
+		void set_link(int sock);
+
+		void delay_report(std::ostream &out) const;
+
+		void set_tracer(tracer *t);
+
+		bool hand_over(std::vector<socket_state> &sockets);
+
+		bool adopt_socket(const socket_state &s);
+
+		void resume(const std::vector<socket_state> &sockets);
+
 		/* adds a socket to the poll set */
 		int add_socket(int sockfd, int flags);
 };
@@ -0,0 +1,203 @@
+#include "helpers.hpp"
+#include "data.hpp"
+#include "log.hpp"
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* opens many client connections to one ibrcd, joins them to a channel and
+ * sends timestamped channel messages at a fixed rate. With -P n every n-th
+ * message is a PRIVMSG to another client of the same node instead. Prints
+ * one report line with the received throughput and the delivery latency. */
+
+#define USAGE "usage: ibrcload [-h host|unix:path] [-p port] [-i node id] [-c clients] [-C channel] [-r msgs/s per client] [-d seconds] [-P every n-th a PRIVMSG]"
+
+struct load_client
+{
+	std::string host;
+
+	std::string nick;
+
+	bool joined;
+};
+
+int main(int argc, char* argv[])
+{
+	std::string host = "localhost";
+	std::string port = DEFAULT_PORT;
+	std::string id = "0";
+	std::string chan = "load";
+	size_t n_clients = 10;
+	double rate = 10;
+	double seconds = 5;
+	uint64_t privmsg_every = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:i:c:C:r:d:P:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'i':
+				id = optarg;
+				break;
+			case 'c':
+				n_clients = std::stoul(optarg);
+				break;
+			case 'C':
+				chan = optarg;
+				break;
+			case 'r':
+				rate = std::stod(optarg);
+				break;
+			case 'd':
+				seconds = std::stod(optarg);
+				break;
+			case 'P':
+				privmsg_every = std::stoull(optarg);
+				break;
+			default:
+				std::cerr << USAGE << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	// connection_manager logs every line at trace level
+	logger::set_level(LOG_WARN);
+
+	connection_manager conman;
+	std::unordered_map<int, load_client> clients;
+	std::vector<int> socks;
+
+	for (size_t i = 0; i < n_clients; i++) {
+		int sock = conman.create_connection(host, port);
+		if (sock == -1) {
+			std::cerr << "ibrcload: failed to connect" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		load_client c;
+		c.host = "load" + id + "-" + std::to_string(i);
+		c.nick = "l" + id + "x" + std::to_string(i);
+		c.joined = false;
+		conman.add_message(sock, "CONNECT " + c.host + "\n");
+		conman.add_message(sock, "NICK " + c.host + " " + c.nick + "\n");
+		clients[sock] = c;
+		socks.push_back(sock);
+	}
+
+	histogram latency;
+	size_t joined = 0;
+	uint64_t slots = 0;
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t join_deadline = monotonic_ns() + 10000000000ULL;
+	uint64_t start = 0;
+	uint64_t stop = 0;
+	uint64_t drain = 0;
+	double total_rate = rate * static_cast<double>(n_clients);
+
+	while (true) {
+		uint64_t now = monotonic_ns();
+		if (start == 0 && (joined == n_clients || now > join_deadline)) {
+			start = now;
+			stop = start + static_cast<uint64_t>(seconds * 1e9);
+			drain = stop + 1000000000ULL;
+		}
+		if (start != 0 && now > drain) {
+			break;
+		}
+
+		if (start != 0 && now < stop && !socks.empty()) {
+			double elapsed = static_cast<double>(now - start) / 1e9;
+			uint64_t due = static_cast<uint64_t>(elapsed * total_rate);
+			while (slots < due) {
+				int sock = socks[slots % socks.size()];
+				load_client &c = clients[sock];
+				if (c.joined) {
+					std::ostringstream msg;
+					if (privmsg_every > 0 && slots % privmsg_every == 0) {
+						const load_client &to = clients[socks[(slots + 1) % socks.size()]];
+						msg << "PRIVMSG " << c.host << " " << c.nick << " " << chan
+							<< " " << to.nick << " t=" << monotonic_ns() << "\n";
+					} else {
+						msg << "MSG " << c.host << " " << c.nick << " " << chan
+							<< " t=" << monotonic_ns() << "\n";
+					}
+					conman.add_message(sock, msg.str());
+					sent++;
+				}
+				slots++;
+			}
+		}
+
+		if (conman.wait_events(1) == -1) {
+			break;
+		}
+
+		struct epoll_event ev;
+		while (conman.next_event(ev)) {
+			int sock = ev.data.fd;
+			if (ev.events & EPOLLRDHUP || ev.events & EPOLLERR || ev.events & EPOLLHUP) {
+				std::cerr << "ibrcload: server closed connection" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			if (ev.events & EPOLLOUT) {
+				conman.send_messages(sock);
+			}
+			bool more;
+			if (!(ev.events & EPOLLIN) || !conman.receive_messages(sock, SIZE_MAX, more)) {
+				continue;
+			}
+			std::string line;
+			while (conman.fetch_message(sock, line)) {
+				load_client &c = clients[sock];
+				take_request_id(line);
+				std::istringstream in(line);
+				std::string name;
+				msg_type type = STATUS;
+				if (!(in >> name) || !parse_msg_type(name, type)) {
+					continue; // empty or unknown line
+				}
+				if (type == NICKRES) {
+					conman.add_message(sock, "JOIN " + c.host + " " + chan + "\n");
+				} else if (type == CHANNEL && !c.joined) {
+					c.joined = true;
+					joined++;
+				} else if (type == MSG) {
+					size_t stamp = line.rfind(" t=");
+					if (stamp != std::string::npos) {
+						uint64_t t = std::stoull(line.substr(stamp + 3));
+						latency.record(monotonic_ns() - t);
+						received++;
+					}
+				}
+			}
+		}
+	}
+
+	for (int sock : socks) {
+		conman.add_message(sock, "QUIT " + clients[sock].host + "\n");
+		conman.send_messages(sock);
+	}
+
+	double measured = seconds > 0 ? seconds : 1;
+	std::string path;
+	std::cout << "node " << id << " port " << (unix_address(host, path) ? host : port)
+		<< " clients " << joined << "/" << n_clients
+		<< " sent " << sent
+		<< " received " << received
+		<< " recv/s " << static_cast<uint64_t>(static_cast<double>(received) / measured)
+		<< " latency_us ";
+	latency.print(std::cout, 1000.0);
+	std::cout << std::endl;
+
+	return 0;
+}
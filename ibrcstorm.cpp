@@ -0,0 +1,219 @@
+#include "helpers.hpp"
+#include "data.hpp"
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+/* keeps a fixed number of connection attempts in flight against one ibrcd,
+ * like clients reconnecting after a restart. Every attempt connects, sends
+ * CONNECT and waits for the STATUS reply. Prints one report line with the
+ * completed connects per second and the time from connect to reply.
+ * With -k the connections stay open and idle for the given seconds, so the
+ * memory of the server can be measured. */
+
+#define USAGE "usage: ibrcstorm [-h host] [-p port] [-i node id] [-c connections in flight] [-d seconds] [-k]"
+
+struct attempt
+{
+	uint64_t started;
+
+	bool sent;
+};
+
+int main(int argc, char* argv[])
+{
+	std::string host = "localhost";
+	std::string port = DEFAULT_PORT;
+	std::string id = "0";
+	size_t in_flight = 256;
+	double seconds = 5;
+	bool hold = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:i:c:d:k")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'i':
+				id = optarg;
+				break;
+			case 'c':
+				in_flight = std::stoul(optarg);
+				break;
+			case 'd':
+				seconds = std::stod(optarg);
+				break;
+			case 'k':
+				hold = true;
+				break;
+			default:
+				std::cerr << USAGE << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *ainfo;
+	std::memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &ainfo);
+	if (status != 0) {
+		std::cerr << "getaddrinfo: " << gai_strerror(status) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int epollfd = epoll_create1(0);
+	if (epollfd == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	std::unordered_map<int, attempt> attempts;
+	std::vector<int> held;
+	histogram latency;
+	uint64_t opened = 0;
+	uint64_t completed = 0;
+	uint64_t failed = 0;
+	uint64_t start = monotonic_ns();
+	// held connections are all opened at once, at most for 30 s
+	uint64_t stop = start + static_cast<uint64_t>(hold ? 30e9 : seconds * 1e9);
+	uint64_t drain = stop + 2000000000ULL;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (true) {
+		uint64_t now = monotonic_ns();
+		if (now > drain || (now > stop && attempts.empty())) {
+			break;
+		}
+
+		if (hold && opened == in_flight && attempts.empty()) {
+			break;
+		}
+
+		while (now < stop && attempts.size() < in_flight && (!hold || opened < in_flight)) {
+			int sock = socket(ainfo->ai_family, ainfo->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					ainfo->ai_protocol);
+			if (sock == -1) {
+				perror("socket");
+				exit(EXIT_FAILURE);
+			}
+			// closes with a reset, otherwise TIME_WAIT runs out of local ports
+			struct linger lin;
+			lin.l_onoff = 1;
+			lin.l_linger = 0;
+			setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof lin);
+
+			if (connect(sock, ainfo->ai_addr, ainfo->ai_addrlen) == -1 && errno != EINPROGRESS) {
+				perror("connect");
+				close(sock);
+				failed++;
+				continue;
+			}
+			struct epoll_event ev;
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+			ev.data.fd = sock;
+			if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+				perror("epoll_ctl");
+				exit(EXIT_FAILURE);
+			}
+			attempt a;
+			a.started = now;
+			a.sent = false;
+			attempts[sock] = a;
+			opened++;
+		}
+
+		int count = epoll_wait(epollfd, events, MAX_EVENTS, 1);
+		if (count == -1) {
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < count; i++) {
+			int sock = events[i].data.fd;
+			attempt &a = attempts[sock];
+			bool done = false;
+			bool ok = false;
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+				done = true;
+			} else {
+				if (!a.sent && events[i].events & EPOLLOUT) {
+					std::string line = "CONNECT storm" + id + "-" + std::to_string(opened) + "-"
+						+ std::to_string(sock) + "\n";
+					if (send(sock, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+						done = true;
+					} else {
+						a.sent = true;
+						struct epoll_event ev;
+						ev.events = EPOLLIN | EPOLLRDHUP;
+						ev.data.fd = sock;
+						epoll_ctl(epollfd, EPOLL_CTL_MOD, sock, &ev);
+					}
+				}
+				if (a.sent && events[i].events & EPOLLIN) {
+					char buf[BUFLEN];
+					ssize_t n = recv(sock, buf, sizeof buf, 0);
+					done = true;
+					ok = n > 0 && std::memchr(buf, '\n', static_cast<size_t>(n)) != nullptr;
+				}
+			}
+
+			if (done) {
+				if (ok) {
+					latency.record(monotonic_ns() - a.started);
+					completed++;
+				} else {
+					failed++;
+				}
+				attempts.erase(sock);
+				if (ok && hold) {
+					epoll_ctl(epollfd, EPOLL_CTL_DEL, sock, nullptr);
+					held.push_back(sock);
+				} else {
+					close(sock);
+				}
+			}
+		}
+	}
+
+	failed += attempts.size(); // no reply before the deadline
+	for (auto &a : attempts) {
+		close(a.first);
+	}
+	freeaddrinfo(ainfo);
+
+	double measured = seconds > 0 ? seconds : 1;
+	if (hold) {
+		measured = static_cast<double>(monotonic_ns() - start) / 1e9;
+		std::cerr << "ibrcstorm: holding " << held.size() << " connections" << std::endl;
+		usleep(static_cast<useconds_t>(seconds * 1e6));
+		for (int sock : held) {
+			close(sock);
+		}
+	}
+	std::cout << "node " << id << " port " << port
+		<< " in_flight " << in_flight
+		<< " connects " << completed
+		<< " failed " << failed
+		<< " held " << held.size()
+		<< " connects/s " << static_cast<uint64_t>(static_cast<double>(completed) / measured)
+		<< " latency_us ";
+	latency.print(std::cout, 1000.0);
+	std::cout << std::endl;
+
+	return 0;
+}
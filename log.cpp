@@ -0,0 +1,151 @@
+#include "log.hpp"
+#include <cstring>
+#include <strings.h>
+#include <cstdio>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef DEBUG
+log_level logger::max_level = LOG_TRACE;
+#else
+log_level logger::max_level = LOG_INFO;
+#endif
+
+unsigned logger::categories = LOG_ALL;
+
+int logger::out_fd = STDOUT_FILENO;
+
+thread_local logger::buffer logger::records;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+static const char *category_name(uint8_t category)
+{
+	switch (category) {
+		case LOG_NET:
+			return "net";
+		case LOG_PROTO:
+			return "proto";
+		case LOG_SERVER:
+			return "server";
+		case LOG_CLIENT:
+			return "client";
+		default:
+			return "-";
+	}
+}
+
+static const size_t BUFFER_SIZE = 1 << 20;
+
+logger::buffer::buffer()
+	: bytes(BUFFER_SIZE), used(0)
+{
+}
+
+logger::buffer::~buffer()
+{
+	logger::flush();
+}
+
+void logger::write(log_level level, log_category category, const char *prefix, const char *text, size_t length)
+{
+	size_t size = sizeof(record) + length;
+	if (size > records.bytes.size()) {
+		length = records.bytes.size() - sizeof(record);
+		size = records.bytes.size();
+	}
+	if (records.used + size > records.bytes.size()) {
+		flush();
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	record r;
+	r.time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+	r.prefix = prefix;
+	r.length = static_cast<uint32_t>(length);
+	r.level = static_cast<uint8_t>(level);
+	r.category = static_cast<uint8_t>(category);
+
+	char *at = records.bytes.data() + records.used;
+	std::memcpy(at, &r, sizeof(record));
+	std::memcpy(at + sizeof(record), text, length);
+	// keeps the next record aligned
+	records.used += (size + alignof(record) - 1) / alignof(record) * alignof(record);
+}
+
+void logger::write(log_level level, log_category category, const char *prefix, const char *text)
+{
+	write(level, category, prefix, text, std::strlen(text));
+}
+
+void logger::flush()
+{
+	if (records.used == 0) {
+		return;
+	}
+
+	std::string out;
+	out.reserve(records.used + records.used / 2);
+	size_t pos = 0;
+	char stamp[64];
+	while (pos < records.used) {
+		record r;
+		std::memcpy(&r, records.bytes.data() + pos, sizeof(record));
+		const char *text = records.bytes.data() + pos + sizeof(record);
+
+		std::snprintf(stamp, sizeof(stamp), "%llu.%06llu %s %s ",
+				static_cast<unsigned long long>(r.time_ns / 1000000000ULL),
+				static_cast<unsigned long long>(r.time_ns % 1000000000ULL / 1000),
+				level_names[r.level], category_name(r.category));
+		out += stamp;
+		out += r.prefix;
+		out.append(text, r.length);
+		if (r.length == 0 || text[r.length - 1] != '\n') {
+			out += '\n';
+		}
+
+		size_t size = sizeof(record) + r.length;
+		pos += (size + alignof(record) - 1) / alignof(record) * alignof(record);
+	}
+	records.used = 0;
+
+	size_t written = 0;
+	while (written < out.size()) {
+		ssize_t n = ::write(out_fd, out.data() + written, out.size() - written);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		} else if (n < 1) {
+			break; // nowhere to log to
+		}
+		written += static_cast<size_t>(n);
+	}
+}
+
+void logger::set_level(log_level level)
+{
+	max_level = level;
+}
+
+void logger::set_categories(unsigned mask)
+{
+	categories = mask;
+}
+
+void logger::set_output(int fd)
+{
+	out_fd = fd;
+}
+
+bool logger::parse_level(const std::string &name, log_level &level)
+{
+	for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+		if (strcasecmp(name.c_str(), level_names[i]) == 0) {
+			level = static_cast<log_level>(i);
+			return true;
+		}
+	}
+	return false;
+}
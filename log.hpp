@@ -0,0 +1,115 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+enum log_level
+{
+	LOG_ERROR,
+	LOG_WARN,
+	LOG_INFO,
+	LOG_DEBUG,
+	LOG_TRACE,
+};
+
+/* bits of the category mask */
+enum log_category
+{
+	LOG_NET = 1,
+	LOG_PROTO = 2,
+	LOG_SERVER = 4,
+	LOG_CLIENT = 8,
+	LOG_ALL = 15,
+};
+
+/* levels above LOG_MAX_LEVEL are compiled out */
+#ifndef LOG_MAX_LEVEL
+#ifdef DEBUG
+#define LOG_MAX_LEVEL LOG_TRACE
+#else
+#define LOG_MAX_LEVEL LOG_INFO
+#endif
+#endif
+
+/* logs prefix followed by text, a string, string_view or C string */
+#define LOG(level, category, prefix, text) \
+	do { \
+		if ((level) <= LOG_MAX_LEVEL && logger::enabled(level, category)) { \
+			logger::write(level, category, prefix, text); \
+		} \
+	} while (0)
+
+/* the hot path only copies records into a buffer of its thread, flush
+ * formats them and writes them with one system call. Event loops flush
+ * once per round, a full buffer is flushed on the spot. */
+class logger
+{
+	private:
+		struct record
+		{
+			uint64_t time_ns;
+
+			/* a string literal */
+			const char *prefix;
+
+			uint32_t length;
+
+			uint8_t level;
+
+			uint8_t category;
+		};
+
+		class buffer
+		{
+			public:
+				std::vector<char> bytes;
+
+				size_t used;
+
+				buffer();
+
+				~buffer();
+		};
+
+		static log_level max_level;
+
+		static unsigned categories;
+
+		static int out_fd;
+
+		static thread_local buffer records;
+
+	public:
+		static bool enabled(log_level level, log_category category)
+		{
+			return level <= max_level && (categories & category) != 0;
+		}
+
+		static void write(log_level level, log_category category, const char *prefix, const char *text, size_t length);
+
+		static void write(log_level level, log_category category, const char *prefix, std::string_view text)
+		{
+			write(level, category, prefix, text.data(), text.size());
+		}
+
+		static void write(log_level level, log_category category, const char *prefix, const char *text);
+
+		/* formats and writes the records of this thread */
+		static void flush();
+
+		static void set_level(log_level level);
+
+		/* mask of log_category bits */
+		static void set_categories(unsigned mask);
+
+		static void set_output(int fd);
+
+		/* error, warn, info, debug or trace, false if name is none of them */
+		static bool parse_level(const std::string &name, log_level &level);
+};
+
+#endif /* LOG_HPP */
@@ -0,0 +1,319 @@
+#include "loopback.hpp"
+
+loopback_hub::loopback_hub()
+	: now(0), server_lines(0), client_lines_sent(0), client_lines_received(0)
+{
+}
+
+int loopback_hub::new_endpoint(loopback_transport *owner)
+{
+	endpoint ep;
+	ep.owner = owner;
+	ep.peer = -1;
+	ep.closed = false;
+	ep.listening = false;
+	ep.attached = true;
+	ep.ready = false;
+	ep.in_head = 0;
+	endpoints.push_back(ep);
+	return static_cast<int>(endpoints.size() - 1);
+}
+
+void loopback_hub::mark_ready(int ep)
+{
+	endpoint &e = endpoints[ep];
+	if (e.ready || e.closed || !e.attached) {
+		return;
+	}
+	e.ready = true;
+	if (e.owner != nullptr) {
+		e.owner->ready.push_back(ep);
+	} else {
+		client_ready.push_back(ep);
+	}
+}
+
+void loopback_hub::deliver(int from, int ep, std::string_view text)
+{
+	endpoint &e = endpoints[ep];
+	if (e.closed) {
+		return;
+	}
+	bool from_server = endpoints[from].owner != nullptr;
+
+	size_t start = 0;
+	size_t end;
+	while ((end = text.find('\n', start)) != std::string_view::npos) {
+		line l;
+		l.due = now + 1;
+		l.text.swap(e.partial);
+		l.text += text.substr(start, end - start + 1);
+		e.in.push_back(std::move(l));
+		start = end + 1;
+
+		if (e.owner != nullptr) {
+			e.owner->received++;
+			if (from_server) {
+				server_lines++;
+			}
+		} else {
+			client_lines_received++;
+		}
+	}
+	e.partial += text.substr(start);
+	in_flight.push_back(std::make_pair(now + 1, ep));
+}
+
+bool loopback_hub::readable(int ep) const
+{
+	const endpoint &e = endpoints[ep];
+	return e.in_head < e.in.size() && e.in[e.in_head].due <= now;
+}
+
+uint64_t loopback_hub::step() const
+{
+	return now;
+}
+
+bool loopback_hub::advance()
+{
+	if (in_flight.empty()) {
+		return false;
+	}
+	now++;
+	while (!in_flight.empty() && in_flight.front().first <= now) {
+		mark_ready(in_flight.front().second);
+		in_flight.pop_front();
+	}
+	return true;
+}
+
+int loopback_hub::connect_client(std::string host, std::string port)
+{
+	auto found = listeners.find(host + ":" + port);
+	if (found == listeners.end()) {
+		return -1;
+	}
+	int listener = found->second;
+
+	int local = new_endpoint(nullptr);
+	int remote = new_endpoint(endpoints[listener].owner);
+	endpoints[local].peer = remote;
+	endpoints[remote].peer = local;
+	endpoints[remote].attached = false;
+	endpoints[listener].backlog.push_back(remote);
+	in_flight.push_back(std::make_pair(now + 1, listener));
+	return local;
+}
+
+bool loopback_hub::client_send(int ep, std::string text)
+{
+	if (endpoints[ep].closed || endpoints[ep].peer < 0) {
+		return false;
+	}
+	client_lines_sent++;
+	deliver(ep, endpoints[ep].peer, text);
+	return true;
+}
+
+bool loopback_hub::client_receive(int ep, std::string &text)
+{
+	endpoint &e = endpoints[ep];
+	if (!readable(ep)) {
+		return false;
+	}
+	text.swap(e.in[e.in_head].text);
+	e.in_head++;
+	if (e.in_head == e.in.size()) {
+		e.in.clear();
+		e.in_head = 0;
+	}
+	return true;
+}
+
+std::vector<int> loopback_hub::take_client_ready()
+{
+	std::vector<int> eps;
+	eps.swap(client_ready);
+	for (int ep : eps) {
+		endpoints[ep].ready = false;
+	}
+	return eps;
+}
+
+void loopback_hub::client_close(int ep)
+{
+	close(ep);
+}
+
+void loopback_hub::fail(const loopback_transport *t)
+{
+	for (auto l = listeners.begin(); l != listeners.end();) {
+		l = endpoints[l->second].owner == t ? listeners.erase(l) : std::next(l);
+	}
+	for (size_t ep = 0; ep < endpoints.size(); ep++) {
+		if (endpoints[ep].owner == t && !endpoints[ep].closed) {
+			close(static_cast<int>(ep));
+		}
+	}
+}
+
+void loopback_hub::close(int ep)
+{
+	endpoint &e = endpoints[ep];
+	e.closed = true;
+	e.in.clear();
+	e.in_head = 0;
+	if (e.peer >= 0) {
+		in_flight.push_back(std::make_pair(now + 1, e.peer));
+	}
+}
+
+uint64_t loopback_hub::lines_in(const loopback_transport *t) const
+{
+	return t->received;
+}
+
+loopback_transport::loopback_transport(loopback_hub &network, std::string hostname)
+	: hub(network), host(hostname), next_event_pos(0), received(0)
+{
+}
+
+bool loopback_transport::pending() const
+{
+	return !ready.empty();
+}
+
+int loopback_transport::wait_events(int timeout)
+{
+	events.clear();
+	next_event_pos = 0;
+
+	std::deque<int> again;
+	while (!ready.empty()) {
+		int ep = ready.front();
+		ready.pop_front();
+		loopback_hub::endpoint &e = hub.endpoints[ep];
+		e.ready = false;
+		if (e.closed) {
+			continue;
+		}
+
+		struct epoll_event ev;
+		ev.data.fd = ep;
+		if (e.listening) {
+			if (!e.backlog.empty()) { // one edge for all queued connections
+				ev.events = EPOLLIN;
+				events.push_back(ev);
+			}
+		} else if (hub.readable(ep)) {
+			ev.events = EPOLLIN;
+			events.push_back(ev);
+			if (e.peer >= 0 && hub.endpoints[e.peer].closed) {
+				again.push_back(ep); // hang up once the lines are read
+			}
+		} else if (e.peer >= 0 && hub.endpoints[e.peer].closed) {
+			ev.events = EPOLLRDHUP;
+			events.push_back(ev);
+		}
+	}
+
+	for (int ep : again) {
+		hub.mark_ready(ep);
+	}
+
+	return static_cast<int>(events.size());
+}
+
+bool loopback_transport::next_event(struct epoll_event &ev)
+{
+	while (next_event_pos < events.size()) {
+		ev = events[next_event_pos];
+		next_event_pos++;
+		if (!hub.endpoints[ev.data.fd].closed) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int loopback_transport::add_accepting(std::string port)
+{
+	std::string address = host + ":" + port;
+	if (hub.listeners.find(address) != hub.listeners.end()) {
+		return -1;
+	}
+	int ep = hub.new_endpoint(this);
+	hub.endpoints[ep].listening = true;
+	hub.listeners[address] = ep;
+	return ep;
+}
+
+int loopback_transport::create_connection(std::string dest, std::string port)
+{
+	int ep = hub.connect_client(dest, port);
+	if (ep != -1) {
+		hub.endpoints[ep].owner = this;
+	}
+	return ep;
+}
+
+int loopback_transport::accept_client(int sock)
+{
+	std::vector<int> &backlog = hub.endpoints[sock].backlog;
+	if (backlog.empty()) {
+		return -1;
+	}
+	int ep = backlog.front();
+	backlog.erase(backlog.begin());
+	hub.endpoints[ep].attached = true;
+	if (hub.readable(ep) || hub.endpoints[hub.endpoints[ep].peer].closed) {
+		hub.mark_ready(ep);
+	}
+	return ep;
+}
+
+bool loopback_transport::remove_socket(int sock)
+{
+	hub.close(sock);
+	return true;
+}
+
+bool loopback_transport::add_message(int sock, std::string &&message)
+{
+	return add_message(sock, std::string_view(message));
+}
+
+bool loopback_transport::add_message(int sock, std::string_view message)
+{
+	if (sock < 0 || static_cast<size_t>(sock) >= hub.endpoints.size()) {
+		return false;
+	}
+	loopback_hub::endpoint &e = hub.endpoints[sock];
+	if (e.closed || e.peer < 0) {
+		return false;
+	}
+	hub.deliver(sock, e.peer, message);
+	return true;
+}
+
+bool loopback_transport::fetch_message(int sock, std::string &msg)
+{
+	return hub.client_receive(sock, msg);
+}
+
+bool loopback_transport::receive_messages(int sock, size_t budget, bool &more)
+{
+	more = false; // lines are taken one by one in fetch_message
+	return !hub.endpoints[sock].closed;
+}
+
+bool loopback_transport::send_messages(int sock)
+{
+	return true;
+}
+
+uint64_t loopback_transport::clock_ns() const
+{
+	return hub.step() * LOOPBACK_STEP_NS;
+}
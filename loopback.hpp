@@ -0,0 +1,175 @@
+#ifndef LOOPBACK_HPP
+#define LOOPBACK_HPP
+
+#include "helpers.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+
+#define LOOPBACK_STEP_NS 1000 // simulated time of one step, rtts in us count steps
+
+class loopback_transport;
+
+/* in process network for loopback_transports. Lines sent over a link become
+ * readable one step later, so a simulation advances in deterministic hops. */
+class loopback_hub
+{
+	private:
+		struct line
+		{
+			uint64_t due;
+
+			std::string text;
+		};
+
+		struct endpoint
+		{
+			/* nullptr for endpoints driven by the caller (virtual clients) */
+			loopback_transport *owner;
+
+			/* other end of the link, -1 for listeners */
+			int peer;
+
+			bool closed;
+
+			bool listening;
+
+			/* accepted by the owner, events are held back until then */
+			bool attached;
+
+			/* already queued on the owner's ready list */
+			bool ready;
+
+			std::vector<line> in;
+
+			size_t in_head;
+
+			/* bytes after the last newline, like a tcp stream */
+			std::string partial;
+
+			/* connections waiting for accept, for listeners */
+			std::vector<int> backlog;
+		};
+
+		std::vector<endpoint> endpoints;
+
+		/* host:port to listening endpoint */
+		std::unordered_map<std::string, int> listeners;
+
+		/* endpoints that receive lines, in delivery order */
+		std::deque<std::pair<uint64_t, int>> in_flight;
+
+		/* client endpoints that have lines to take */
+		std::vector<int> client_ready;
+
+		uint64_t now;
+
+		int new_endpoint(loopback_transport *owner);
+
+		void mark_ready(int ep);
+
+		/* appends text from the endpoint from to the stream of ep,
+		 * complete lines are due next step */
+		void deliver(int from, int ep, std::string_view text);
+
+		void close(int ep);
+
+		bool readable(int ep) const;
+
+		friend class loopback_transport;
+
+	public:
+		/* lines carried between two transports */
+		uint64_t server_lines;
+
+		/* lines sent by client endpoints */
+		uint64_t client_lines_sent;
+
+		/* lines delivered to client endpoints */
+		uint64_t client_lines_received;
+
+		loopback_hub();
+
+		/* current step */
+		uint64_t step() const;
+
+		/* advances one step and makes the lines due now readable,
+		 * returns false if nothing is in flight */
+		bool advance();
+
+		/* connects an endpoint driven by the caller to host:port */
+		int connect_client(std::string host, std::string port);
+
+		/* sends a line from a client endpoint */
+		bool client_send(int ep, std::string line);
+
+		/* takes the readable lines of a client endpoint */
+		bool client_receive(int ep, std::string &line);
+
+		/* client endpoints with readable lines since the last call */
+		std::vector<int> take_client_ready();
+
+		void client_close(int ep);
+
+		/* closes every endpoint of t and its listeners, like a crashed
+		 * process */
+		void fail(const loopback_transport *t);
+
+		/* lines received by a transport */
+		uint64_t lines_in(const loopback_transport *t) const;
+};
+
+/* transport of one simulated server, connected through a loopback_hub */
+class loopback_transport : public transport
+{
+	private:
+		loopback_hub &hub;
+
+		const std::string host;
+
+		/* endpoints with pending events */
+		std::deque<int> ready;
+
+		std::vector<struct epoll_event> events;
+
+		size_t next_event_pos;
+
+		friend class loopback_hub;
+
+	public:
+		uint64_t received;
+
+		loopback_transport(loopback_hub &network, std::string hostname);
+
+		/* has events waiting */
+		bool pending() const;
+
+		int wait_events(int timeout);
+
+		bool next_event(struct epoll_event &ev);
+
+		int add_accepting(std::string port);
+
+		int create_connection(std::string host, std::string port);
+
+		int accept_client(int sock);
+
+		bool remove_socket(int sock);
+
+		bool add_message(int sock, std::string &&message);
+
+		bool add_message(int sock, std::string_view message);
+
+		bool fetch_message(int sock, std::string &msg);
+
+		bool receive_messages(int sock, size_t budget, bool &more);
+
+		bool send_messages(int sock);
+
+		/* the steps of the hub, so round trips are the same every run */
+		uint64_t clock_ns() const;
+};
+
+#endif /* LOOPBACK_HPP */
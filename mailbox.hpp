@@ -0,0 +1,76 @@
+#ifndef MAILBOX_HPP
+#define MAILBOX_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/* bounded queue between exactly one producer and one consumer thread. Slots
+ * live in one array sized to a power of two, head and tail are a cache line
+ * apart so the two threads do not share one for every item. */
+template <typename T>
+class mailbox
+{
+	private:
+		std::vector<T> slots;
+
+		size_t mask;
+
+		/* next slot to pop, written by the consumer */
+		std::atomic<size_t> head;
+
+		// padding instead of alignas, new does not align beyond 16 before c++17
+		char apart[64 - sizeof(std::atomic<size_t>)];
+
+		/* next slot to push, written by the producer */
+		std::atomic<size_t> tail;
+
+	public:
+		explicit mailbox(size_t capacity)
+			: head(0), tail(0)
+		{
+			size_t n = 1;
+			while (n < capacity) {
+				n *= 2;
+			}
+			slots.resize(n);
+			mask = n - 1;
+		}
+
+		mailbox(const mailbox &) = delete;
+
+		mailbox &operator=(const mailbox &) = delete;
+
+		/* producer side, false if the mailbox is full */
+		bool push(T &&item)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == slots.size()) {
+				return false;
+			}
+			slots[t & mask] = std::move(item);
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		/* consumer side, false if the mailbox is empty */
+		bool pop(T &item)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			item = std::move(slots[h & mask]);
+			slots[h & mask] = T();
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const
+		{
+			return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+		}
+};
+
+#endif /* MAILBOX_HPP */
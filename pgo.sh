@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# builds ibrcd with profile feedback and link time optimization: an
+# instrumented ibrcd runs the training workload, then ibrcd is built again
+# from the profile. The same workload then runs against the plain release
+# build and the optimized one in turns. The offered load stays below what
+# the servers can take, so every run delivers the same lines and the cpu
+# time of the servers tells the builds apart.
+# usage: pgo.sh [seconds] [clients per node] [base port]
+# RATE=n msgs/s per client, ROUNDS=n runs of each build
+# leaves the optimized ibrcd in place
+
+set -u
+set -e
+
+seconds=${1:-5}
+clients=${2:-50}
+base=${3:-6500}
+rate=${RATE:-10}
+rounds=${ROUNDS:-3}
+
+dir=`mktemp -d`
+servers=()
+
+cleanup() {
+  kill ${servers[@]} 2>/dev/null || true
+  rm -rf ${dir}
+}
+trap cleanup EXIT
+
+# a root and two children: channel floods with a PRIVMSG in four on every
+# node, connect churn against one child. Prints lines received by the
+# clients and the user and system cpu time of the three servers.
+workload() {
+  local ibrcd=$1
+  servers=()
+  ${ibrcd} -k ${base} -l warn & servers+=($!)
+  sleep 0.3
+  for n in 1 2; do
+    ${ibrcd} -k $((base + n)) -h localhost -p ${base} -l warn & servers+=($!)
+  done
+  sleep 0.5
+  local loads=()
+  for n in 0 1 2; do
+    ${dir}/ibrcload -p $((base + n)) -i ${n} -c ${clients} -r ${rate} -P 4 -d ${seconds} > ${dir}/load-${n}.txt &
+    loads+=($!)
+  done
+  ${dir}/ibrcstorm -p $((base + 2)) -i churn -c 32 -d ${seconds} > /dev/null &
+  loads+=($!)
+  wait ${loads[@]}
+  local user=0 sys=0 stat
+  for pid in ${servers[@]}; do
+    read -a stat < /proc/${pid}/stat
+    user=$((user + stat[13]))
+    sys=$((sys + stat[14]))
+  done
+  kill ${servers[@]}
+  wait ${servers[@]} 2>/dev/null || true
+  servers=()
+  awk -v user=${user} -v sys=${sys} -v hz=`getconf CLK_TCK` '{ recv += $10 } END {
+    cpu = (user + sys) / hz
+    printf "%d lines received, servers user %.2f s sys %.2f s, %d lines per cpu s\n",
+      recv, user / hz, sys / hz, (cpu > 0 ? recv / cpu : 0) }' ${dir}/load-*.txt
+}
+
+# load tools and the plain release build
+make -s clean
+make -s release-bin
+cp ibrcload ibrcstorm ${dir}/
+cp ibrcd ${dir}/ibrcd.release
+
+# instrumented build and training
+rm -rf pgo-data
+make -s clean
+make -s pgo-gen
+echo "training: `workload ./ibrcd`"
+if [ -z "`ls pgo-data 2>/dev/null`" ]; then
+  echo "no profile written to pgo-data" >&2
+  exit 1
+fi
+
+make -s clean
+make -s pgo-use
+
+for round in `seq ${rounds}`; do
+  echo "release:  `workload ${dir}/ibrcd.release`"
+  echo "pgo+lto:  `workload ./ibrcd`"
+done
@@ -0,0 +1,58 @@
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+#include <cstdint>
+
+/* static tracepoints (USDT) in the note format of systemtap's sys/sdt.h, so
+ * perf, bpftrace and gdb find them in the binary without a rebuild:
+ *
+ *   bpftrace -e 'usdt:./ibrcd:ibrcd:dispatch { @us[arg0] = hist(arg2 / 1000); }'
+ *
+ * A probe is one nop plus a note naming its arguments, all passed as 64 bit
+ * values. Nothing runs unless a tracer attaches. Only x86-64 with gcc or
+ * clang has them, -DNO_PROBES leaves them out. */
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_PROBES)
+
+#define PROBE_NOTE_(name, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"ibrcd\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define PROBE2(name, a, b) \
+	__asm__ __volatile__ (PROBE_NOTE_(name, "8@%0 8@%1") \
+			:: "nor"(static_cast<uint64_t>(a)), "nor"(static_cast<uint64_t>(b)))
+
+#define PROBE3(name, a, b, c) \
+	__asm__ __volatile__ (PROBE_NOTE_(name, "8@%0 8@%1 8@%2") \
+			:: "nor"(static_cast<uint64_t>(a)), "nor"(static_cast<uint64_t>(b)), \
+			"nor"(static_cast<uint64_t>(c)))
+
+#else
+
+#define PROBE2(name, a, b) do {} while (0)
+
+#define PROBE3(name, a, b, c) do {} while (0)
+
+#endif
+
+#endif /* PROBES_HPP */
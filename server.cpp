@@ -1,5 +1,7 @@
 #include "server.hpp"
 #include "helpers.hpp"
+#include "log.hpp"
+#include "probes.hpp"
 #include <iostream>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -9,27 +11,188 @@
 #include <cstring>
 #include <stdio.h>
 #include <sstream>
+#include <algorithm>
 #include <sys/epoll.h>
+#include <signal.h>
+
+/* set by SIGUSR1, run logs the memory report once it is seen */
+static volatile sig_atomic_t memory_report_requested = 0;
+
+/* set by SIGTERM and SIGINT, run returns and main exits normally */
+static volatile sig_atomic_t stop_requested = 0;
+
+/* set by SIGUSR2, run moves the server under a better parent */
+static volatile sig_atomic_t rebalance_requested = 0;
+
+#ifndef NO_MAIN
+static void request_memory_report(int sig)
+{
+	memory_report_requested = 1;
+}
+
+static void request_stop(int sig)
+{
+	stop_requested = 1;
+}
+
+static void request_rebalance(int sig)
+{
+	rebalance_requested = 1;
+}
 
 int main(int argc, char* argv[])
 {
-	std::string usage = "usage: ibrcd <peer_host>";
+	std::string usage = "usage: ibrcd [-k listen_port|unix:path] [-h parent_host|unix:path] [-p parent_port] [-t trace_file] [-T trace 1 in n] [-l log level] [-b backlog] [-a listen sockets] [-W writer threads] [-w presence window ms] [-r msgs/s per client] [-B burst] [-U upgrade socket] [-S] [-H fallback_host] [-P fallback_port] [-g takeover grace ms] [-A] [-f children per parent] [-X shortcut msgs/s] [parent_host]";
 	std::string peer_port = DEFAULT_PORT;
 	std::string peer_host;
 	std::string listen_port = DEFAULT_PORT;
+	std::string trace_file;
+	unsigned trace_sample = 100;
+	int backlog = DEFAULT_BACKLOG;
+	unsigned n_acceptors = 1;
+	unsigned n_writers = 0;
+	double msg_rate = 0;
+	double msg_burst = 0;
+	uint64_t presence_window = PRESENCE_WINDOW_NS;
+	std::string upgrade_path;
+	bool as_standby = false;
+	std::string fallback_host;
+	std::string fallback_port = DEFAULT_PORT;
+	uint64_t takeover_grace = TAKEOVER_GRACE_NS;
+	bool placed = false;
+	size_t place_fanout = PLACE_FANOUT;
+	size_t shortcut_threshold = 0;
 
 	bool wants_connect = false;
 
-	if (argc > 1) {
-		peer_host = argv[1];
+	int opt;
+	log_level level;
+	while ((opt = getopt(argc, argv, "k:h:p:t:T:l:b:a:W:w:r:B:U:SH:P:g:Af:X:")) != -1) {
+		switch (opt) {
+			case 'k':
+				listen_port = optarg;
+				break;
+			case 'h':
+				peer_host = optarg;
+				wants_connect = true;
+				break;
+			case 'p':
+				peer_port = optarg;
+				break;
+			case 't':
+				trace_file = optarg;
+				break;
+			case 'T':
+				trace_sample = static_cast<unsigned>(std::stoul(optarg));
+				break;
+			case 'l':
+				if (!logger::parse_level(optarg, level)) {
+					std::cerr << "log levels: error, warn, info, debug, trace" << std::endl;
+					exit(EXIT_FAILURE);
+				}
+				logger::set_level(level);
+				break;
+			case 'b':
+				backlog = std::stoi(optarg);
+				break;
+			case 'a':
+				// the kernel spreads connections over the listen queues,
+				// all are accepted on the one thread of the server
+				n_acceptors = static_cast<unsigned>(std::stoul(optarg));
+				break;
+			case 'W':
+				n_writers = static_cast<unsigned>(std::stoul(optarg));
+				break;
+			case 'w':
+				presence_window = std::stoull(optarg) * 1000000;
+				break;
+			case 'r':
+				msg_rate = std::stod(optarg);
+				break;
+			case 'B':
+				msg_burst = std::stod(optarg);
+				break;
+			case 'U':
+				upgrade_path = optarg;
+				break;
+			case 'S':
+				as_standby = true;
+				break;
+			case 'H':
+				fallback_host = optarg;
+				break;
+			case 'P':
+				fallback_port = optarg;
+				break;
+			case 'g':
+				takeover_grace = std::stoull(optarg) * 1000000;
+				break;
+			case 'A':
+				placed = true;
+				break;
+			case 'f':
+				place_fanout = std::stoul(optarg);
+				break;
+			case 'X':
+				shortcut_threshold = std::stoul(optarg);
+				break;
+			default:
+				std::cerr << usage << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind < argc) { // old form, parent host as only argument
+		peer_host = argv[optind];
 		wants_connect = true;
 	}
+	if (as_standby && !wants_connect) {
+		std::cerr << "a standby needs the root as parent" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGUSR1, request_memory_report);
+	signal(SIGTERM, request_stop);
+	signal(SIGINT, request_stop);
+	signal(SIGUSR2, request_rebalance);
 
 	try {
-		server s = server(listen_port);
+		// a server running with the same upgrade socket hands over to this one
+		int handoff = upgrade_path.empty() ? -1 : unix_connect(upgrade_path);
+		server *created = handoff != -1 ? new server(handoff, n_writers)
+			: new server(listen_port, backlog, n_acceptors > 0 ? n_acceptors : 1, n_writers);
+		server &s = *created;
+		if (handoff != -1) {
+			close(handoff);
+			wants_connect = false; // the link to the parent came along
+		}
+		if (!upgrade_path.empty() && !s.listen_for_upgrade(upgrade_path)) {
+			std::cerr << "failed to listen on " << upgrade_path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		s.set_presence_window(presence_window);
+		s.set_rate_limit(msg_rate, msg_burst > 0 ? msg_burst : msg_rate);
+		s.set_takeover_grace(takeover_grace);
+		s.set_placement_fanout(place_fanout);
+		s.set_shortcut_threshold(shortcut_threshold);
+		if (!fallback_host.empty()) {
+			s.set_fallback(fallback_host, fallback_port);
+		}
+
+		if (trace_file != "") {
+			char hostn[1024];
+			hostn[1023] = '\0';
+			gethostname(hostn, 1023);
+			if (!s.enable_tracing(trace_file, "ibrcd " + std::string(hostn) + ":" + listen_port, trace_sample)) {
+				std::cerr << "failed to open " << trace_file << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
 
 		if (wants_connect) {
-			if (!s.connect_parent(peer_host, peer_port)) {
+			bool connected = as_standby ? s.connect_standby(peer_host, peer_port)
+				: placed ? s.connect_placed(peer_host, peer_port) : s.connect_parent(peer_host, peer_port);
+			if (!connected) {
 				std::cerr << "failed to connect" << std::endl;
 				exit(EXIT_FAILURE);
 			}
@@ -38,6 +201,7 @@ int main(int argc, char* argv[])
 		if (!s.run()) { // run the server
 			exit(EXIT_FAILURE);
 		}
+		delete created;
 
 	} catch (server_exception e) {
 		std::cerr << e.what() << std::endl;
@@ -46,602 +210,2771 @@ int main(int argc, char* argv[])
 
 	exit(EXIT_SUCCESS);
 }
+#endif /* NO_MAIN */
+
+static connection_manager *new_manager(int backlog, unsigned n_acceptors, unsigned n_writers)
+{
+	auto conman = new connection_manager(backlog, n_acceptors > 1);
+	conman->start_writers(n_writers);
+	return conman;
+}
 
-server::server(std::string port)
+server::server(std::string port, int backlog, unsigned n_acceptors, unsigned n_writers)
+	: server(new_manager(backlog, n_acceptors, n_writers), port, n_acceptors)
 {
-	conman = new connection_manager();
-	accepting = conman->add_accepting(port);
-	if (accepting == -1) {
+}
 
-		delete conman;
+server::server(int handoff, unsigned n_writers)
+	: server(new_manager(DEFAULT_BACKLOG, 1, n_writers), "", 0)
+{
+	std::string state;
+	std::vector<int> fds;
+	const std::string hello = UPGRADE_HELLO;
+	if (write(handoff, hello.data(), hello.size()) != static_cast<ssize_t>(hello.size())) {
+		perror("write");
+		throw server_exception();
+	}
+	if (!receive_with_fds(handoff, state, fds) || !load_state(state, fds)) {
 		throw server_exception();
 	}
+	// the old process exits once the fds are here
+	char done = 1;
+	if (write(handoff, &done, 1) != 1) {
+		perror("write");
+	}
+}
+
+server::server(transport *net, std::string port, unsigned n_acceptors)
+{
+	conman = net;
+	for (unsigned i = 0; i < n_acceptors; i++) {
+		int sock = conman->add_accepting(port);
+		if (sock == -1) {
+			delete conman;
+			throw server_exception();
+		}
+		acceptors.push_back(sock);
+	}
 	parent = -1;
 	root = true;
+	trace = nullptr;
+	received_at = 0;
+	presence_due = 0;
+	presence_window = PRESENCE_WINDOW_NS;
+	serving = -1;
+	link_started = 0;
+	channels_due = 0;
+	upgrade_sock = -1;
+	upgrade_requested = false;
+	handed_off = false;
+	msg_rate = 0;
+	msg_burst = 0;
+	standby = -1;
+	following = false;
+	repl_seq = 0;
+	takeover_started = 0;
+	takeover_grace = TAKEOVER_GRACE_NS;
+	takeover_orphans = 0;
+	takeover_adopted = 0;
+	takeover_took = 0;
+	depth = 0;
+	parent_name = "-";
+	link_rtt_us = 0;
+	root_rtt_us = 0;
+	topo_due = 0;
+	topo_sent_rtt = 0;
+	topo_sent_at = 0;
+	place_fanout = PLACE_FANOUT;
+	placing = -1;
+	shortcut_threshold = 0;
+	shortcut_seq = 0;
+	shortcut_sent = 0;
+	shortcut_received = 0;
+	shortcut_pruned = 0;
+	shortcut_duplicates = 0;
+
+	char hostn[1024];
+	hostn[1023] = '\0';
+	gethostname(hostn, 1023);
+	name_id = symbol::acquire(std::string(hostn) + ":" + port);
 }
 
 server::~server()
 {
 	delete conman;
+	delete trace;
+	for (auto h : handlers) {
+		delete h;
+	}
+	symbol::release(name_id);
+}
+
+void server::set_name(std::string_view name)
+{
+	symbol::release(name_id);
+	name_id = symbol::acquire(name);
+}
+
+void server::set_presence_window(uint64_t ns)
+{
+	presence_window = ns;
+}
+
+void server::set_rate_limit(double per_second, double burst)
+{
+	msg_rate = per_second;
+	msg_burst = burst;
+	buckets.clear();
+}
+
+bool server::busy() const
+{
+	return !carried.empty();
 }
 
 bool server::connect_parent(std::string host, std::string port)
 {
 	parent = conman->create_connection(host, port);
 	root = (parent == -1);
+	if (parent != -1) {
+		// depth and table come from the new parent
+		parent_name.clear();
+		topology.clear();
+		shortcut_prunes.clear();
+		conman->set_link(parent);
+		conman->add_message(parent, "SERVER " + symbol::name(name_id) + "\n");
+		stale_channels.clear();
+		for (auto &e : directory.get_entries()) {
+			stale_channels.insert(e.first);
+		}
+		send_burst();
+	}
 	return parent != -1;
 }
 
-bool server::run()
+void server::disconnect_parent()
 {
-	while (true) {
-		// polling here
-		int count_events = conman->wait_events();
-
-		if (count_events == -1) {
-			perror("epoll_wait");
-			return false;
-		}
+	if (parent != -1) {
+		close_route(parent);
+		parent = -1;
+		root = true;
+		presence.clear();
+	}
+}
 
-		struct epoll_event ev;
-		while (conman->next_event(ev)) {
-			if (ev.events & EPOLLRDHUP || ev.events == EPOLLERR || ev.events == EPOLLHUP) { // remote peer closed connection
-				close_route(ev.data.fd);
-				if (parent == ev.data.fd) { // become new root
-					root = true;
-				}
-			} else if (ev.data.fd == accepting) { // adds a new client or server
-				int sock = conman->accept_client(ev.data.fd);
-				if (sock == -1) {
-					std::cerr << "failed to accept incoming connection"
-					       	<< std::endl;
-				}
-			} else { // some other fd is ready
-				if (ev.events & EPOLLIN) {
-					if (conman->receive_messages(ev.data.fd)) {
-						std::string msg;
-						while (conman->fetch_message(ev.data.fd, msg)) {
-							// reads all fully received messages
-							// TODO remove
-							std::cout << "receiving: " << msg;
-							//
-							process_message(msg, ev.data.fd);
-						}
-					} else {
-						close_route(ev.data.fd);
-						std::cerr << "connection closed" << std::endl;
-					}
-				} else if (ev.events & EPOLLOUT) {
-					if (!conman->send_messages(ev.data.fd)) {
-						std::cerr << "failed to send messages from queue" << std::endl;
-					}
-				}
-			}
+bool server::connect_standby(std::string host, std::string port)
+{
+	parent = conman->create_connection(host, port);
+	root = (parent == -1);
+	following = (parent != -1);
+	if (parent != -1) {
+		// nothing to merge, the root sends all it knows
+		parent_name.clear();
+		topology.clear();
+		shortcut_prunes.clear();
+		conman->set_link(parent);
+		conman->add_message(parent, "STANDBY " + symbol::name(name_id) + "\n");
+		stale_channels.clear();
+		for (auto &e : directory.get_entries()) {
+			stale_channels.insert(e.first);
 		}
+		link_started = monotonic_ns();
 	}
-	return false;
+	return parent != -1;
 }
 
-void server::process_message(std::string msg, int source)
+void server::set_fallback(std::string host, std::string port)
 {
-	std::istringstream smsg (msg);
-	msg_type type;
-	std::string host;
-	std::string port;
+	fallback_host = host;
+	fallback_port = port;
+}
 
-	if (smsg >> type) {
-		switch (type) {
-			case CONNECT:
-				do_connect(smsg, source);
-				break;
-			case DISCONNECT:
-				do_disconnect(smsg, source);
-				break;
-			case NICK:
-				do_nick(smsg, source);
-				break;
-			case NICKRES:
-				do_nickres(smsg, source);
-				break;
-			case JOIN:
-				do_join(smsg, source);
-				break;
-			case LEAVE:
-				do_leave(smsg, source);
-				break;
-			case LIST:
-				do_list(smsg, source);
-			case LISTRES:
-				do_listres(smsg, source);
-			case GETTOPIC:
-				do_gettopic(smsg, source);
-				break;
-			case SETTOPIC:
-				do_settopic(smsg, source);
-				break;
-			case MSG:
-				do_msg(smsg, source);
-				break;
-			case PRIVMSG:
-				do_privmsg(smsg, source);
-				break;
-			case STATUS:
-				do_status(smsg, source);
-				break;
-			case TOPIC:
-				do_topic(smsg, source);
-				break;
-			case CHANNEL:
-				do_channel(smsg, source);
-				break;
-			case QUIT:
-				do_quit(smsg, source);
-				break;
-			case DELCHANNEL:
-				do_delchannel(smsg, source);
-				break;
-			default:
-				// do_nothing
-				break;
+void server::set_takeover_grace(uint64_t ns)
+{
+	takeover_grace = ns;
+}
+
+void server::lose_parent()
+{
+	bool takes_over = following;
+	if (takes_over) {
+		// the peers of the old root wait for their servers to link here
+		auto peers = reg.get_peers(parent);
+		for (auto p : peers) {
+			p->reroute(-1);
 		}
+		following = false;
+		// the directory mirrors the one of the old root, no need to announce it
+		reg.track_channels(true);
+		reg.take_changes();
+		takeover_started = monotonic_ns();
+		takeover_orphans = peers.size();
+		takeover_adopted = 0;
+		LOG(LOG_WARN, LOG_SERVER, "takeover: ", "root lost, " + std::to_string(peers.size())
+				+ " peers wait for their servers");
+	}
+	close_route(parent);
+	parent = -1;
+	root = true;
+	depth = 0;
+	parent_name = "-";
+	root_rtt_us = 0;
+	presence.clear(); // the burst has the peers held back
+	if (!takes_over && !fallback_host.empty()) {
+		if (connect_parent(fallback_host, fallback_port)) {
+			LOG(LOG_WARN, LOG_SERVER, "parent lost: ", "linked to " + fallback_host + ":" + fallback_port);
+		} else {
+			LOG(LOG_WARN, LOG_SERVER, "parent lost: ", "failed to link to " + fallback_host + ":"
+					+ fallback_port + ", now root");
+		}
+	}
+	if (root) {
+		push_depth();
+		announce_topology(false);
 	}
 }
 
-void server::do_delchannel(std::istringstream &smsg, int source)
+void server::end_takeover()
 {
-	std::string chan_name;
-	if (smsg >> chan_name) {
-		channel *chan = channel::get(chan_name);
-		if (chan != nullptr) {
-			peer *op = peer::get_by_host(chan->op);
+	if (takeover_started == 0) {
+		return;
+	}
+	size_t dropped = 0;
+	for (auto p : reg.get_peers(-1)) {
+		drop_peer(p);
+		dropped++;
+	}
+	takeover_took = monotonic_ns() - takeover_started;
+	takeover_started = 0;
+	LOG(LOG_INFO, LOG_SERVER, "takeover: ", std::to_string(takeover_adopted) + " of "
+			+ std::to_string(takeover_orphans) + " peers adopted, " + std::to_string(dropped)
+			+ " dropped after " + std::to_string(takeover_took / 1000) + " us");
+}
 
-			if (root) {
-				if (op != nullptr) {
-					send_status(op, leave_successful);
-				}
-			}
+bool server::linked() const
+{
+	return parent != -1 && link_started == 0;
+}
 
-			send_to_channel(chan, smsg.str(), source);
+unsigned server::tree_depth() const
+{
+	return depth;
+}
 
-			delete chan;
+void server::send_burst()
+{
+	link_started = monotonic_ns();
+	size_t lines = 0;
+
+	// peers by origin, a few hundred per line
+	auto peers = reg.peer_list();
+	std::sort(peers.begin(), peers.end(), [](const peer *a, const peer *b) {
+		return a->origin < b->origin;
+	});
+	size_t i = 0;
+	while (i < peers.size()) {
+		symbol_id origin = peers[i]->origin != 0 ? peers[i]->origin : name_id;
+		std::string line = "BURST " + symbol::name(origin);
+		for (size_t n = 0; i < peers.size() && n < BURST_BATCH; i++, n++) {
+			if (n > 0 && peers[i]->origin != peers[i - 1]->origin) {
+				break;
+			}
+			line += " " + peers[i]->host();
+			if (peers[i]->get_nick_id() != 0) {
+				line += ":" + peers[i]->get_nick();
+			}
 		}
+		conman->add_message(parent, line + "\n");
+		lines++;
 	}
+
+	// channels with op, members and topic
+	auto chans = reg.channel_list();
+	for (auto chan : chans) {
+		const std::set<peer*> &members = chan->get_members();
+		auto member = members.begin();
+		do {
+			std::string list;
+			for (size_t n = 0; member != members.end() && n < BURST_BATCH; ++member, n++) {
+				list += (n > 0 ? "," : "") + (*member)->host();
+			}
+			conman->add_message(parent, "BURSTCHAN " + chan->name() + " " + symbol::name(chan->op)
+					+ " " + (list.empty() ? "-" : list) + " " + chan->get_topic() + "\n");
+			lines++;
+		} while (member != members.end());
+	}
+	conman->add_message(parent, std::string("BURSTEND\n"));
+
+	LOG(LOG_INFO, LOG_SERVER, "burst: ", std::to_string(peers.size()) + " peers, "
+			+ std::to_string(chans.size()) + " channels in " + std::to_string(lines + 1) + " lines");
 }
 
-void server::send_status(const peer *dest, status_code code)
+bool server::enable_tracing(std::string file, std::string name, unsigned sample)
 {
-	std::ostringstream reply;
-	reply << "STATUS " << dest->host << " " << static_cast<int>(code) << std::endl;
-	conman->add_message(dest->route, reply.str());
+	tracer *t = new tracer(file, name, sample);
+	if (!t->good()) {
+		delete t;
+		return false;
+	}
+	delete trace;
+	trace = t;
+	conman->set_tracer(trace);
+	return true;
 }
 
-void server::do_connect(std::istringstream &smsg, int source)
+bool server::run()
 {
-	std::string host;
-
-	if (smsg >> host && source != parent) {
-		peer *npeer = new peer(source, host);
-		if (!root) {
-			conman->add_message(parent, smsg.str());
-		} else {
-			send_status(npeer, connect_success);
+	while (true) {
+		// polling here, until the held back presence is due
+		int timeout = -1;
+		uint64_t due = !presence.empty() ? presence_due : 0;
+		if (channels_due != 0 && (due == 0 || channels_due < due)) {
+			due = channels_due;
+		}
+		uint64_t takeover_due = takeover_started != 0 ? takeover_started + takeover_grace : 0;
+		if (takeover_due != 0 && (due == 0 || takeover_due < due)) {
+			due = takeover_due;
+		}
+		if ((parent != -1 || !children.empty() || !shortcut_links.empty())
+				&& (due == 0 || topo_due < due)) {
+			due = topo_due;
+		}
+		if (due != 0) {
+			uint64_t now = monotonic_ns();
+			timeout = due > now ? static_cast<int>((due - now + 999999) / 1000000) : 0;
+		}
+		if (!run_once(timeout)) {
+			return false;
+		}
+		if (handed_off || stop_requested) {
+			return true;
+		}
+		if (rebalance_requested) {
+			rebalance_requested = 0;
+			rebalance();
+		}
+		if (memory_report_requested) {
+			memory_report_requested = 0;
+			std::ostringstream report;
+			memory_report(report);
+			LOG(LOG_INFO, LOG_SERVER, "memory: ", report.str());
+			std::ostringstream delays;
+			conman->delay_report(delays);
+			LOG(LOG_INFO, LOG_SERVER, "queue delay: ", delays.str());
+			std::ostringstream handled;
+			handler_report(handled);
+			LOG(LOG_INFO, LOG_SERVER, "handlers: ", handled.str());
+			std::ostringstream replication;
+			replication_report(replication);
+			LOG(LOG_INFO, LOG_SERVER, "replication: ", replication.str());
+			std::ostringstream topo;
+			topology_report(topo);
+			LOG(LOG_INFO, LOG_SERVER, "topology: ", topo.str());
+			std::ostringstream shortcuts;
+			shortcut_report(shortcuts);
+			LOG(LOG_INFO, LOG_SERVER, "shortcuts: ", shortcuts.str());
+			logger::flush();
 		}
 	}
+	return false;
 }
 
-void server::do_disconnect(std::istringstream &smsg, int source)
+void server::handler_report(std::ostream &out) const
 {
-	std::string host;
-
-	if (smsg >> host && source != parent) {
-		peer *deleted = peer::get_by_host(host);
-		if (deleted != nullptr) {
-			delete deleted;
-			conman->add_message(parent, smsg.str());
+	bool first = true;
+	for (size_t type = 0; type < handlers.size(); type++) {
+		if (handlers[type] != nullptr) {
+			out << (first ? "" : "; ") << command_names[type] << " handle_us ";
+			handlers[type]->handle.print(out, 1000.0);
+			out << " parse_us ";
+			handlers[type]->parse.print(out, 1000.0);
+			first = false;
 		}
 	}
 }
 
-void server::do_nick(std::istringstream &smsg, int source)
+void server::replication_report(std::ostream &out) const
 {
-	std::string host, nick;
+	if (following) {
+		out << "standby of the root, mark " << repl_seq;
+	} else if (standby != -1) {
+		out << "standby linked, mark " << repl_seq << ", " << repl_pending.size()
+			<< " unacknowledged, lag_us ";
+		repl_lag.print(out, 1000.0);
+	} else {
+		out << "no standby";
+	}
+	if (takeover_took != 0) {
+		out << ", took over in " << takeover_took / 1000 << " us, " << takeover_adopted
+			<< " of " << takeover_orphans << " peers adopted";
+	}
+}
 
-	if (smsg >> host >> nick) {
-		peer *known = peer::get_by_host(host);
+void server::memory_report(std::ostream &out) const
+{
+	out << "rss " << resident_bytes() / 1024 << " kB, ";
+	conman->memory_report(out);
+	out << ", ";
+	reg.memory_report(out);
+	out << " directory " << directory.size() << " (" << directory.memory_usage() << " B)";
+}
 
-		if (known != nullptr) {
-			peer *collision = peer::get(nick);
+bool server::run_once(int timeout)
+{
+	// sockets carried over from the last round do not wait for events
+	size_t turns = carried.size();
+	int count_events = conman->wait_events(turns > 0 ? 0 : timeout);
 
-			if (collision != nullptr) {
-				send_status(known, nick_not_unique);
+	if (count_events == -1) {
+		perror("epoll_wait");
+		return false;
+	}
+
+	struct epoll_event ev;
+	while (conman->next_event(ev)) {
+		if (ev.events & EPOLLRDHUP || ev.events == EPOLLERR || ev.events == EPOLLHUP) { // remote peer closed connection
+			if (parent == ev.data.fd) {
+				lose_parent();
 			} else {
-				if (root) {
-					if (test_nick(nick)) {
-						known->set_nick(nick);
-						send_nick_res(known, nick);
-						send_status(known, nick_unique);
-					}
-				} else {
-					conman->add_message(parent, smsg.str());
+				close_route(ev.data.fd);
+			}
+		} else if (ev.data.fd == upgrade_sock) {
+			upgrade_requested = true;
+		} else if (std::find(acceptors.begin(), acceptors.end(), ev.data.fd) != acceptors.end()) {
+			// adds new clients or servers, the event comes once for all of them
+			while (conman->accept_client(ev.data.fd) != -1) {
+			}
+		} else { // some other fd is ready
+			if (ev.events & EPOLLIN) {
+				auto waiting = carried_unread.find(ev.data.fd);
+				if (waiting != carried_unread.end()) { // read in its turn below
+					waiting->second = true;
+				} else if (!serve(ev.data.fd, true)) {
+					continue;
+				}
+			}
+			if (ev.events & EPOLLOUT) {
+				if (!conman->send_messages(ev.data.fd)) {
+					std::cerr << "failed to send messages from queue" << std::endl;
+				}
+			}
+		}
+	}
+	// one turn for each socket carried over, in order
+	for (size_t i = 0; i < turns && !carried.empty(); i++) {
+		int sock = carried.front();
+		carried.pop_front();
+		auto waiting = carried_unread.find(sock);
+		if (waiting != carried_unread.end()) {
+			bool unread = waiting->second;
+			carried_unread.erase(waiting);
+			serve(sock, unread);
+		}
+	}
+	if (!presence.empty() && (presence_window == 0 || monotonic_ns() >= presence_due)) {
+		flush_presence();
+	}
+	if (standby != -1 && reg.has_journal()) {
+		flush_journal();
+	}
+	if (takeover_started != 0 && (takeover_adopted == takeover_orphans
+				|| monotonic_ns() >= takeover_started + takeover_grace)) {
+		end_takeover();
+	}
+	uint64_t now = conman->clock_ns();
+	if ((parent != -1 || !children.empty() || !shortcut_links.empty()) && now >= topo_due) {
+		topo_due = now + TOPO_INTERVAL_NS;
+		check_shortcuts();
+		if (parent != -1 && link_started == 0) {
+			conman->add_message(parent, "LINKPING " + std::to_string(now) + "\n");
+		}
+		announce_topology(false);
+		if (root) { // servers that stopped sending TOPO are gone
+			std::vector<std::string> expired;
+			for (auto &e : topology) {
+				if (e.first != symbol::name(name_id) && now > e.second.seen + TOPO_EXPIRY_NS) {
+					expired.push_back("TOPO " + e.first + " " + e.second.parent + " -\n");
+				}
+			}
+			for (auto &line : expired) {
+				if (apply_topology(line) && !children.empty()) {
+					conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
 				}
 			}
 		}
 	}
+	if (root && (!reg.tracks_channels() || reg.has_changes())) {
+		// changes of one window go out together
+		now = monotonic_ns();
+		if (channels_due == 0) {
+			channels_due = now + presence_window;
+		}
+		if (presence_window == 0 || now >= channels_due || !reg.tracks_channels()) {
+			publish_channels();
+		}
+	} else if (!root) {
+		reg.track_channels(false);
+		channels_due = 0;
+	}
+	if (upgrade_requested) {
+		// between rounds, nothing is half handled
+		upgrade_requested = false;
+		hand_off();
+	}
+	if (trace != nullptr) {
+		trace->flush();
+	}
+	logger::flush();
+	return true;
 }
 
-void server::send_nick_res(peer *dest, std::string &nick)
+bool server::listen_for_upgrade(const std::string &path)
 {
-	std::ostringstream msg;
-	msg << "NICKRES" << " " << dest->host << " " << nick << std::endl;
+	int sock = unix_listen(path);
+	if (sock == -1) {
+		return false;
+	}
+	socket_state s;
+	s.fd = sock;
+	s.link = false;
+	if (!conman->adopt_socket(s)) {
+		return false;
+	}
+	upgrade_sock = sock;
+	return true;
+}
+
+/* reads the hello of a new process from sock, false after UPGRADE_HELLO_S
+ * seconds or if something else came */
+static bool read_upgrade_hello(int sock)
+{
+	const std::string hello = UPGRADE_HELLO;
+	struct timeval wait = { UPGRADE_HELLO_S, 0 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof wait) == -1) {
+		perror("setsockopt");
+		return false;
+	}
+	std::string got;
+	char c;
+	while (got.size() < hello.size() && read(sock, &c, 1) == 1) {
+		got += c;
+		if (c == '\n') {
+			break;
+		}
+	}
+	// the state may take longer to load than the hello to come
+	wait = { 0, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof wait);
+	return got == hello;
+}
+
+void server::hand_off()
+{
+	int sock;
+	while (!handed_off && (sock = accept4(upgrade_sock, nullptr, nullptr, SOCK_CLOEXEC)) != -1) {
+		if (!read_upgrade_hello(sock)) {
+			LOG(LOG_WARN, LOG_SERVER, "upgrade: ", "no new ibrcd on the upgrade socket, still serving");
+			close(sock);
+			continue;
+		}
+		// the new process gets what the parent would have got next
+		if (!presence.empty()) {
+			flush_presence();
+		}
+
+		std::vector<socket_state> sockets;
+		if (!conman->hand_over(sockets)) {
+			LOG(LOG_WARN, LOG_SERVER, "upgrade: ", "transport cannot hand over its sockets");
+			close(sock);
+			return;
+		}
+		sockets.erase(std::remove_if(sockets.begin(), sockets.end(),
+					[this](const socket_state &s) { return s.fd == upgrade_sock; }), sockets.end());
+		std::vector<int> fds;
+		for (auto &s : sockets) {
+			fds.push_back(s.fd);
+		}
+
+		std::string state = save_state(sockets);
+		char done = 0;
+		bool sent = send_with_fds(sock, state, fds) && read(sock, &done, 1) == 1 && done == 1;
+		close(sock);
+		if (!sent) {
+			// the sockets are still ours, sending goes on where it stopped
+			conman->resume(sockets);
+			LOG(LOG_WARN, LOG_SERVER, "upgrade: ", "the new process did not take the sockets, still serving");
+			continue;
+		}
+		LOG(LOG_INFO, LOG_SERVER, "upgrade: ", "handed " + std::to_string(fds.size()) + " sockets and "
+				+ std::to_string(state.size()) + " bytes of state to the new process");
+		handed_off = true;
+	}
+	if (!handed_off && errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept4");
+	}
+}
+
+std::string server::save_state(const std::vector<socket_state> &sockets)
+{
+	std::ostringstream out;
+	out << "name " << symbol::name(name_id) << "\n";
+	out << "root " << root << " " << parent << "\n";
+	out << "replication " << standby << " " << following << " " << repl_seq << "\n";
+	out << "acceptors";
+	for (int sock : acceptors) {
+		out << " " << sock;
+	}
+	out << "\nchildren";
+	for (int sock : children) {
+		out << " " << sock;
+	}
+	out << "\n";
+	// buffers go raw after their line
+	for (auto &s : sockets) {
+		out << "socket " << s.fd << " " << s.link << " " << s.in.size() << " " << s.out.size() << "\n"
+			<< s.in << s.out;
+	}
+	for (auto p : reg.peer_list()) {
+		out << "peer " << p->route << " " << (p->origin != 0 ? symbol::name(p->origin) : "-")
+			<< " " << p->host() << " " << (p->get_nick_id() != 0 ? p->get_nick() : "-") << "\n";
+	}
+	for (auto chan : reg.channel_list()) {
+		out << "channel " << chan->name() << " " << symbol::name(chan->op) << " " << chan->get_topic() << "\n";
+		out << "members " << chan->name();
+		for (auto m : chan->get_members()) {
+			out << " " << m->host();
+		}
+		out << "\n";
+	}
+	for (auto &e : directory.get_entries()) {
+		out << "directory " << e.first << " " << e.second.members << " " << e.second.topic << "\n";
+	}
+	for (auto &l : shortcut_links) {
+		out << "shortcut " << l.first << " " << l.second.name << "\n";
+	}
+	for (auto &o : shortcut_out) {
+		out << "shortcut_out " << o.first;
+		for (int sock : o.second) {
+			out << " " << sock;
+		}
+		out << "\n";
+	}
+	for (auto &i : shortcut_in) {
+		out << "shortcut_in " << i.first << "\n";
+	}
+	return out.str();
+}
+
+bool server::load_state(const std::string &state, const std::vector<int> &fds)
+{
+	std::istringstream in(state);
+	std::unordered_map<int, int> fd_of; // old fd to the received one
+	size_t next_fd = 0;
+	auto mapped = [&fd_of](int old) {
+		auto found = fd_of.find(old);
+		return found != fd_of.end() ? found->second : -1;
+	};
+	int old_parent = -1, old_standby = -1;
+	std::vector<int> old_acceptors, old_children;
+
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream item(line);
+		std::string kind;
+		item >> kind;
+		if (kind == "name") {
+			std::string name;
+			item >> name;
+			set_name(name);
+		} else if (kind == "root") {
+			item >> root >> old_parent;
+		} else if (kind == "replication") {
+			item >> old_standby >> following >> repl_seq;
+		} else if (kind == "acceptors" || kind == "children") {
+			int sock;
+			while (item >> sock) {
+				(kind == "acceptors" ? old_acceptors : old_children).push_back(sock);
+			}
+		} else if (kind == "socket") {
+			socket_state s;
+			size_t in_size, out_size;
+			int old;
+			if (!(item >> old >> s.link >> in_size >> out_size) || next_fd == fds.size()) {
+				return false;
+			}
+			s.fd = fds[next_fd++];
+			s.in.resize(in_size);
+			s.out.resize(out_size);
+			in.read(&s.in[0], static_cast<std::streamsize>(in_size));
+			in.read(&s.out[0], static_cast<std::streamsize>(out_size));
+			if (!in || !conman->adopt_socket(s)) {
+				return false;
+			}
+			fd_of[old] = s.fd;
+		} else if (kind == "peer") {
+			int route;
+			std::string origin, host, nick;
+			item >> route >> origin >> host >> nick;
+			symbol_id origin_id = origin != "-" ? symbol::acquire(origin) : 0;
+			peer *p = new peer(reg, mapped(route), host, origin_id);
+			symbol::release(origin_id);
+			if (nick != "-") {
+				p->set_nick(nick);
+			}
+		} else if (kind == "channel") {
+			std::string name, op, topic;
+			item >> name >> op;
+			std::getline(item, topic);
+			new channel(reg, topic.empty() ? topic : topic.substr(1), name, op);
+		} else if (kind == "members") {
+			std::string name, host;
+			item >> name;
+			channel *chan = reg.get_channel(symbol::find(name));
+			while (chan != nullptr && item >> host) {
+				peer *p = reg.get_peer_by_host(symbol::find(host));
+				if (p != nullptr) {
+					chan->join(p);
+				}
+			}
+		} else if (kind == "directory") {
+			std::string name, topic;
+			size_t members;
+			item >> name >> members;
+			std::getline(item, topic);
+			directory.set(name, members, topic.empty() ? topic : topic.substr(1));
+		} else if (kind == "shortcut") {
+			int sock;
+			std::string name;
+			if (item >> sock >> name && mapped(sock) != -1) {
+				shortcut_links.emplace(mapped(sock), shortcut_link{name, 0});
+				shortcut_socks.emplace(name, mapped(sock));
+			}
+		} else if (kind == "shortcut_out") {
+			std::string name;
+			int sock;
+			item >> name;
+			while (item >> sock) {
+				if (mapped(sock) != -1) {
+					shortcut_out[name].insert(mapped(sock));
+				}
+			}
+		} else if (kind == "shortcut_in") {
+			std::string chan, origin;
+			if (item >> chan >> origin) {
+				shortcut_in[chan + " " + origin] = SIZE_MAX / 2; // kept for the first window
+			}
+		}
+	}
+
+	parent = mapped(old_parent);
+	standby = mapped(old_standby);
+	if (standby != -1) { // the old process sent its journal before the hand off
+		reg.journal_changes(true);
+	}
+	for (int sock : old_acceptors) {
+		acceptors.push_back(mapped(sock));
+	}
+	for (int sock : old_children) {
+		children.insert(mapped(sock));
+	}
+	if (root) { // the directory came along, no need to announce it again
+		reg.track_channels(true);
+		reg.take_changes();
+	}
+	// each socket gets a turn for the lines and bytes left unread
+	for (auto &f : fd_of) {
+		if (std::find(acceptors.begin(), acceptors.end(), f.second) == acceptors.end()) {
+			carried.push_back(f.second);
+			carried_unread[f.second] = true;
+		}
+	}
+	LOG(LOG_INFO, LOG_SERVER, "upgrade: ", "took over " + std::to_string(fds.size()) + " sockets, "
+			+ std::to_string(reg.peer_list().size()) + " peers and "
+			+ std::to_string(reg.channel_list().size()) + " channels");
+	return next_fd == fds.size();
+}
+
+bool server::serve(int sock, bool unread)
+{
+	size_t handled = 0;
+	bool more = unread;
+	bool read = false;
+	serving = sock;
+
+	while (true) {
+		// lines read in an earlier turn go first
+		while (handled < DISPATCH_BUDGET && conman->fetch_message(sock, line_buffer)) {
+			LOG(LOG_TRACE, LOG_NET, "receiving: ", line_buffer);
+			process_message(line_buffer, sock);
+			handled++;
+			if (serving != sock) { // closed by the line
+				return false;
+			}
+		}
+		if (handled == DISPATCH_BUDGET || !more || read) {
+			break;
+		}
+		if (!conman->receive_messages(sock, READ_BUDGET, more)) {
+			close_route(sock);
+			std::cerr << "connection closed" << std::endl;
+			return false;
+		}
+		read = true;
+		if (trace != nullptr) {
+			received_at = tracer::now_us();
+		}
+	}
+	serving = -1;
+
+	if (handled == DISPATCH_BUDGET || more) {
+		carried.push_back(sock);
+		carried_unread[sock] = more;
+	}
+	return true;
+}
+
+bool server::within_rate(const peer *src, int source)
+{
+	if (msg_rate <= 0 || source == parent || children.count(source) != 0) {
+		return true; // servers relay what their clients were allowed
+	}
+	if (buckets[source].take(msg_rate, msg_burst, monotonic_ns())) {
+		return true;
+	}
+	send_status(src, rate_limited);
+	return false;
+}
+
+void server::process_message(const std::string &line, int source)
+{
+	uint64_t started = monotonic_ns();
+	PROBE3(ingress, source, reinterpret_cast<uintptr_t>(line.data()), line.size());
+	uint64_t dispatched = 0;
+	uint64_t trace_id = 0;
+	bool ingress = false;
+	if (trace != nullptr) {
+		dispatched = tracer::now_us();
+		trace_id = trace_id_of(line);
+	}
+
+	// only tag and type are read here, relays read the fields they route by
+	const std::string *msg = &line;
+	std::string traced;
+	line_reader in(line);
+	std::string_view tag, name;
+	msg_type type;
+	if (!in.next(name)) {
+		return;
+	}
+	if (name[0] == '@') {
+		tag = name;
+		if (!in.next(name)) {
+			return;
+		}
+	}
+	if (!parse_msg_type(name, type)) {
+		return;
+	}
+
+	if (trace != nullptr && trace_id == 0 && source != parent && children.count(source) == 0
+			&& (type == MSG || type == PRIVMSG || type == JOIN)) {
+		// sampled at the first server, the id travels with the line
+		trace_id = trace->sample();
+		if (trace_id != 0) {
+			ingress = true;
+			traced = add_trace_id(line, trace_id);
+			msg = &traced;
+			in = line_reader(traced);
+			in.next(tag);
+			in.next(name);
+		}
+	}
+	if (trace_id != 0) {
+		trace->handling(trace_id);
+	}
+	set_request_tag(tag);
+	uint64_t parsed = monotonic_ns();
+
+	bool relayed = true;
+	switch (type) {
+		case MSG:
+			do_msg(in, *msg, source);
+			break;
+		case PRIVMSG:
+			do_privmsg(in, *msg, source);
+			break;
+		case SETTOPIC:
+			do_settopic(in, *msg, source);
+			break;
+		case STATUS:
+			do_status(in, *msg, source);
+			break;
+		case TOPIC:
+			do_topic(in, *msg, source);
+			break;
+		case LISTRES:
+		case LISTPAGE:
+			do_listres(in, *msg, source);
+			break;
+		case CHANINFO:
+			do_chaninfo(in, *msg, source);
+			break;
+		case REPL:
+			do_repl(in, *msg, source);
+			break;
+		case TOPO:
+			do_topo(in, *msg, source);
+			break;
+		case CHANNEL:
+			do_channel(in, *msg, source);
+			break;
+		default:
+			relayed = false;
+			break;
+	}
+
+	if (!relayed) {
+		std::istringstream smsg(*msg);
+		smsg.seekg(static_cast<std::streamoff>(in.offset()));
+
+		switch (type) {
+			case CONNECT:
+				do_connect(smsg, source);
+				break;
+			case DISCONNECT:
+				do_disconnect(smsg, source);
+				break;
+			case NICK:
+				do_nick(smsg, source);
+				break;
+			case NICKRES:
+				do_nickres(smsg, source);
+				break;
+			case JOIN:
+				do_join(smsg, source);
+				break;
+			case LEAVE:
+				do_leave(smsg, source);
+				break;
+			case LIST:
+				do_list(smsg, source);
+				break;
+			case GETTOPIC:
+				do_gettopic(smsg, source);
+				break;
+			case QUIT:
+				do_quit(smsg, source);
+				break;
+			case DELCHANNEL:
+				do_delchannel(smsg, source);
+				break;
+			case SERVER:
+				do_server(smsg, source);
+				break;
+			case CONNECTS:
+				do_connects(smsg, source);
+				break;
+			case QUITS:
+				do_quits(smsg, source);
+				break;
+			case NETSPLIT:
+				do_netsplit(smsg, source);
+				break;
+			case BURST:
+				do_burst(smsg, source);
+				break;
+			case BURSTCHAN:
+				do_burstchan(smsg, source);
+				break;
+			case BURSTEND:
+				do_burstend(smsg, source);
+				break;
+			case STANDBY:
+				do_standby(smsg, source);
+				break;
+			case REPLACK:
+				do_replack(smsg, source);
+				break;
+			case LINKPING:
+				do_linkping(smsg, source);
+				break;
+			case LINKPONG:
+				do_linkpong(smsg, source);
+				break;
+			case PLACE:
+				do_place(smsg, source);
+				break;
+			case PLACERES:
+				do_placeres(smsg, source);
+				break;
+			case MOVED:
+				do_moved(smsg, source);
+				break;
+			case SHORTCUT:
+				do_shortcut(smsg, source);
+				break;
+			default:
+				// do_nothing
+				break;
+		}
+	}
+
+	uint64_t handled = monotonic_ns();
+	if (handlers.size() <= static_cast<size_t>(type)) {
+		handlers.resize(command_names.size(), nullptr);
+	}
+	if (handlers[type] == nullptr) {
+		handlers[type] = new handler_stats();
+	}
+	handlers[type]->parse.record(parsed - started);
+	handlers[type]->handle.record(handled - parsed);
+	PROBE3(dispatch, type, source, handled - parsed);
+
+	if (trace_id != 0) {
+		trace->handling(0);
+		trace->span("receive", trace_id, received_at, dispatched);
+		trace->hop(trace_id, ingress, dispatched);
+		trace->span(command_names[type], trace_id, dispatched, tracer::now_us());
+	}
+}
+
+void server::do_server(std::istringstream &smsg, int source)
+{
+	std::string name;
+	if (source != parent) {
+		children.insert(source);
+		conman->set_link(source);
+		if (smsg >> name) {
+			child_names[source] = name;
+		}
+		announce_topology(false);
+	}
+}
+
+void server::do_delchannel(std::istringstream &smsg, int source)
+{
+	std::string chan_name;
+	if (smsg >> chan_name) {
+		channel *chan = reg.get_channel(symbol::find(chan_name));
+		if (chan != nullptr) {
+			peer *op = reg.get_peer_by_host(chan->op);
+
+			if (root) {
+				if (op != nullptr) {
+					send_status(op, leave_successful);
+				}
+			}
+
+			send_to_channel(chan, smsg.str(), source);
+
+			delete chan;
+		}
+	}
+}
+
+void server::set_request_tag(std::string_view tag)
+{
+	// replies keep request and trace id, not the message id
+	request_tag.assign(tag.substr(0, tag.find('^')));
+	if (request_tag == "@0" && tag.size() > 2) {
+		request_tag.clear();
+	}
+	if (!request_tag.empty()) {
+		request_tag += ' ';
+	}
+	client_tag.assign(client_tag_of(tag));
+	if (!client_tag.empty()) {
+		client_tag += ' ';
+	}
+}
+
+const std::string &server::reply_tag(int route) const
+{
+	return route == parent || children.count(route) != 0 ? request_tag : client_tag;
+}
+
+void server::relay_reply(int route, const std::string &line)
+{
+	std::string_view tag(line);
+	tag = tag.substr(0, tag.empty() || tag[0] != '@' ? 0 : tag.find(' '));
+	if (route == parent || children.count(route) != 0 || client_tag_of(tag).size() == tag.size()) {
+		conman->add_message(route, std::string_view(line));
+	} else {
+		conman->add_message(route, client_reply(line));
+	}
+}
+
+void server::send_status(const peer *dest, status_code code)
+{
+	// built in one buffer that the queue takes over
+	const std::string &host = dest->host();
+	const std::string &tag = reply_tag(dest->route);
+	std::string reply;
+	reply.reserve(tag.size() + host.size() + 12);
+	reply += tag;
+	reply += "STATUS ";
+	reply += host;
+	reply += ' ';
+	reply += std::to_string(static_cast<int>(code));
+	reply += '\n';
+	conman->add_message(dest->route, std::move(reply));
+}
+
+void server::do_connect(std::istringstream &smsg, int source)
+{
+	std::string host;
+
+	if (smsg >> host && source != parent) {
+		uint64_t id = request_tag.empty() ? 0 : std::strtoull(request_tag.c_str() + 1, nullptr, 10);
+		add_peer(host, id, source, name_id);
+	}
+}
+
+void server::do_connects(std::istringstream &smsg, int source)
+{
+	std::string origin_name, entry;
+
+	if (smsg >> origin_name && source != parent) {
+		symbol_id origin = symbol::acquire(origin_name);
+		while (smsg >> entry) {
+			size_t colon = entry.find(':');
+			if (colon != std::string::npos) {
+				add_peer(entry.substr(colon + 1), std::strtoull(entry.c_str(), nullptr, 10), source, origin);
+			}
+		}
+		symbol::release(origin);
+	}
+}
+
+void server::add_peer(std::string_view host, uint64_t id, int source, symbol_id origin)
+{
+	peer *known = reg.get_peer_by_host(symbol::find(host));
+	if (known != nullptr && known->route == -1) {
+		drop_peer(known); // it waited for a lost server, the host is back
+	} else if (known != nullptr) {
+		// the first one keeps the host
+		set_request_tag(id != 0 ? "@" + std::to_string(id) : "");
+		conman->add_message(source, reply_tag(source) + "STATUS " + std::string(host) + " "
+				+ std::to_string(static_cast<int>(connect_error)) + "\n");
+		return;
+	}
+	peer *npeer = new peer(reg, source, host, origin);
+	if (root) {
+		// each host of a batch gets the reply to its own CONNECT
+		set_request_tag(id != 0 ? "@" + std::to_string(id) : "");
+		send_status(npeer, connect_success);
+	} else {
+		queue_presence(true, symbol::name(origin), std::to_string(id) + ":" + std::string(host));
+	}
+}
+
+void server::queue_presence(bool connect, const std::string &origin, std::string entry)
+{
+	if (presence.empty()) {
+		presence_due = monotonic_ns() + presence_window;
+	}
+	presence_change change;
+	change.connect = connect;
+	change.origin = origin;
+	change.entry = std::move(entry);
+	presence.push_back(std::move(change));
+}
+
+void server::flush_presence()
+{
+	// one line per run of CONNECTs from one origin or of QUITs
+	size_t i = 0;
+	while (i < presence.size()) {
+		const presence_change &first = presence[i];
+		std::string line = first.connect ? "CONNECTS " + first.origin : "QUITS";
+		for (size_t n = 0; i < presence.size() && n < PRESENCE_BATCH; i++, n++) {
+			const presence_change &c = presence[i];
+			if (c.connect != first.connect || c.origin != first.origin) {
+				break;
+			}
+			line += " " + c.entry;
+		}
+		conman->add_message(parent, line + "\n");
+	}
+	presence.clear();
+}
+
+void server::send_parent(std::string_view msg)
+{
+	if (!presence.empty()) {
+		flush_presence();
+	}
+	conman->add_message(parent, msg);
+}
+
+void server::do_disconnect(std::istringstream &smsg, int source)
+{
+	std::string host;
+
+	if (smsg >> host && source != parent) {
+		peer *deleted = reg.get_peer_by_host(symbol::find(host));
+		if (deleted != nullptr) {
+			delete deleted;
+			send_parent(smsg.str());
+		}
+	}
+}
+
+void server::do_nick(std::istringstream &smsg, int source)
+{
+	std::string host, nick;
+
+	if (smsg >> host >> nick) {
+		peer *known = reg.get_peer_by_host(symbol::find(host));
+
+		if (known != nullptr) {
+			peer *collision = reg.get_peer(symbol::find(nick));
+
+			if (collision != nullptr) {
+				send_status(known, nick_not_unique);
+			} else {
+				if (root) {
+					if (test_nick(nick)) {
+						known->set_nick(nick);
+						send_nick_res(known, nick);
+						send_status(known, nick_unique);
+					}
+				} else {
+					send_parent(smsg.str());
+				}
+			}
+		}
+	}
+}
+
+void server::send_nick_res(peer *dest, std::string_view nick)
+{
+	std::ostringstream msg;
+	msg << reply_tag(dest->route) << "NICKRES" << " " << dest->host() << " " << nick << std::endl;
+
+	conman->add_message(dest->route, msg.str());
+}
+
+void server::do_nickres(std::istringstream &smsg, int source)
+{
+	std::string host, nick;
+	if (smsg >> host >> nick && source == parent) {
+		peer *known = reg.get_peer_by_host(symbol::find(host));
+		if (known != nullptr && nick == "-") {
+			// the nick was taken when the burst got to a server above
+			known->clear_nick();
+			if (children.count(known->route) != 0) {
+				relay_reply(known->route, smsg.str());
+			} else if (known->route != -1) {
+				send_status(known, nick_not_unique);
+			}
+		} else if (known != nullptr && test_nick(nick)) {
+			known->set_nick(nick);
+			relay_reply(known->route, smsg.str());
+		}
+	}
+}
+
+bool server::test_nick(std::string_view nick)
+{
+	if (nick.size() > 9) {
+		return false;
+	}
+	for (auto c : nick) {
+		if (!std::isalnum(c)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void server::do_join(std::istringstream &smsg, int source)
+{
+	std::string host, chan;
+
+	if (smsg >> host >> chan) {
+		peer *known_peer = reg.get_peer_by_host(symbol::find(host));
+		channel *known_channel = reg.get_channel(symbol::find(chan));
+
+		if (known_peer != nullptr) {
+			if (known_peer->get_nick_id() == 0) {
+				send_status(known_peer, nick_not_set);
+			} else if (reg.is_in_channel(known_peer)) {
+				send_status(known_peer, already_in_channel);
+			} else if (root) {
+				if (known_channel != nullptr) {
+					known_channel->join(known_peer);
+					send_status(known_peer, join_known_success);
+				} else {
+					known_channel = new channel(reg, chan, known_peer); // implicit join
+					send_status(known_peer, join_new_success);
+				}
+
+				send_channel(known_peer, known_channel);
+			} else {
+				if (known_channel != nullptr) {
+					known_channel->join(known_peer);
+				}
+				send_parent(smsg.str());
+			}
+		}
+	}
+}
+
+void server::send_channel(const peer *dest, const channel *chan)
+{
+	std::ostringstream reply;
+	if (chan->op != 0) {
+		reply << reply_tag(dest->route) << "CHANNEL" << " " << dest->host() << " " 
+			<< chan->name() << " " <<  symbol::name(chan->op) << " " 
+			<< chan->get_topic() << std::endl;
+		conman->add_message(dest->route, reply.str());
+	}
+}
+
+void server::do_leave(std::istringstream &smsg, int source)
+{
+	std::string host, chan_name;
+	if (smsg >> host >> chan_name) {
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		if (src != nullptr && src->route == source) {
+			channel *chan = reg.get_channel(symbol::find(chan_name));
+			if (chan == nullptr) {
+				send_status(src, no_such_channel);
+			} else if (!chan->in_channel(src)) {
+				send_status(src, not_in_channel);
+			} else {
+				chan->leave(src);
+
+				if (chan->op == src->host_id) {
+					send_delete_channel(chan, source);
+					delete chan;
+				} else if (!root) {
+					send_parent(smsg.str());
+				}
+
+				if (root) {
+					send_status(src, leave_successful);
+				}
+			}
+		}
+	}
+}
+
+
+void server::send_delete_channel(channel *chan, int source)
+{
+	std::ostringstream del_msg;
+	del_msg << request_tag << "DELCHANNEL" << " " << chan->name() << std::endl;
+	send_to_channel(chan, del_msg.str(), source);
+}
+
+void server::do_gettopic(std::istringstream &smsg, int source)
+{
+	std::string host, chan_name;
+	if (smsg >> host >> chan_name) {
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		if (src != nullptr && src->route == source) {
+			channel *chan = reg.get_channel(symbol::find(chan_name));
+			if (chan != nullptr && chan->in_channel(src)) { // known channel, sending reply
+				send_topic(chan, src);
+			} else {
+				send_status(src, not_in_channel);
+			}
+		}
+	}
+}
+
+void server::send_topic(channel *chan, peer *dest)
+{
+	std::ostringstream reply;
+	reply << reply_tag(dest->route) << "TOPIC " 
+		<< dest->host() << " " 
+		<< chan->name() << " " 
+		<< chan->get_topic() << std::endl;
+	conman->add_message(dest->route, reply.str());
+}
+
+void server::do_settopic(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host, chan_name;
+	if (in.next(host) && in.next(chan_name)) {
+		std::string_view topic = in.rest();
+		if (!topic.empty()) { // leading space
+			topic.remove_prefix(1);
+		}
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		channel *chan = reg.get_channel(symbol::find(chan_name));
+		if (parent == source) {
+			if (chan != nullptr) {
+				chan->set_topic(topic);
+				send_to_channel(chan, line, source);
+			}
+		} else if (src != nullptr && src->route == source) {
+			if (chan == nullptr) {
+				send_status(src, no_such_channel);
+			} else if (chan->op == src->host_id) {
+				chan->set_topic(topic);
+				send_to_channel(chan, line, source);
+			} else {
+				send_status(src, nick_not_authorized);
+			}
+		}
+	}
+}
+
+void server::do_msg(line_reader &in, const std::string &line, int source)
+{
+	std::string_view sender, nick, chan_name;
+	if (in.next(sender) && in.next(nick) && in.next(chan_name)) {
+		channel *chan = reg.get_channel(symbol::find(chan_name));
+		peer *src = reg.get_peer_by_host(symbol::find(sender));
+
+		if (chan == nullptr) {
+			if (src != nullptr) {
+				send_status(src, no_such_channel);
+			}
+		} else if (shortcut_links.count(source) != 0) {
+			receive_shortcut(chan, line, source);
+		} else { // knows the channel
+			if (src != nullptr) {
+				if (src->route == source && within_rate(src, source)) { // validate source
+					if (children.count(source) == 0 && (shortcut_threshold != 0 || !shortcut_out.empty())) {
+						send_shortcut(chan, line, source);
+					} else {
+						send_to_channel(chan, line, source);
+					}
+					if (root) {
+						send_status(src, msg_delivered);
+					}
+				}
+			} else if (source == parent) {
+				relay_from_parent(chan, line);
+			}
+		}
+	}
+}
+
+void server::do_privmsg(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host, sender_nick, chan_name, dest_nick;
+	if (in.next(host) && in.next(sender_nick) && in.next(chan_name) && in.next(dest_nick)) {
+		channel *chan = reg.get_channel(symbol::find(chan_name));
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		peer *dest = reg.get_peer(symbol::find(dest_nick));
+
+		if (chan == nullptr) {
+			if (src != nullptr) {
+				send_status(src, no_such_channel);
+			}
+		} else { // knows the channel
+			if (src != nullptr) {
+				if (src->route == source && within_rate(src, source)) { // validate source
+					if (dest != nullptr) {
+						if (chan->in_channel(src)) {
+							if (chan->in_channel(dest)) {
+								forward(dest->route, line);
+							} else {
+								send_status(src, no_such_client_in_channel);
+							}
+						}
+					} else {
+						if (!root) {
+							send_parent(line);
+						}
+					}
+				}
+			} else if (source == parent) {
+				if (dest != nullptr) {
+					if (chan->in_channel(dest)) {
+						forward(dest->route, line);
+					}
+				}
+			}
+		}
+	}
+}
+
+void server::do_status(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host, code;
+	if (in.next(host) && in.next(code)) {
+		peer *dest = reg.get_peer_by_host(symbol::find(host));
+		if (dest != nullptr) {
+			relay_reply(dest->route, line);
+			if (source == parent && code == std::to_string(static_cast<int>(connect_error))) {
+				drop_peer(dest); // the host is connected elsewhere in the tree
+			}
+		}
+	}
+}
+
+void server::do_topic(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host, chan_name;
+	if (in.next(host) && in.next(chan_name)) {
+		peer *dest = reg.get_peer_by_host(symbol::find(host));
+		if (dest != nullptr) {
+			relay_reply(dest->route, line);
+		}
+	}
+}
+
+void server::do_list(std::istringstream &smsg, int source)
+{
+	std::string host, prefix;
+	size_t min_members = 0;
+	if (smsg >> host) {
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		if (src != nullptr && src->route == source) {
+			if (smsg >> prefix && prefix == "*") {
+				prefix.clear();
+			}
+			smsg >> min_members;
+			if (root) { // changes of this window are in the answer
+				publish_channels();
+			}
+			send_channel_list(src, prefix, min_members);
+		}
+	}
+}
+
+void server::send_channel_list(peer *dest, std::string_view prefix, size_t min_members)
+{
+	std::string after;
+	bool more;
+	do {
+		std::string names;
+		more = directory.page(prefix, min_members, after, LIST_PAGE, names);
+		conman->add_message(dest->route, reply_tag(dest->route) + (more ? "LISTPAGE " : "LISTRES ")
+				+ dest->host() + names + "\n");
+	} while (more);
+}
+
+void server::do_chaninfo(line_reader &in, const std::string &line, int source)
+{
+	std::string_view chan_name, members;
+	if (source == parent && in.next(chan_name) && in.next(members)) {
+		std::string_view topic = in.rest();
+		if (!topic.empty()) { // leading space
+			topic.remove_prefix(1);
+		}
+		directory.set(chan_name, std::strtoul(std::string(members).c_str(), nullptr, 10), topic);
+		auto stale = stale_channels.find(chan_name);
+		if (stale != stale_channels.end()) {
+			stale_channels.erase(stale);
+		}
+		if (!children.empty()) {
+			conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
+		}
+	}
+}
+
+void server::do_standby(std::istringstream &smsg, int source)
+{
+	std::string name;
+	if (!(smsg >> name) || source == parent) {
+		return;
+	}
+	if (!root || standby != -1) {
+		LOG(LOG_WARN, LOG_SERVER, "standby: ", "refused " + name
+				+ (root ? ", a standby is linked" : ", not the root"));
+		close_route(source);
+		return;
+	}
+	children.insert(source);
+	conman->set_link(source);
+	child_names[source] = name;
+	standby = source;
+	repl_pending.clear();
+	reg.journal_changes(true);
+	std::string snapshot = reg.snapshot();
+	LOG(LOG_INFO, LOG_SERVER, "standby: ", name + " linked, " + std::to_string(reg.peer_list().size())
+			+ " peers and " + std::to_string(reg.channel_list().size()) + " channels in "
+			+ std::to_string(snapshot.size()) + " bytes");
+	conman->add_message(source, std::move(snapshot));
+	send_directory(source);
+	send_topology(source);
+	conman->add_message(source, std::string("BURSTEND\n"));
+}
+
+void server::flush_journal()
+{
+	std::string lines = reg.take_journal();
+	repl_seq++;
+	lines += "REPL MARK " + std::to_string(repl_seq) + "\n";
+	conman->add_message(standby, std::move(lines));
+	if (repl_pending.size() == REPL_PENDING) {
+		repl_pending.pop_front();
+	}
+	repl_pending.emplace_back(repl_seq, monotonic_ns());
+}
+
+void server::do_replack(std::istringstream &smsg, int source)
+{
+	uint64_t seq;
+	if (source == standby && smsg >> seq) {
+		uint64_t now = monotonic_ns();
+		while (!repl_pending.empty() && repl_pending.front().first <= seq) {
+			if (repl_pending.front().first == seq) {
+				repl_lag.record(now - repl_pending.front().second);
+			}
+			repl_pending.pop_front();
+		}
+	}
+}
+
+void server::do_repl(line_reader &in, const std::string &line, int source)
+{
+	std::string_view op, name, arg;
+	if (!following || source != parent || !in.next(op) || !in.next(name)) {
+		return;
+	}
+	if (op == "MARK") {
+		repl_seq = std::strtoull(std::string(name).c_str(), nullptr, 10);
+		conman->add_message(parent, "REPLACK " + std::string(name) + "\n");
+		return;
+	}
+	// the peers of this server's own subtree are kept as they are
+	if (op == "PEER" || op == "NICK" || op == "QUIT") {
+		peer *p = reg.get_peer_by_host(symbol::find(name));
+		if (op == "PEER" && p == nullptr) {
+			in.next(arg);
+			symbol_id origin = arg.empty() || arg == "-" ? 0 : symbol::acquire(arg);
+			new peer(reg, parent, name, origin);
+			symbol::release(origin);
+		} else if (op == "NICK" && p != nullptr && in.next(arg)) {
+			if (arg == "-") {
+				p->clear_nick();
+			} else {
+				p->set_nick(arg);
+			}
+		} else if (op == "QUIT" && p != nullptr && p->route == parent) {
+			delete p;
+		}
+		return;
+	}
+	channel *chan = reg.get_channel(symbol::find(name));
+	if (op == "CHAN" && chan == nullptr && in.next(arg)) {
+		std::string_view topic = in.rest();
+		if (!topic.empty()) { // leading space
+			topic.remove_prefix(1);
+		}
+		new channel(reg, topic, name, arg);
+	} else if (chan == nullptr) {
+		return;
+	} else if (op == "TOPIC") {
+		std::string_view topic = in.rest();
+		if (!topic.empty()) {
+			topic.remove_prefix(1);
+		}
+		chan->set_topic(topic);
+	} else if (op == "DELCHAN") {
+		delete chan;
+	} else if ((op == "JOIN" || op == "LEAVE") && in.next(arg)) {
+		peer *p = reg.get_peer_by_host(symbol::find(arg));
+		if (p != nullptr) {
+			op == "JOIN" ? chan->join(p) : chan->leave(p);
+		}
+	}
+}
+
+void server::publish_channels()
+{
+	std::set<std::string> names;
+	if (!reg.tracks_channels()) {
+		// a new root drops what it knew from its parent and is not here
+		reg.track_channels(true);
+		for (auto &e : directory.get_entries()) {
+			names.insert(e.first);
+		}
+		stale_channels.clear();
+	}
+	auto changed = reg.take_changes();
+	names.insert(changed.begin(), changed.end());
+	channels_due = 0;
+
+	std::vector<int> servers(children.begin(), children.end());
+	for (auto &name : names) {
+		channel *chan = reg.get_channel(symbol::find(name));
+		size_t members = 0;
+		std::string topic;
+		if (chan != nullptr) {
+			members = std::max<size_t>(chan->get_members().size(), 1);
+			topic = chan->get_topic();
+		}
+		directory.set(name, members, topic);
+		if (!servers.empty()) {
+			conman->add_broadcast(servers, "CHANINFO " + name + " " + std::to_string(members)
+					+ " " + topic + "\n");
+		}
+	}
+}
+
+void server::send_directory(int sock)
+{
+	for (auto &e : directory.get_entries()) {
+		conman->add_message(sock, "CHANINFO " + e.first + " " + std::to_string(e.second.members)
+				+ " " + e.second.topic + "\n");
+	}
+}
+
+void server::do_channel(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host, chan_name, op;
+	if (in.next(host) && in.next(chan_name) && in.next(op)) {
+		std::string_view topic = in.rest();
+		if (!topic.empty()) { // leading space
+			topic.remove_prefix(1);
+		}
+		peer *dest = reg.get_peer_by_host(symbol::find(host));
+		if (source == parent && dest != nullptr) {
+			channel *chan = reg.get_channel(symbol::find(chan_name));
+			if (chan != nullptr) {
+				chan->set_topic(topic);
+			} else {
+				chan = new channel(reg, topic, chan_name, op);
+			}
+			chan->join(dest);
+			if (directory.get_entries().count(chan->name()) == 0) {
+				// listed before its CHANINFO arrives
+				directory.set(chan->name(), 1, chan->get_topic());
+			}
+			relay_reply(dest->route, line);
+		}
+	}
+}
+
+void server::do_listres(line_reader &in, const std::string &line, int source)
+{
+	std::string_view host;
+	if (in.next(host)) {
+		peer *dest = reg.get_peer_by_host(symbol::find(host));
+		if (dest != nullptr) {
+			relay_reply(dest->route, line);
+		}
+	}
+}
+
+void server::send_to_channel(channel *chan, std::string_view msg, int source)
+{
+	// clients get the line without request id
+	bool tagged = !msg.empty() && msg[0] == '@';
+	// subtrees that got the line over a shortcut are left out
+	std::string_view served = tagged ? served_of(msg) : std::string_view();
+	server_routes.clear();
+	client_routes.clear();
+	for (auto s : chan->get_routes()) {
+		// a standby knows members behind the parent, send_parent reaches them
+		if (s == source || s == parent) {
+			continue;
+		}
+		if (!tagged || children.count(s) != 0) {
+			if (served.empty() || !shortcut_covers(chan, s, served)) {
+				server_routes.push_back(s);
+			} else {
+				shortcut_pruned++;
+			}
+		} else {
+			client_routes.push_back(s);
+		}
+	}
+	if (!server_routes.empty()) {
+		conman->add_broadcast(server_routes, msg);
+	}
+	if (!client_routes.empty()) {
+		conman->add_broadcast(client_routes, untagged(msg));
+	}
+	if (!root && source != parent) {
+		send_parent(msg);
+	}
+}
+
+std::string_view server::untagged(std::string_view msg)
+{
+	if (msg.empty() || msg[0] != '@') {
+		return msg;
+	}
+	size_t end = msg.find(' ');
+	return end == std::string_view::npos ? msg : msg.substr(end + 1);
+}
+
+void server::forward(int route, std::string_view msg)
+{
+	conman->add_message(route, children.count(route) != 0 ? msg : untagged(msg));
+}
+
+const char* server_exception::what() const throw()
+{
+	return "server: failed to create a server";
+}
+
+void server::close_route(int sock)
+{
+	if (sock == standby) {
+		LOG(LOG_WARN, LOG_SERVER, "standby: ", "lost the standby root");
+		standby = -1;
+		reg.journal_changes(false);
+		repl_pending.clear();
+	}
+	auto peers = reg.get_peers(sock);
+
+	// everything behind a server link goes in one NETSPLIT by origin
+	bool server_link = children.count(sock) != 0;
+	std::set<symbol_id> origins;
+	std::string netsplit = "NETSPLIT";
+	for (auto p : peers) {
+		if (!root && server_link) {
+			if (origins.insert(p->origin).second) {
+				netsplit += " " + symbol::name(p->origin);
+			}
+		} else if (!root) {
+			queue_presence(false, "", p->host());
+		}
+	}
+	for (auto p : peers) {
+		delete p;
+	}
+	if (!origins.empty()) {
+		send_parent(netsplit + "\n");
+	}
+
+	children.erase(sock);
+	auto child = child_names.find(sock);
+	if (child != child_names.end()) {
+		// the servers below it go with it, unless it announced a new parent
+		std::string line = "TOPO " + child->second + " " + symbol::name(name_id) + " -\n";
+		child_names.erase(child);
+		if (!root) {
+			send_parent(line);
+		} else if (apply_topology(line) && !children.empty()) {
+			conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
+		}
+		announce_topology(false);
+	}
+	carried_unread.erase(sock);
+	buckets.erase(sock);
+	if (serving == sock) {
+		serving = -1;
+	}
+	conman->remove_socket(sock);
+	if (shortcut_links.count(sock) != 0) {
+		close_shortcut(sock);
+	}
+	if (sock == placing) { // closed before it answered PLACE
+		placing = -1;
+		connect_parent(placing_host, placing_port);
+	}
+}
+
+void server::do_quit(std::istringstream &smsg, int source)
+{
+	std::string host;
+
+	if (smsg >> host) {
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		if (src != nullptr && src->route == source) {
+			drop_peer(src);
+			if (!root) {
+				queue_presence(false, "", host);
+			}
+		}
+	}
+}
+
+void server::do_quits(std::istringstream &smsg, int source)
+{
+	std::string host;
+
+	while (smsg >> host) {
+		peer *src = reg.get_peer_by_host(symbol::find(host));
+		if (src != nullptr && src->route == source) {
+			drop_peer(src);
+			if (!root) {
+				queue_presence(false, "", host);
+			}
+		}
+	}
+}
+
+void server::do_netsplit(std::istringstream &smsg, int source)
+{
+	std::set<symbol_id> origins;
+	std::string name;
+	while (smsg >> name) {
+		symbol_id origin = symbol::find(name);
+		if (origin != 0) {
+			origins.insert(origin);
+		}
+	}
+
+	if (source != parent && !origins.empty()) {
+		for (auto p : reg.get_peers(source)) {
+			if (origins.count(p->origin) != 0) {
+				drop_peer(p);
+			}
+		}
+		if (!root) {
+			send_parent(smsg.str());
+		}
+	}
+}
+
+void server::do_burst(std::istringstream &smsg, int source)
+{
+	std::string origin_name, entry;
+
+	if (smsg >> origin_name && children.count(source) != 0) {
+		symbol_id origin = symbol::acquire(origin_name);
+		std::string accepted = "BURST " + origin_name;
+		size_t count = 0;
+		while (smsg >> entry) {
+			size_t colon = entry.find(':');
+			std::string host = entry.substr(0, colon);
+			peer *known = reg.get_peer_by_host(symbol::find(host));
+			if (known != nullptr && known->route != source && (known->origin == origin
+						|| known->route == -1 || (following && known->route == parent))) {
+				// its server moved here, or a peer of the lost root is back
+				takeover_adopted += known->route == -1;
+				known->reroute(source);
+				std::string nick = colon != std::string::npos ? entry.substr(colon + 1) : "";
+				if (known->get_nick_id() != 0) {
+					if (known->get_nick() != nick) {
+						conman->add_message(source, "NICKRES " + host + " " + known->get_nick() + "\n");
+					}
+				} else if (!nick.empty() && (reg.get_peer(symbol::find(nick)) != nullptr
+							|| !known->set_nick(nick))) {
+					// taken here, the subtree drops it too
+					conman->add_message(source, "NICKRES " + host + " -\n");
+				}
+				accepted += " " + host + (known->get_nick_id() != 0 ? ":" + known->get_nick() : "");
+				count++;
+				continue;
+			}
+			if (known != nullptr) {
+				continue; // the host known here wins
+			}
+			peer *p = new peer(reg, source, host, origin);
+			accepted += " " + host;
+			if (colon != std::string::npos) {
+				std::string nick = entry.substr(colon + 1);
+				if (reg.get_peer(symbol::find(nick)) == nullptr && p->set_nick(nick)) {
+					accepted += ":" + nick;
+				} else if (!nick.empty()) {
+					conman->add_message(source, "NICKRES " + host + " -\n");
+				}
+			}
+			count++;
+		}
+		symbol::release(origin);
+		if (!root && count > 0) {
+			send_parent(accepted + "\n");
+		}
+	}
+}
+
+void server::do_burstchan(std::istringstream &smsg, int source)
+{
+	std::string chan_name, op, members, topic;
+
+	if (!(smsg >> chan_name >> op >> members)) {
+		return;
+	}
+	std::getline(smsg, topic);
+	if (!topic.empty() && topic[0] == ' ') {
+		topic.erase(0, 1);
+	}
+	channel *chan = reg.get_channel(symbol::find(chan_name));
+
+	if (source == parent) { // the view of the root, passed down to members
+		if (chan != nullptr) {
+			chan = adopt_channel(chan, op, topic);
+			std::string line = "BURSTCHAN " + chan_name + " " + op + " - " + topic + "\n";
+			for (int route : chan->get_routes()) {
+				if (children.count(route) != 0) {
+					conman->add_message(route, line);
+				}
+			}
+		}
+		return;
+	}
+	if (children.count(source) == 0) {
+		return;
+	}
+
+	bool known = chan != nullptr;
+	if (!known) {
+		chan = new channel(reg, topic, chan_name, op);
+	}
+	std::string accepted;
+	std::istringstream list(members);
+	std::string host;
+	while (members != "-" && std::getline(list, host, ',')) {
+		peer *member = reg.get_peer_by_host(symbol::find(host));
+		if (member != nullptr && member->route == source && !reg.is_in_channel(member)) {
+			chan->join(member);
+			accepted += (accepted.empty() ? "" : ",") + host;
+		}
+	}
+
+	std::string here_op = symbol::name(chan->op);
+	if (known && (here_op != op || chan->get_topic() != topic)) {
+		// the link takes over what is known here
+		conman->add_message(source, "BURSTCHAN " + chan_name + " " + here_op + " - "
+				+ chan->get_topic() + "\n");
+	}
+	if (!root) {
+		send_parent("BURSTCHAN " + chan_name + " " + here_op + " "
+				+ (accepted.empty() ? "-" : accepted) + " " + chan->get_topic() + "\n");
+	}
+}
+
+void server::do_burstend(std::istringstream &smsg, int source)
+{
+	if (source == parent && link_started != 0) {
+		uint64_t took = monotonic_ns() - link_started;
+		link_started = 0;
+		LOG(LOG_INFO, LOG_SERVER, "linked: ", (following ? "mirrored the root after "
+					: "parent merged the burst after ") + std::to_string(took / 1000) + " us");
+		// what the parent did not announce again is gone
+		std::vector<int> servers(children.begin(), children.end());
+		for (auto &name : stale_channels) {
+			directory.set(name, 0, "");
+			if (!servers.empty()) {
+				conman->add_broadcast(servers, "CHANINFO " + name + " 0 \n");
+			}
+		}
+		stale_channels.clear();
+		// depth and rtt come with the answer
+		conman->add_message(parent, "LINKPING " + std::to_string(conman->clock_ns()) + "\n");
+	} else if (children.count(source) != 0) {
+		// after the corrections for the burst of the link
+		send_directory(source);
+		send_topology(source);
+		conman->add_message(source, std::string("BURSTEND\n"));
+	}
+}
+
+channel *server::adopt_channel(channel *chan, const std::string &op, const std::string &topic)
+{
+	bool changed = chan->get_topic() != topic;
+	chan->set_topic(topic);
+	if (symbol::name(chan->op) != op) {
+		std::set<peer*> members = chan->get_members();
+		std::string name = chan->name();
+		delete chan;
+		chan = new channel(reg, topic, name, op);
+		for (auto m : members) {
+			chan->join(m);
+		}
+		changed = true;
+	}
+	if (changed) {
+		for (auto m : chan->get_members()) {
+			if (m->route != parent && children.count(m->route) == 0) {
+				conman->add_message(m->route, "CHANNEL " + m->host() + " " + chan->name() + " "
+						+ op + " " + topic + "\n");
+			}
+		}
+	}
+	return chan;
+}
+
+void server::drop_peer(peer *src)
+{
+	std::vector<channel*> chans = src->get_channels();
+	for (auto chan : chans) {
+		if (chan->op == src->host_id) {
+			send_delete_channel(chan, src->route);
+			delete chan;
+		} else {
+			chan->leave(src);
+		}
+	}
+	delete src;
+}
+
+
+static void split_address(std::string_view address, std::string &host, std::string &port)
+{
+	// server names are host:port, a name without port uses the default
+	size_t local = address.find(":" UNIX_PREFIX);
+	if (local != std::string_view::npos) {
+		// host:unix:/path, only reached from the same host
+		host = address.substr(local + 1);
+		port.clear();
+		return;
+	}
+	size_t colon = address.rfind(':');
+	host = address.substr(0, colon);
+	port = colon != std::string_view::npos ? address.substr(colon + 1) : DEFAULT_PORT;
+}
+
+void server::set_placement_fanout(size_t n)
+{
+	place_fanout = n;
+}
+
+void server::do_linkping(std::istringstream &smsg, int source)
+{
+	std::string sent;
+	if (children.count(source) != 0 && smsg >> sent) {
+		conman->add_message(source, "LINKPONG " + sent + " " + symbol::name(name_id) + " "
+				+ std::to_string(depth) + " " + std::to_string(root_rtt_us) + "\n");
+	}
+}
+
+void server::do_linkpong(std::istringstream &smsg, int source)
+{
+	uint64_t sent, rtt;
+	unsigned parent_depth;
+	std::string name;
+	if (source != parent || !(smsg >> sent >> name >> parent_depth >> rtt)) {
+		return;
+	}
+	if (sent != 0) { // 0 if the parent only tells a change
+		uint64_t sample = (conman->clock_ns() - sent) / 1000;
+		link_rtt_us = link_rtt_us == 0 ? sample : (7 * link_rtt_us + sample) / 8;
+	}
+	bool moved = depth != parent_depth + 1 || parent_name != name;
+	depth = parent_depth + 1;
+	parent_name = name;
+	root_rtt_us = rtt + link_rtt_us;
+	if (moved) {
+		push_depth();
+	}
+	announce_topology(false);
+}
 
-	conman->add_message(dest->route, msg.str());
+void server::push_depth()
+{
+	if (!children.empty()) {
+		conman->add_broadcast(std::vector<int>(children.begin(), children.end()), "LINKPONG 0 "
+				+ symbol::name(name_id) + " " + std::to_string(depth) + " " + std::to_string(root_rtt_us) + "\n");
+	}
 }
 
-void server::do_nickres(std::istringstream &smsg, int source)
+void server::announce_topology(bool force)
 {
-	std::string host, nick;
-	if (smsg >> host >> nick && source == parent) {
-		peer *known = peer::get_by_host(host);
-		if (known != nullptr && test_nick(nick)) {
-			known->set_nick(nick);
-			conman->add_message(known->route, smsg.str());
-		}
+	if (!root && (parent == -1 || parent_name.empty())) {
+		return; // the depth comes with the first LINKPONG
+	}
+	std::string state = symbol::name(name_id) + " " + parent_name + " " + std::to_string(depth)
+		+ " " + std::to_string(children.size());
+	uint64_t now = conman->clock_ns();
+	// the rtt goes up again when it moved by a quarter
+	bool rtt_moved = root_rtt_us > topo_sent_rtt + topo_sent_rtt / 4 + 100
+		|| topo_sent_rtt > root_rtt_us + root_rtt_us / 4 + 100;
+	if (!force && state == topo_sent && !rtt_moved && now < topo_sent_at + TOPO_REFRESH_NS) {
+		return;
+	}
+	topo_sent = state;
+	topo_sent_rtt = root_rtt_us;
+	topo_sent_at = now;
+	std::string line = "TOPO " + state + " " + std::to_string(root_rtt_us) + "\n";
+	if (!root) {
+		send_parent(line);
+	} else if (apply_topology(line) && !children.empty()) {
+		conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
 	}
 }
 
-bool server::test_nick(std::string nick)
+bool server::apply_topology(std::string_view line)
 {
-	if (nick.size() > 9) {
+	line_reader in(line);
+	std::string_view cmd, name, parent_of, depth_field, children_field, rtt_field;
+	if (!in.next(cmd) || !in.next(name) || !in.next(parent_of) || !in.next(depth_field)) {
 		return false;
 	}
-	for (auto c : nick) {
-		if (!std::isalnum(c)) {
+	auto found = topology.find(name);
+	if (depth_field == "-") {
+		if (found == topology.end() || found->second.parent != parent_of) {
 			return false;
 		}
+		std::set<std::string, std::less<>> gone = { std::string(name) };
+		bool more = true;
+		while (more) {
+			more = false;
+			for (auto &e : topology) {
+				if (gone.count(e.second.parent) != 0 && gone.insert(e.first).second) {
+					more = true;
+				}
+			}
+		}
+		for (auto &g : gone) {
+			topology.erase(g);
+		}
+		shortcut_prunes.clear();
+		return true;
 	}
-	return true;
+	if (!in.next(children_field) || !in.next(rtt_field)) {
+		return false;
+	}
+	topology_entry e;
+	e.parent = parent_of;
+	e.depth = static_cast<unsigned>(std::strtoul(std::string(depth_field).c_str(), nullptr, 10));
+	e.children = std::strtoul(std::string(children_field).c_str(), nullptr, 10);
+	e.rtt_us = std::strtoull(std::string(rtt_field).c_str(), nullptr, 10);
+	e.seen = conman->clock_ns();
+	bool changed = found == topology.end() || found->second.parent != e.parent
+		|| found->second.depth != e.depth || found->second.children != e.children
+		|| found->second.rtt_us != e.rtt_us;
+	if (found == topology.end()) {
+		topology.emplace(std::string(name), std::move(e));
+	} else {
+		found->second = std::move(e);
+	}
+	if (changed) {
+		shortcut_prunes.clear();
+	}
+	return changed;
 }
 
-void server::do_join(std::istringstream &smsg, int source)
+void server::do_topo(line_reader &in, const std::string &line, int source)
 {
-	std::string host, chan;
-
-	if (smsg >> host >> chan) {
-		peer *known_peer = peer::get_by_host(host);
-		channel *known_channel = channel::get(chan);
-
-		if (known_peer != nullptr) {
-			if (known_peer->get_nick() == "") {
-				send_status(known_peer, nick_not_set);
-			} else if (channel::is_in_channel(known_peer)) {
-				send_status(known_peer, already_in_channel);
-			} else if (root) {
-				if (known_channel != nullptr) {
-					known_channel->join(known_peer);
-					send_status(known_peer, join_known_success);
-				} else {
-					known_channel = new channel(chan, known_peer); // implicit join
-					send_status(known_peer, join_new_success);
-				}
-
-				send_channel(known_peer, known_channel);
-			} else {
-				if (known_channel != nullptr) {
-					known_channel->join(known_peer);
-				}
-				conman->add_message(parent, smsg.str());
-			}
+	if (children.count(source) != 0) {
+		if (!root) { // the root keeps the table
+			send_parent(line);
+		} else if (apply_topology(line)) {
+			conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
+		}
+	} else if (source == parent) {
+		apply_topology(line);
+		if (!children.empty()) {
+			conman->add_broadcast(std::vector<int>(children.begin(), children.end()), line);
 		}
 	}
 }
 
-void server::send_channel(const peer *dest, const channel *chan)
+void server::send_topology(int sock)
 {
-	std::ostringstream reply;
-	if (chan->op != "") {
-		reply << "CHANNEL" << " " << dest->host << " " 
-			<< chan->name << " " <<  chan->op << " " 
-			<< chan->get_topic() << std::endl;
-		conman->add_message(dest->route, reply.str());
+	for (auto &e : topology) {
+		conman->add_message(sock, "TOPO " + e.first + " " + e.second.parent + " "
+				+ std::to_string(e.second.depth) + " " + std::to_string(e.second.children) + " "
+				+ std::to_string(e.second.rtt_us) + "\n");
 	}
 }
 
-void server::do_leave(std::istringstream &smsg, int source)
+std::string server::best_parent(std::string_view name) const
 {
-	std::string host, chan_name;
-	if (smsg >> host >> chan_name) {
-		peer *src = peer::get_by_host(host);
-		if (src != nullptr && src->route == source) {
-			channel *chan = channel::get(chan_name);
-			if (chan == nullptr) {
-				send_status(src, no_such_channel);
-			} else if (!chan->in_channel(src)) {
-				send_status(src, not_in_channel);
-			} else {
-				chan->leave(src);
-
-				if (chan->op == src->host) {
-					send_delete_channel(chan, source);
-					delete chan;
-				} else if (!root) {
-					conman->add_message(parent, smsg.str());
-				}
-
-				if (root) {
-					send_status(src, leave_successful);
-				}
+	auto below = [this, name](const std::string &candidate) {
+		auto e = topology.find(candidate);
+		for (size_t steps = 0; e != topology.end() && steps <= topology.size(); steps++) {
+			if (e->first == name) {
+				return true;
+			}
+			e = topology.find(e->second.parent);
+		}
+		return false;
+	};
+	// shallowest with room first, any shallowest if all are full
+	for (size_t fanout : { place_fanout, static_cast<size_t>(-1) }) {
+		const std::string *best = nullptr;
+		const topology_entry *best_entry = nullptr;
+		for (auto &e : topology) {
+			const topology_entry &t = e.second;
+			if (t.children >= fanout || below(e.first)) {
+				continue;
+			}
+			if (best_entry == nullptr || t.depth < best_entry->depth
+					|| (t.depth == best_entry->depth && (t.rtt_us < best_entry->rtt_us
+					|| (t.rtt_us == best_entry->rtt_us && t.children < best_entry->children)))) {
+				best = &e.first;
+				best_entry = &t;
 			}
 		}
+		if (best != nullptr) {
+			return *best;
+		}
 	}
+	return "";
 }
 
+void server::do_place(std::istringstream &smsg, int source)
+{
+	std::string name;
+	if (smsg >> name) {
+		std::string best = best_parent(name);
+		if (best.empty()) {
+			best = symbol::name(name_id);
+		}
+		LOG(LOG_INFO, LOG_SERVER, "placement: ", "recommended " + best + " to " + name);
+		conman->add_message(source, "PLACERES " + name + " " + best + "\n");
+	}
+}
 
-void server::send_delete_channel(channel *chan, int source)
+bool server::connect_placed(std::string host, std::string port)
 {
-	std::ostringstream del_msg;
-	del_msg << "DELCHANNEL" << " " << chan->name << std::endl;
-	send_to_channel(chan, del_msg.str(), source);
+	int sock = conman->create_connection(host, port);
+	if (sock == -1) {
+		return false;
+	}
+	conman->add_message(sock, "PLACE " + symbol::name(name_id) + "\n");
+	placing = sock;
+	placing_host = host;
+	placing_port = port;
+	return true;
 }
 
-void server::do_gettopic(std::istringstream &smsg, int source)
+void server::do_placeres(std::istringstream &smsg, int source)
 {
-	std::string host, chan_name;
-	if (smsg >> host >> chan_name) {
-		peer *src = peer::get_by_host(host);
-		if (src != nullptr && src->route == source) {
-			channel *chan = channel::get(chan_name);
-			if (chan != nullptr && chan->in_channel(src)) { // known channel, sending reply
-				send_topic(chan, src);
-			} else {
-				send_status(src, not_in_channel);
-			}
-		}
+	std::string name, address, host, port;
+	if (source != placing || !(smsg >> name >> address)) {
+		return;
+	}
+	placing = -1;
+	close_route(source);
+	split_address(address, host, port);
+	LOG(LOG_INFO, LOG_SERVER, "placement: ", placing_host + ":" + placing_port + " recommends " + address);
+	if (!connect_parent(host, port) && !connect_parent(placing_host, placing_port)) {
+		LOG(LOG_WARN, LOG_SERVER, "placement: ", "failed to link to " + address + ", now root");
 	}
 }
 
-void server::send_topic(channel *chan, peer *dest)
+bool server::rebalance()
 {
-	std::ostringstream reply;
-	reply << "TOPIC " 
-		<< dest->host << " " 
-		<< chan->name << " " 
-		<< chan->get_topic() << std::endl;
-	conman->add_message(dest->route, reply.str());
+	if (root || following || link_started != 0) {
+		return false;
+	}
+	std::string best = best_parent(symbol::name(name_id));
+	auto found = topology.find(best);
+	if (found == topology.end() || best == parent_name || found->second.depth + 1 >= depth) {
+		LOG(LOG_INFO, LOG_SERVER, "rebalance: ", "no parent nearer to the root than " + parent_name);
+		return false;
+	}
+	// the old parent forgets the subtree without QUITs, the burst brings it back
+	std::string old_name = parent_name, host, port;
+	unsigned old_depth = depth;
+	unsigned new_depth = found->second.depth + 1; // connect_parent clears the table
+	if (!presence.empty()) {
+		flush_presence();
+	}
+	conman->add_message(parent, std::string("MOVED\n"));
+	// peers known from above go as on a netsplit, without QUITs when the
+	// old link closes. The new parent does not burst downwards
+	for (auto p : reg.get_peers(parent)) {
+		delete p;
+	}
+	split_address(best, host, port);
+	if (!connect_parent(host, port)) {
+		split_address(old_name, host, port);
+		connect_parent(host, port);
+		return false;
+	}
+	LOG(LOG_INFO, LOG_SERVER, "rebalance: ", "moved from " + old_name + " at depth " + std::to_string(old_depth)
+			+ " to " + best + " at depth " + std::to_string(new_depth));
+	return true;
 }
 
-void server::do_settopic(std::istringstream &smsg, int source)
+void server::do_moved(std::istringstream &smsg, int source)
 {
-	std::string host, chan_name, topic;
-	if (smsg >> host >> chan_name && std::getline(smsg, topic, '\n')) {
-		if (topic.size() > 0) { // leading space
-			topic = topic.substr(1, topic.size());
+	if (children.count(source) == 0) {
+		return;
+	}
+	// no names: all of the link moved, else the subtrees of the origins
+	std::set<symbol_id> origins;
+	std::string name;
+	bool whole = true;
+	while (smsg >> name) {
+		whole = false;
+		origins.insert(symbol::find(name));
+	}
+	std::set<std::string> dropped; // the names go with the last peer
+	std::set<channel*> chans;
+	for (auto p : reg.get_peers(source)) {
+		if (whole || origins.count(p->origin) != 0) {
+			dropped.insert(symbol::name(p->origin));
+			chans.insert(p->get_channels().begin(), p->get_channels().end());
+			delete p;
 		}
-		peer *src = peer::get_by_host(host);
-		channel *chan = channel::get(chan_name);
-		if (parent == source) {
-			if (chan != nullptr) {
-				chan->set_topic(topic);
-				send_to_channel(chan, smsg.str(), source);
-			}
-		} else if (src != nullptr && src->route == source) {
-			if (chan == nullptr) {
-				send_status(src, no_such_channel);
-			} else if (chan->op == src->host) {
-				chan->set_topic(topic);
-				send_to_channel(chan, smsg.str(), source);
-			} else {
-				send_status(src, nick_not_authorized);
+	}
+	if (!root) { // a channel is only known here for its members
+		for (auto chan : chans) {
+			if (chan->get_members().empty()) {
+				delete chan;
 			}
 		}
 	}
+	if (!root && !dropped.empty()) {
+		std::string line = "MOVED";
+		for (auto &origin : dropped) {
+			line += " " + origin;
+		}
+		send_parent(line + "\n");
+	}
+	if (whole) {
+		close_route(source);
+	}
 }
 
-void server::do_msg(std::istringstream &smsg, int source)
+void server::topology_report(std::ostream &out) const
 {
-	std::string chan_name, msg, sender, nick;
-	if (smsg >> sender >> nick >> chan_name) {
-		channel *chan = channel::get(chan_name);
-		peer *src = peer::get_by_host(sender);
-
-		if (chan == nullptr) {
-			if (src != nullptr) {
-				send_status(src, no_such_channel);
-			}
-		} else { // knows the channel
-			if (src != nullptr) {
-				if (src->route == source) { // validate source
-					send_to_channel(chan, smsg.str(), source);
-					if (root) {
-						send_status(src, msg_delivered);
-					}
-				}
-			} else if (source == parent) {
-				send_to_channel(chan, smsg.str(), source);
-			}
+	unsigned max_depth = 0;
+	uint64_t depth_sum = 0, rtt_sum = 0;
+	for (auto &e : topology) {
+		depth_sum += e.second.depth;
+		rtt_sum += e.second.rtt_us;
+		max_depth = std::max(max_depth, e.second.depth);
+	}
+	size_t n = topology.size();
+	out << "depth " << depth << ", servers " << n << " at depth mean "
+		<< (n ? static_cast<double>(depth_sum) / static_cast<double>(n) : 0) << " max " << max_depth
+		<< ", rtt_us to the root mean " << (n ? rtt_sum / n : 0);
+	// clients known here, one link more than their server
+	size_t clients = 0;
+	uint64_t client_depth = 0;
+	for (auto p : reg.peer_list()) {
+		auto e = topology.find(symbol::name(p->origin));
+		if (e != topology.end()) {
+			clients++;
+			client_depth += e->second.depth + 1;
 		}
 	}
+	out << ", clients " << clients << " at depth mean "
+		<< (clients ? static_cast<double>(client_depth) / static_cast<double>(clients) : 0);
 }
 
-void server::do_privmsg(std::istringstream &smsg, int source)
+void server::set_shortcut_threshold(size_t lines)
 {
-	std::string host, sender, sender_nick, chan_name, dest_nick;
-	if (smsg >> host >> sender_nick >> chan_name >> dest_nick) {
-		channel *chan = channel::get(chan_name);
-		peer *src = peer::get_by_host(host);
-		peer *dest = peer::get(dest_nick);
-
-		if (chan == nullptr) {
-			if (src != nullptr) {
-				send_status(src, no_such_channel);
-			}
-		} else { // knows the channel
-			if (src != nullptr) {
-				if (src->route == source) { // validate source
-					if (dest != nullptr) {
-						if (chan->in_channel(src)) {
-							if (chan->in_channel(dest)) {
-
-								conman->add_message(dest->route, smsg.str());
-							} else {
-								send_status(src, no_such_client_in_channel);
-							}
-						}
-					} else {
-						if (!root) {
-							conman->add_message(parent, smsg.str());
-						}
-					}
-				}
-			} else if (source == parent) {
-			       	if (dest != nullptr) {
-				       	if (chan->in_channel(dest)) {
-						conman->add_message(dest->route, smsg.str());
-					}
-				}
-			}
-		}
-	}
+	shortcut_threshold = lines;
 }
 
-void server::do_status(std::istringstream &smsg, int source)
+/* name is in the comma separated list */
+static bool listed(std::string_view list, std::string_view name)
 {
-	std::string host;
-	status_code status;
-	if (smsg >> host >> status) {
-		peer *dest = peer::get_by_host(host);
-		if (dest != nullptr) {
-			conman->add_message(dest->route, smsg.str());
+	while (!list.empty()) {
+		std::string_view item = list.substr(0, list.find(','));
+		if (item == name) {
+			return true;
 		}
+		list.remove_prefix(std::min(list.size(), item.size() + 1));
 	}
+	return false;
 }
 
-void server::do_topic(std::istringstream &smsg, int source)
+void server::do_shortcut(std::istringstream &smsg, int source)
 {
-	std::string host, chan_name, topic;
-	if (smsg >> host >> chan_name && std::getline(smsg, topic, '\n')) {
-		peer *dest = peer::get_by_host(host);
-		if (dest != nullptr) {
-			conman->add_message(dest->route, smsg.str());
+	std::string name, chan, op;
+	// tree links and clients carry no shortcuts
+	if (!(smsg >> name >> chan) || source == parent || children.count(source) != 0) {
+		return;
+	}
+	auto link = shortcut_links.find(source);
+	if (link == shortcut_links.end()) {
+		if (!reg.get_peers(source).empty()) {
+			return;
+		}
+		conman->set_link(source);
+		link = shortcut_links.emplace(source, shortcut_link{name, 0}).first;
+		shortcut_socks.emplace(name, source);
+	}
+	link->second.idle = 0;
+	if (smsg >> op && op == "-") {
+		auto out = shortcut_out.find(chan);
+		if (out != shortcut_out.end()) {
+			out->second.erase(source);
+			if (out->second.empty()) {
+				shortcut_out.erase(out);
+			}
 		}
+		LOG(LOG_INFO, LOG_SERVER, "shortcut: ", name + " no longer takes " + chan);
+	} else {
+		shortcut_out[chan].insert(source);
+		LOG(LOG_INFO, LOG_SERVER, "shortcut: ", name + " takes " + chan);
 	}
 }
 
-void server::do_list(std::istringstream &smsg, int source)
+void server::send_shortcut(channel *chan, std::string_view msg, int source)
 {
-	std::string host;
-	if (smsg >> host) {
-		peer *src = peer::get_by_host(host);
-		if (src != nullptr && src->route == source) {
-			if (!root) {
-				conman->add_message(parent, smsg.str());
-			} else {
-				send_channel_list(src);
-			}
+	if (shortcut_threshold != 0) {
+		auto counted = local_traffic.find(chan->name());
+		if (counted == local_traffic.end()) {
+			local_traffic.emplace(chan->name(), 1);
+		} else {
+			counted->second++;
 		}
 	}
+	auto out = shortcut_out.find(chan->name());
+	if (out == shortcut_out.end() && hot_channels.count(chan->name()) == 0) {
+		send_to_channel(chan, msg, source); // most lines, no id needed
+		return;
+	}
+	std::string served;
+	std::vector<int> links;
+	if (out != shortcut_out.end()) {
+		for (int sock : out->second) {
+			shortcut_link &link = shortcut_links[sock];
+			served += served.empty() ? "" : ",";
+			served += link.name;
+			link.idle = 0;
+			links.push_back(sock);
+		}
+	}
+	// the id names the origin, the servers that asked for chan count by it
+	std::string tagged = add_msg_id(msg, symbol::name(name_id) + "/" + std::to_string(++shortcut_seq), served);
+	if (!links.empty()) {
+		conman->add_broadcast(links, tagged);
+		shortcut_sent += links.size();
+	}
+	send_to_channel(chan, tagged, source);
 }
 
-void server::send_channel_list(peer *dest)
+void server::receive_shortcut(channel *chan, const std::string &line, int source)
 {
-	std::ostringstream out;
-	out << "LISTRES " << dest->host;
-	for (auto c : channel::channel_list()) {
-		out << " " << c->name;
+	std::string_view id = msg_id_of(line);
+	if (id.empty()) {
+		return;
+	}
+	shortcut_links[source].idle = 0;
+	if (!first_copy(id)) {
+		shortcut_duplicates++;
+		return;
 	}
-	out << std::endl;
-	conman->add_message(dest->route, out.str());
+	shortcut_received++;
+	std::string key = chan->name() + " " + std::string(id.substr(0, id.rfind('/')));
+	auto in = shortcut_in.find(key);
+	if (in != shortcut_in.end()) {
+		in->second++;
+	}
+	// the subtree here, not the parent and no other link
+	send_to_channel(chan, without_served(line, symbol::name(name_id)), parent);
 }
 
-void server::do_channel(std::istringstream &smsg, int source)
+void server::relay_from_parent(channel *chan, const std::string &line)
 {
-	std::string host, chan_name, topic, op;
-	if (smsg >> host >> chan_name >> op && std::getline(smsg, topic, '\n'))  {
-		if (topic.size() > 0) { // leading space
-			topic = topic.substr(1, topic.size());
+	std::string_view id = msg_id_of(line);
+	if (id.empty()) {
+		send_to_channel(chan, line, parent);
+		return;
+	}
+	const std::string &me = symbol::name(name_id);
+	if (listed(served_of(line), me)) {
+		// the copy over the link may have come first
+		if (!first_copy(id)) {
+			shortcut_duplicates++;
+			return;
 		}
-		peer *dest = peer::get_by_host(host);
-		if (source == parent && dest != nullptr) {
-			channel *chan = channel::get(chan_name);
-			if (chan != nullptr) {
-				chan->set_topic(topic);
-			} else {
-				chan = new channel(topic, chan_name, op);
-			}
-			chan->join(dest);
-			conman->add_message(dest->route, smsg.str());
+		send_to_channel(chan, without_served(line, me), parent);
+		return;
+	}
+	if (shortcut_threshold != 0 && attached(chan)) {
+		auto counts = cross_traffic.find(chan->name());
+		if (counts == cross_traffic.end()) {
+			counts = cross_traffic.emplace(chan->name(), std::map<std::string, size_t, std::less<>>()).first;
+		}
+		std::string_view origin = id.substr(0, id.rfind('/'));
+		auto counted = counts->second.find(origin);
+		if (counted == counts->second.end()) {
+			counts->second.emplace(origin, 1);
+		} else {
+			counted->second++;
 		}
 	}
+	send_to_channel(chan, line, parent);
 }
 
-void server::do_listres(std::istringstream &smsg, int source)
+bool server::attached(channel *chan) const
 {
-	std::string host;
-	if (smsg >> host) {
-		peer *dest = peer::get_by_host(host);
-		if (dest != nullptr) {
-			conman->add_message(dest->route, smsg.str());
+	for (int route : chan->get_routes()) {
+		if (route != parent && children.count(route) == 0) {
+			return true;
 		}
 	}
+	return false;
 }
 
-void server::send_to_channel(channel *chan, std::string msg, int source)
+bool server::first_copy(std::string_view id)
 {
-	auto subs = chan->get_routes();
-	for (auto s : subs) {
-		if (s != source) {
-			conman->add_message(s, msg);
-		}
+	std::string key(id);
+	if (shortcut_seen.erase(key) != 0) {
+		return false; // no third copy comes
 	}
-	if (!root && source != parent) {
-		conman->add_message(parent, msg);
+	shortcut_seen.insert(key);
+	shortcut_seen_order.push_back(std::move(key));
+	if (shortcut_seen_order.size() > SHORTCUT_SEEN) {
+		shortcut_seen.erase(shortcut_seen_order.front());
+		shortcut_seen_order.pop_front();
 	}
+	return true;
 }
 
-const char* server_exception::what() const throw()
+bool server::shortcut_covers(channel *chan, int route, std::string_view served)
 {
-	return "server: failed to create a server";
+	uint64_t key = static_cast<uint64_t>(route) << 32 | chan->name_id;
+	std::vector<shortcut_prune> &known = shortcut_prunes[key];
+	for (auto &k : known) {
+		if (k.served == served && k.generation == chan->generation()) {
+			return k.covered;
+		}
+	}
+	// every member behind route is attached below a served server
+	bool covered = true;
+	for (auto p : chan->get_members()) {
+		if (p->route != route) {
+			continue;
+		}
+		bool below = false;
+		auto e = p->origin != 0 ? topology.find(symbol::name(p->origin)) : topology.end();
+		for (size_t steps = 0; e != topology.end() && steps <= topology.size() && !below; steps++) {
+			below = listed(served, e->first);
+			e = topology.find(e->second.parent);
+		}
+		if (!below) {
+			covered = false;
+			break;
+		}
+	}
+	// entries of older generations go first
+	known.erase(std::remove_if(known.begin(), known.end(), [chan](const shortcut_prune &k) {
+		return k.generation != chan->generation();
+	}), known.end());
+	if (known.size() >= SHORTCUT_PRUNE) {
+		known.clear();
+	}
+	known.push_back(shortcut_prune{std::string(served), chan->generation(), covered});
+	return covered;
 }
 
-void server::close_route(int sock)
+unsigned server::tree_distance(std::string_view name) const
 {
-	auto peers = peer::get_peers(sock);
-
-	for (auto p : peers) {
-		if (!root) {
-			conman->add_message(parent, "QUIT " + p->host);
+	// links from here up to each ancestor, then up from name to the first
+	std::map<std::string, unsigned, std::less<>> up;
+	unsigned hops = 0;
+	auto e = topology.find(symbol::name(name_id));
+	for (; e != topology.end() && hops <= topology.size(); hops++) {
+		up.emplace(e->first, hops);
+		e = topology.find(e->second.parent);
+	}
+	hops = 0;
+	e = topology.find(name);
+	for (; e != topology.end() && hops <= topology.size(); hops++) {
+		auto common = up.find(e->first);
+		if (common != up.end()) {
+			return hops + common->second;
 		}
-		delete p;
+		e = topology.find(e->second.parent);
 	}
-
-	conman->remove_socket(sock);
+	return 0;
 }
 
-void server::do_quit(std::istringstream &smsg, int source)
+bool server::request_shortcut(const std::string &chan, const std::string &origin)
 {
-	std::string host;
+	int sock;
+	auto known = shortcut_socks.find(origin);
+	if (known != shortcut_socks.end()) {
+		sock = known->second;
+	} else {
+		std::string host, port;
+		split_address(origin, host, port);
+		sock = conman->create_connection(host, port);
+		if (sock == -1) {
+			LOG(LOG_WARN, LOG_SERVER, "shortcut: ", "failed to link to " + origin);
+			return false;
+		}
+		conman->set_link(sock);
+		shortcut_links.emplace(sock, shortcut_link{origin, 0});
+		shortcut_socks.emplace(origin, sock);
+	}
+	conman->add_message(sock, "SHORTCUT " + symbol::name(name_id) + " " + chan + "\n");
+	LOG(LOG_INFO, LOG_SERVER, "shortcut: ", "asked " + origin + " for " + chan);
+	return true;
+}
 
-	if (smsg >> host) {
-		peer *src = peer::get_by_host(host);
+void server::close_shortcut(int sock)
+{
+	auto link = shortcut_links.find(sock);
+	std::string name = link->second.name;
+	auto by_name = shortcut_socks.find(name);
+	if (by_name != shortcut_socks.end() && by_name->second == sock) {
+		shortcut_socks.erase(by_name);
+	}
+	for (auto out = shortcut_out.begin(); out != shortcut_out.end(); ) {
+		out->second.erase(sock);
+		out = out->second.empty() ? shortcut_out.erase(out) : std::next(out);
+	}
+	// the lines of name come on the tree again
+	std::string suffix = " " + name;
+	for (auto in = shortcut_in.begin(); in != shortcut_in.end(); ) {
+		bool from = in->first.size() > suffix.size()
+			&& in->first.compare(in->first.size() - suffix.size(), suffix.size(), suffix) == 0;
+		in = from ? shortcut_in.erase(in) : std::next(in);
+	}
+	shortcut_links.erase(link);
+	LOG(LOG_INFO, LOG_SERVER, "shortcut: ", "closed the link to " + name);
+}
 
-		for (auto chan : channel::channel_list()) {
-			if (chan->in_channel(src)) {
-				if (chan->op == src->host) {
-					send_delete_channel(chan, src->route);
-					delete chan;
-				} else {
-					chan->leave(src);
+void server::check_shortcuts()
+{
+	const std::string &me = symbol::name(name_id);
+	// channels that cooled down go back to the tree
+	for (auto in = shortcut_in.begin(); in != shortcut_in.end(); ) {
+		size_t space = in->first.find(' ');
+		std::string chan = in->first.substr(0, space), origin = in->first.substr(space + 1);
+		auto sock = shortcut_socks.find(origin);
+		if (sock != shortcut_socks.end() && shortcut_threshold != 0 && 2 * in->second >= shortcut_threshold
+				&& reg.get_channel(symbol::find(chan)) != nullptr) {
+			in->second = 0;
+			++in;
+			continue;
+		}
+		if (sock != shortcut_socks.end()) {
+			conman->add_message(sock->second, "SHORTCUT " + me + " " + chan + " -\n");
+			LOG(LOG_INFO, LOG_SERVER, "shortcut: ", "gave up " + chan + " from " + origin);
+		}
+		in = shortcut_in.erase(in);
+	}
+	// hot channels of servers far away in the tree get a shortcut
+	if (shortcut_threshold != 0 && !root) {
+		for (auto &counts : cross_traffic) {
+			for (auto &c : counts.second) {
+				std::string key = counts.first + " " + c.first;
+				if (c.second < shortcut_threshold || shortcut_in.count(key) != 0
+						|| tree_distance(c.first) < SHORTCUT_HOPS) {
+					continue;
+				}
+				if (request_shortcut(counts.first, c.first)) {
+					shortcut_in[key] = shortcut_threshold; // the first window counts as hot
 				}
 			}
 		}
-
-		if (src != nullptr && src->route == source) {
-
-			if (!root) {
-				conman->add_message(parent, smsg.str());
-			}
-
-			delete src;
+	}
+	cross_traffic.clear();
+	hot_channels.clear();
+	for (auto &l : local_traffic) {
+		if (shortcut_threshold != 0 && l.second >= shortcut_threshold) {
+			hot_channels.insert(l.first);
 		}
 	}
+	local_traffic.clear();
+	// a link without channels closes after lines in flight have come
+	std::vector<int> idle;
+	for (auto &l : shortcut_links) {
+		bool used = false;
+		for (auto &out : shortcut_out) {
+			used = used || out.second.count(l.first) != 0;
+		}
+		std::string suffix = " " + l.second.name;
+		for (auto &in : shortcut_in) {
+			used = used || (in.first.size() > suffix.size()
+					&& in.first.compare(in.first.size() - suffix.size(), suffix.size(), suffix) == 0);
+		}
+		l.second.idle = used ? 0 : l.second.idle + 1;
+		if (l.second.idle > SHORTCUT_IDLE) {
+			idle.push_back(l.first);
+		}
+	}
+	for (int sock : idle) {
+		close_route(sock);
+	}
 }
 
+void server::shortcut_report(std::ostream &out) const
+{
+	size_t given = 0;
+	for (auto &o : shortcut_out) {
+		given += o.second.size();
+	}
+	out << "links " << shortcut_links.size() << ", channels sent " << given << " received "
+		<< shortcut_in.size() << ", lines sent " << shortcut_sent << " received " << shortcut_received
+		<< ", tree copies pruned " << shortcut_pruned << ", second copies dropped " << shortcut_duplicates;
+}
@@ -4,30 +4,343 @@
 #include "data.hpp"
 #include "helpers.hpp"
 #include <string>
+#include <string_view>
+#include <deque>
+#include <map>
 #include <queue>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define PRESENCE_WINDOW_NS 5000000 // churn collected before it goes up
+#define PRESENCE_BATCH 128 // hosts per CONNECTS or QUITS line
+#define READ_BUDGET 65536 // bytes read from one socket per turn
+#define DISPATCH_BUDGET 256 // lines handled from one socket per turn
+#define BURST_BATCH 512 // peers or members per BURST or BURSTCHAN line
+#define LIST_PAGE 256 // channels per LISTPAGE or LISTRES line
+#define TAKEOVER_GRACE_NS 5000000000 // peers of a lost root wait for their servers
+#define REPL_PENDING 4096 // REPL MARKs kept until the standby acknowledges them
+#define TOPO_INTERVAL_NS 1000000000 // LINKPING to the parent, changes of TOPO go up
+#define TOPO_REFRESH_NS 10000000000 // TOPO goes up unchanged after this long
+#define TOPO_EXPIRY_NS 30000000000 // the root forgets servers not heard of this long
+#define PLACE_FANOUT 8 // children of a server recommended as parent
+#define SHORTCUT_HOPS 3 // tree distance to an origin worth a shortcut
+#define SHORTCUT_IDLE 2 // checks without channels before a shortcut closes
+#define SHORTCUT_SEEN 4096 // message ids kept to drop the second copy
+#define SHORTCUT_PRUNE 64 // sets of servers served cached for a route and channel
+#define UPGRADE_HELLO "IBRCD UPGRADE\n" // a new process says this before it gets the sockets
+#define UPGRADE_HELLO_S 2 // seconds to wait for it
 
 int main(int argc, char* argv[]);
 
+/* time spent on the lines of one command */
+struct handler_stats
+{
+	/* request id and command */
+	histogram parse;
+
+	/* the do_ handler, with what it queues */
+	histogram handle;
+};
+
+/* a CONNECT or QUIT held back for the parent */
+struct presence_change
+{
+	bool connect;
+
+	/* server the client is attached to, empty for QUIT */
+	std::string origin;
+
+	/* "<id>:<host>" for CONNECT, "<host>" for QUIT */
+	std::string entry;
+};
+
+/* a server of the tree as its TOPO announced it */
+struct topology_entry
+{
+	/* name of its parent, "-" for the root */
+	std::string parent;
+
+	unsigned depth;
+
+	size_t children;
+
+	/* round trip to the root along the tree */
+	uint64_t rtt_us;
+
+	/* root only: when the last TOPO came */
+	uint64_t seen;
+};
+
+/* a direct link to a server outside the tree, it carries MSG lines only */
+struct shortcut_link
+{
+	std::string name;
+
+	/* checks in a row with no channel in either direction */
+	unsigned idle;
+};
+
+/* whether the members of a channel behind a route all got a line over
+ * shortcuts, for the servers served and the generation of the channel */
+struct shortcut_prune
+{
+	std::string served;
+
+	uint64_t generation;
+
+	bool covered;
+};
+
 class server
 {
 	private:
 		/* is root */
 		bool root;
 
-		/* socket accepts clients */
-		int accepting;
+		/* sockets that accept clients, more than one share the port
+		 * with SO_REUSEPORT */
+		std::vector<int> acceptors;
 
 		/* default route, to parent server */
 		int parent;
 
-		connection_manager *conman;
+		transport *conman;
+
+		/* peers and channels known to this server */
+		registry reg;
+
+		/* "@<id> " of the request being handled, replies start with it.
+		 * Replies to servers keep the trace id, clients get the id they
+		 * sent and nothing if they sent none */
+		std::string request_tag;
+
+		std::string client_tag;
+
+		/* sockets of child servers, they get lines with their tags */
+		std::set<int> children;
+
+		/* nullptr unless tracing */
+		tracer *trace;
+
+		/* when the lines being handled were read, for tracing */
+		uint64_t received_at;
+
+		/* host:port other servers know this one by, origin of its clients */
+		symbol_id name_id;
+
+		/* CONNECTs and QUITs not yet sent to the parent, in the order they
+		 * happened */
+		std::vector<presence_change> presence;
+
+		/* when the oldest entry in presence has waited long enough */
+		uint64_t presence_due;
+
+		uint64_t presence_window;
+
+		/* sockets with work left after their turn, in the order they get
+		 * the next one */
+		std::deque<int> carried;
+
+		/* carried sockets, true while bytes may be left unread */
+		std::unordered_map<int, bool> carried_unread;
+
+		/* socket whose turn it is, -1 once it was closed meanwhile */
+		int serving;
+
+		/* MSG and PRIVMSG per second and burst allowed for each client of
+		 * this server, no limit for 0 */
+		double msg_rate;
+
+		double msg_burst;
+
+		/* by client socket */
+		std::unordered_map<int, token_bucket> buckets;
+
+		/* when connect_parent sent the burst, 0 once the parent ended its
+		 * answer */
+		uint64_t link_started;
+
+		/* all channels of the network, from CHANINFO of the parent or the
+		 * registry of the root */
+		channel_directory directory;
+
+		/* directory entries from before the link the parent has not
+		 * announced again yet, dropped at its BURSTEND */
+		std::set<std::string, std::less<>> stale_channels;
+
+		/* when the root announces the channels changed since, 0 if none */
+		uint64_t channels_due;
+
+		/* unix socket a new process connects to for the upgrade, -1 if none */
+		int upgrade_sock;
+
+		/* a new process is waiting on upgrade_sock */
+		bool upgrade_requested;
+
+		/* the sockets went to a new process, run returns */
+		bool handed_off;
+
+		/* line being handled by serve, kept so its buffer is reused */
+		std::string line_buffer;
+
+		/* routes of a channel line in send_to_channel, reused likewise */
+		std::vector<int> server_routes;
+
+		std::vector<int> client_routes;
+
+		/* by msg_type, nullptr until a line of the type came */
+		std::vector<handler_stats*> handlers;
+
+		/* root only: socket of the standby root that gets the journal of
+		 * the registry, -1 if none */
+		int standby;
+
+		/* this server is the standby of its parent and mirrors its
+		 * registry, it takes over when the parent is lost */
+		bool following;
+
+		/* parent to link to when the parent is lost, empty for none */
+		std::string fallback_host;
+
+		std::string fallback_port;
+
+		/* number of the last REPL MARK sent or, on a standby, applied */
+		uint64_t repl_seq;
+
+		/* MARKs sent to the standby and when, until it acknowledges them */
+		std::deque<std::pair<uint64_t, uint64_t>> repl_pending;
+
+		/* from a REPL MARK to its REPLACK, in ns */
+		histogram repl_lag;
+
+		/* when this server took over as root, 0 once the peers of the old
+		 * root were adopted or dropped */
+		uint64_t takeover_started;
+
+		uint64_t takeover_grace;
+
+		/* peers of the old root and those adopted by a BURST so far */
+		size_t takeover_orphans;
+
+		size_t takeover_adopted;
+
+		/* how long the last takeover took, 0 if none */
+		uint64_t takeover_took;
+
+		/* links to the root, 0 on the root. From LINKPONG of the parent */
+		unsigned depth;
+
+		std::string parent_name;
+
+		/* round trip to the parent, smoothed, and to the root */
+		uint64_t link_rtt_us;
+
+		uint64_t root_rtt_us;
+
+		/* every server of the tree by name, from TOPO of the root */
+		std::map<std::string, topology_entry, std::less<>> topology;
+
+		/* names of the child servers by socket, from SERVER or STANDBY */
+		std::unordered_map<int, std::string> child_names;
+
+		/* next LINKPING and check of the TOPO of this server */
+		uint64_t topo_due;
+
+		/* the TOPO of this server last sent, without rtt, and when */
+		std::string topo_sent;
+
+		uint64_t topo_sent_rtt;
+
+		uint64_t topo_sent_at;
+
+		/* children a server may have to be recommended by PLACE */
+		size_t place_fanout;
+
+		/* socket to the server asked for a parent, -1 if none */
+		int placing;
+
+		std::string placing_host;
+
+		std::string placing_port;
+
+		/* MSG lines from one origin in a check window that make a channel
+		 * worth a shortcut, 0 for no shortcuts */
+		size_t shortcut_threshold;
+
+		/* of the message ids this server gives */
+		uint64_t shortcut_seq;
+
+		std::unordered_map<int, shortcut_link> shortcut_links;
+
+		/* link by server name */
+		std::unordered_map<std::string, int> shortcut_socks;
+
+		/* MSG lines from clients here in this window by channel */
+		std::map<std::string, size_t, std::less<>> local_traffic;
+
+		/* channels over the threshold in the last window, their lines get
+		 * a message id so servers far away can count them by origin */
+		std::set<std::string, std::less<>> hot_channels;
+
+		/* channels whose MSG lines from clients here also go to links */
+		std::map<std::string, std::set<int>, std::less<>> shortcut_out;
+
+		/* "<channel> <origin>" asked for over a link and its lines in this
+		 * window */
+		std::map<std::string, size_t, std::less<>> shortcut_in;
+
+		/* MSG lines from the parent in this window by channel and origin,
+		 * for channels with members attached here */
+		std::map<std::string, std::map<std::string, size_t, std::less<>>, std::less<>> cross_traffic;
 
-		void process_message(std::string message, int source);
+		/* ids of lines that came over a link or named this server as
+		 * served, oldest first */
+		std::unordered_set<std::string> shortcut_seen;
 
-		bool test_nick(std::string nick);
+		std::deque<std::string> shortcut_seen_order;
 
-		void send_nick_res(peer *dest, std::string &nick);
+		/* by route in the high and channel in the low half, one for each
+		 * set of servers served */
+		std::unordered_map<uint64_t, std::vector<shortcut_prune>> shortcut_prunes;
+
+		/* lines sent and received over links, tree copies not sent to a
+		 * route and second copies dropped */
+		uint64_t shortcut_sent;
+
+		uint64_t shortcut_received;
+
+		uint64_t shortcut_pruned;
+
+		uint64_t shortcut_duplicates;
+
+		/* passes all sockets with their buffers, peers, channels and
+		 * the directory to a new process connected to upgrade_sock. If it
+		 * is no ibrcd or does not take them, the server goes on serving */
+		void hand_off();
+
+		/* the state written by hand_off, one item per line */
+		std::string save_state(const std::vector<socket_state> &sockets);
+
+		/* rebuilds the state of the old process, fds in the order of the
+		 * sockets in the state */
+		bool load_state(const std::string &state, const std::vector<int> &fds);
+
+		/* one turn of sock: a budgeted read and at most DISPATCH_BUDGET
+		 * lines, sock is carried over if work is left. false if sock was
+		 * closed */
+		bool serve(int sock, bool unread);
+
+		/* takes a token for a MSG or PRIVMSG of src, answers rate_limited
+		 * if there is none */
+		bool within_rate(const peer *src, int source);
+
+		void process_message(const std::string &line, int source);
+
+		static bool test_nick(std::string_view nick);
+
+		void send_nick_res(peer *dest, std::string_view nick);
 
 
 		void send_topic(channel *chan, peer *dest);
@@ -46,48 +359,288 @@ class server
 
 		void do_gettopic(std::istringstream &smsg, int source);
 
-		void do_settopic(std::istringstream &smsg, int source);
+		void do_settopic(line_reader &in, const std::string &line, int source);
 
-		void do_msg(std::istringstream &smsge, int source);
+		void do_msg(line_reader &in, const std::string &line, int source);
 
-		void do_privmsg(std::istringstream &smsg, int source);
+		void do_privmsg(line_reader &in, const std::string &line, int source);
 
-		void do_status(std::istringstream &smsg, int source);
+		void do_status(line_reader &in, const std::string &line, int source);
 
-		void do_topic(std::istringstream &smsg, int source);
+		void do_topic(line_reader &in, const std::string &line, int source);
 
 		void do_nickres(std::istringstream &smsg, int source);
 
-		void do_listres(std::istringstream &smsg, int source);
+		void do_listres(line_reader &in, const std::string &line, int source);
 
-		void do_channel(std::istringstream &smsg, int source);
+		void do_channel(line_reader &in, const std::string &line, int source);
 
 		void do_quit(std::istringstream &smsg, int source);
 
 		void do_delchannel(std::istringstream &smsg, int source);
 
+		void do_server(std::istringstream &smsg, int source);
+
+		void do_connects(std::istringstream &smsg, int source);
+
+		void do_quits(std::istringstream &smsg, int source);
+
+		void do_netsplit(std::istringstream &smsg, int source);
+
+		void do_burst(std::istringstream &smsg, int source);
+
+		void do_burstchan(std::istringstream &smsg, int source);
+
+		void do_burstend(std::istringstream &smsg, int source);
+
+		void do_chaninfo(line_reader &in, const std::string &line, int source);
+
+		void do_standby(std::istringstream &smsg, int source);
+
+		void do_repl(line_reader &in, const std::string &line, int source);
+
+		void do_replack(std::istringstream &smsg, int source);
+
+		/* sends the journal of the registry to the standby, closed by a
+		 * REPL MARK it acknowledges */
+		void flush_journal();
+
+		/* the parent closed: a standby takes over, a server with a
+		 * fallback links there, any other becomes a root */
+		void lose_parent();
+
+		void do_linkping(std::istringstream &smsg, int source);
+
+		void do_linkpong(std::istringstream &smsg, int source);
+
+		void do_topo(line_reader &in, const std::string &line, int source);
+
+		void do_place(std::istringstream &smsg, int source);
+
+		void do_placeres(std::istringstream &smsg, int source);
+
+		void do_moved(std::istringstream &smsg, int source);
+
+		void do_shortcut(std::istringstream &smsg, int source);
+
+		/* a MSG from a client here: if chan is hot, gives it an id and
+		 * sends it to the links that asked for chan, then on the tree
+		 * without the routes they serve */
+		void send_shortcut(channel *chan, std::string_view msg, int source);
+
+		/* a MSG over a link goes to the subtree here, never further */
+		void receive_shortcut(channel *chan, const std::string &line, int source);
+
+		/* a MSG from the parent, counted for its origin. Dropped if it
+		 * names this server as served and the link brought it first */
+		void relay_from_parent(channel *chan, const std::string &line);
+
+		/* members of chan are attached here, not only relayed through */
+		bool attached(channel *chan) const;
+
+		/* true the first time of id */
+		bool first_copy(std::string_view id);
+
+		/* the members of chan behind route are all below the servers in
+		 * served */
+		bool shortcut_covers(channel *chan, int route, std::string_view served);
+
+		/* links in the tree between this server and name, 0 if unknown */
+		unsigned tree_distance(std::string_view name) const;
+
+		/* sends SHORTCUT for chan to origin, linking to it if needed */
+		bool request_shortcut(const std::string &chan, const std::string &origin);
+
+		void close_shortcut(int sock);
+
+		/* sends the TOPO of this server up if it changed or is due, the
+		 * root takes it into its table */
+		void announce_topology(bool force);
+
+		/* takes a TOPO line into the table, true if it changed it. Removing
+		 * a server removes the servers below it too */
+		bool apply_topology(std::string_view line);
+
+		/* the table as TOPO to a linking child */
+		void send_topology(int sock);
+
+		/* the shallowest server with room for a child, by rtt to the root
+		 * and children. Not name or a server below it, empty if none */
+		std::string best_parent(std::string_view name) const;
+
+		/* tells the child servers depth and rtt of this one */
+		void push_depth();
+
+		/* root only: updates the directory with the changed channels and
+		 * sends CHANINFO for each to the children */
+		void publish_channels();
+
+		/* the whole directory as CHANINFO to a linking child */
+		void send_directory(int sock);
+
+		/* sends the peers and channels of this subtree to the parent */
+		void send_burst();
+
+		/* takes op and topic of chan from the parent, a new op means a new
+		 * channel object. Local members hear of changes by CHANNEL */
+		channel *adopt_channel(channel *chan, const std::string &op, const std::string &topic);
+
+		/* adds a peer behind source and announces it, as on CONNECT */
+		void add_peer(std::string_view host, uint64_t id, int source, symbol_id origin);
+
+		/* removes a peer and the channels it runs, as on QUIT */
+		void drop_peer(peer *src);
+
+		/* holds a CONNECT or QUIT back for the next batch to the parent */
+		void queue_presence(bool connect, const std::string &origin, std::string entry);
+
+		/* sends the held back CONNECTs and QUITs as CONNECTS and QUITS */
+		void flush_presence();
+
+		/* sends msg to the parent after the presence it may depend on */
+		void send_parent(std::string_view msg);
+
+		/* sets request_tag and client_tag from the tag of a request */
+		void set_request_tag(std::string_view tag);
+
+		/* the tag replies to the request start with on route */
+		const std::string &reply_tag(int route) const;
+
+		/* passes a reply from the parent on to route */
+		void relay_reply(int route, const std::string &line);
+
 		void send_status(const peer *dest, status_code code);
 
 		void send_channel(const peer *scr, const channel *chan);
 
-		void send_to_channel(channel *chan, std::string msg, int source);
+		void send_to_channel(channel *chan, std::string_view msg, int source);
+
+		/* msg without its request id, a view into msg */
+		static std::string_view untagged(std::string_view msg);
+
+		/* sends msg to route, without request id unless route is a server */
+		void forward(int route, std::string_view msg);
 
-		void send_channel_list(peer *dest);
+		/* matching channels from the directory in pages of LIST_PAGE, the
+		 * last page is LISTRES */
+		void send_channel_list(peer *dest, std::string_view prefix, size_t min_members);
 
 		void send_delete_channel(channel *chan, int source);
 
 		void close_route(int sock);
 
 	public:
-		/* creates a new server */
-		server(std::string port);
+		/* creates a new server listening with n_acceptors sockets, with
+		 * n_writers threads sending its lines. The sockets share the port
+		 * with SO_REUSEPORT, so a burst of connects fills several listen
+		 * queues instead of overflowing one, but they are accepted on the
+		 * thread of the server like all other events */
+		server(std::string port, int backlog = DEFAULT_BACKLOG, unsigned n_acceptors = 1,
+				unsigned n_writers = 0);
+
+		/* takes over the sockets and state of a running server connected
+		 * by handoff, see listen_for_upgrade */
+		server(int handoff, unsigned n_writers);
+
+		/* creates a new server on top of net, takes ownership of net */
+		server(transport *net, std::string port, unsigned n_acceptors = 1);
 
 		/* close the server */
 		~server();
 
 		bool run();
 
+		/* handles the events that arrive within timeout ms */
+		bool run_once(int timeout);
+
+		/* links to a parent and sends it the state of this subtree */
 		bool connect_parent(std::string host, std::string port);
+
+		/* drops the link to the parent as if it had closed, this server
+		 * becomes a root */
+		void disconnect_parent();
+
+		/* links to the root as its standby, the root sends its registry
+		 * and every change after */
+		bool connect_standby(std::string host, std::string port);
+
+		/* parent to link to if the parent is lost, the standby root */
+		void set_fallback(std::string host, std::string port);
+
+		/* how long a standby that took over keeps the peers of the old
+		 * root for their servers to link */
+		void set_takeover_grace(uint64_t ns);
+
+		/* drops the peers of the old root no server linked again for */
+		void end_takeover();
+
+		/* asks the server at host for the best parent, PLACERES, and
+		 * links there. Links to host if the answer cannot be used */
+		bool connect_placed(std::string host, std::string port);
+
+		/* moves this server and its subtree under the best parent if
+		 * that is nearer to the root, false if it stays */
+		bool rebalance();
+
+		/* children a server may have to be recommended as parent */
+		void set_placement_fanout(size_t n);
+
+		/* MSG lines of one origin and channel from the parent in a check
+		 * window that make this server ask the origin for a shortcut, 0
+		 * turns it off */
+		void set_shortcut_threshold(size_t lines);
+
+		/* asks for shortcuts of the channels over the threshold, gives up
+		 * those below half of it and closes idle links. run_once calls it
+		 * every TOPO_INTERVAL_NS */
+		void check_shortcuts();
+
+		/* links with their channels, lines over links, tree copies pruned
+		 * and second copies dropped. ibrcd logs it on SIGUSR1 */
+		void shortcut_report(std::ostream &out) const;
+
+		/* servers, their mean and max depth, rtt to the root and the mean
+		 * distance of the clients known here. ibrcd logs it on SIGUSR1 */
+		void topology_report(std::ostream &out) const;
+
+		/* the parent has answered the burst sent by connect_parent */
+		bool linked() const;
+
+		/* links to the root, from the last LINKPONG */
+		unsigned tree_depth() const;
+
+		/* writes spans of one in sample MSG, PRIVMSG and JOIN lines from
+		 * clients to file */
+		bool enable_tracing(std::string file, std::string name, unsigned sample);
+
+		/* writes rss and the memory held for connections, peers and
+		 * channels, ibrcd logs it on SIGUSR1 */
+		void memory_report(std::ostream &out) const;
+
+		/* parse and handle time of each command seen, in us. ibrcd logs
+		 * it on SIGUSR1 */
+		void handler_report(std::ostream &out) const;
+
+		/* the standby and its lag in us, or the mark a standby applied,
+		 * and the last takeover. ibrcd logs it on SIGUSR1 */
+		void replication_report(std::ostream &out) const;
+
+		/* name sent with SERVER, must be unique in the tree */
+		void set_name(std::string_view name);
+
+		/* how long CONNECTs and QUITs are collected before they go to the
+		 * parent, 0 sends them at the end of each round of events */
+		void set_presence_window(uint64_t ns);
+
+		/* limits MSG and PRIVMSG of each client, 0 turns it off */
+		void set_rate_limit(double per_second, double burst);
+
+		/* sockets are carried over, run_once has work without events */
+		bool busy() const;
+
+		/* a new process that connects to path gets all sockets and the
+		 * state of this server, run returns after that */
+		bool listen_for_upgrade(const std::string &path);
 };
 
 class server_exception : public std::exception
@@ -0,0 +1,477 @@
+#include "server.hpp"
+#include "loopback.hpp"
+#include "log.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* runs a whole ibrc tree in one process over a loopback_hub. Every line takes
+ * one step per link, so a run is deterministic for a given seed. */
+
+#define USAGE "usage: ibrcsim [-n servers] [-f fan-out] [-c clients] [-C channels] [-m messages] [-s seed] [-L relinked server] [-R] [-t fanout|random|placed] [-B] [-X shortcut threshold] [-K hot clients] [-v]"
+
+struct vclient
+{
+	int ep;
+
+	std::string host;
+
+	std::string nick;
+
+	std::string chan;
+};
+
+struct simulation
+{
+	loopback_hub hub;
+
+	std::vector<loopback_transport*> nets;
+
+	std::vector<server*> servers;
+
+	/* failed servers, they do not run */
+	std::vector<bool> down;
+
+	std::vector<vclient> clients;
+
+	/* time spent inside the servers */
+	std::chrono::duration<double> server_time;
+
+	/* MSG lines received by clients and their delay in steps */
+	uint64_t msgs_received;
+
+	uint64_t msg_steps;
+
+	uint64_t msg_steps_max;
+
+	simulation() : server_time(0), msgs_received(0), msg_steps(0), msg_steps_max(0) {}
+
+	~simulation()
+	{
+		for (auto s : servers) {
+			delete s;
+		}
+	}
+
+	/* takes the lines that reached the clients */
+	void drain_clients()
+	{
+		std::string line;
+		for (int ep : hub.take_client_ready()) {
+			while (hub.client_receive(ep, line)) {
+				size_t stamp = line.rfind(" t=");
+				if (line.compare(0, 4, "MSG ") == 0 && stamp != std::string::npos) {
+					uint64_t sent = std::stoull(line.substr(stamp + 3));
+					uint64_t steps = hub.step() - sent;
+					msgs_received++;
+					msg_steps += steps;
+					if (steps > msg_steps_max) {
+						msg_steps_max = steps;
+					}
+				}
+			}
+		}
+	}
+
+	/* runs the servers until no line is in flight, returns the steps taken */
+	uint64_t settle()
+	{
+		uint64_t start = hub.step();
+		bool busy = true;
+		while (busy) {
+			busy = hub.advance();
+			auto begin = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < servers.size(); i++) {
+				if (down[i]) {
+					continue;
+				}
+				if (nets[i]->pending() || servers[i]->busy()) {
+					servers[i]->run_once(0);
+					busy = true;
+				}
+			}
+			server_time += std::chrono::steady_clock::now() - begin;
+			drain_clients();
+			logger::flush();
+		}
+		return hub.step() - start;
+	}
+
+	/* the depth every running server reached, not what the root was told */
+	void depth_report(std::ostream &out) const
+	{
+		unsigned max_depth = 0;
+		uint64_t depth_sum = 0;
+		size_t n = 0;
+		for (size_t i = 0; i < servers.size(); i++) {
+			if (down[i]) {
+				continue;
+			}
+			depth_sum += servers[i]->tree_depth();
+			max_depth = std::max(max_depth, servers[i]->tree_depth());
+			n++;
+		}
+		out << "server depth mean " << (n ? static_cast<double>(depth_sum) / static_cast<double>(n) : 0)
+			<< " max " << max_depth << "; root: ";
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	size_t n_servers = 1000;
+	size_t fanout = 8;
+	size_t n_clients = 100000;
+	size_t n_channels = 1000;
+	size_t n_messages = 20000;
+	unsigned seed = 1;
+	size_t relinked = 0;
+	bool root_fails = false;
+	std::string tree = "fanout";
+	bool rebalanced = false;
+	size_t shortcut_threshold = 0;
+	size_t hot = 0;
+	bool verbose = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:f:c:C:m:s:L:Rt:BX:K:v")) != -1) {
+		switch (opt) {
+			case 'n':
+				n_servers = std::stoul(optarg);
+				break;
+			case 'f':
+				fanout = std::stoul(optarg);
+				break;
+			case 'c':
+				n_clients = std::stoul(optarg);
+				break;
+			case 'C':
+				n_channels = std::stoul(optarg);
+				break;
+			case 'm':
+				n_messages = std::stoul(optarg);
+				break;
+			case 's':
+				seed = static_cast<unsigned>(std::stoul(optarg));
+				break;
+			case 'L':
+				relinked = std::stoul(optarg);
+				break;
+			case 'R':
+				root_fails = true;
+				break;
+			case 't':
+				tree = optarg;
+				break;
+			case 'B':
+				rebalanced = true;
+				break;
+			case 'X':
+				shortcut_threshold = std::stoul(optarg);
+				break;
+			case 'K':
+				hot = std::stoul(optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				std::cerr << USAGE << std::endl;
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (n_servers == 0 || fanout == 0 || n_channels == 0 || relinked >= n_servers
+			|| (root_fails && n_servers < 2)
+			|| (tree != "fanout" && tree != "random" && tree != "placed")
+			|| (tree != "fanout" && (root_fails || relinked > 0))
+			|| (hot > 0 && (tree == "placed" || root_fails || rebalanced || n_servers < 2))) {
+		std::cerr << USAGE << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// the servers log every line at trace level
+	logger::set_level(verbose ? LOG_TRACE : LOG_WARN);
+
+	std::mt19937 rng(seed);
+	simulation sim;
+	std::vector<size_t> parent_of(n_servers, 0);
+
+	for (size_t i = 0; i < n_servers; i++) {
+		auto net = new loopback_transport(sim.hub, "s" + std::to_string(i));
+		sim.nets.push_back(net);
+		sim.servers.push_back(new server(net, DEFAULT_PORT));
+		sim.servers[i]->set_name("s" + std::to_string(i));
+		sim.servers[i]->set_presence_window(0); // a step has no duration
+		sim.servers[i]->set_placement_fanout(fanout);
+		sim.servers[i]->set_shortcut_threshold(shortcut_threshold);
+		sim.down.push_back(false);
+		if (root_fails && i == 1) { // s1 mirrors the root, the others fall back to it
+			sim.servers[i]->connect_standby("s0", DEFAULT_PORT);
+		} else if (i > 0 && tree == "random") {
+			parent_of[i] = rng() % i;
+			sim.servers[i]->connect_parent("s" + std::to_string(parent_of[i]), DEFAULT_PORT);
+		} else if (i > 0 && tree == "placed") {
+			// any server already in the tree is the seed
+			sim.servers[i]->connect_placed("s" + std::to_string(rng() % i), DEFAULT_PORT);
+			sim.settle();
+		} else if (i > 0) {
+			if (root_fails) {
+				sim.servers[i]->set_fallback("s1", DEFAULT_PORT);
+			}
+			parent_of[i] = (i - 1) / fanout;
+			sim.servers[i]->connect_parent("s" + std::to_string((i - 1) / fanout), DEFAULT_PORT);
+		}
+	}
+	sim.settle();
+
+	// clients attach anywhere in the tree, like tests.sh does
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < n_clients; i++) {
+		vclient c;
+		// the root that fails has no clients, they would take their channels along
+		size_t home = root_fails ? 1 + rng() % (n_servers - 1) : rng() % n_servers;
+		c.ep = sim.hub.connect_client("s" + std::to_string(home), DEFAULT_PORT);
+		c.host = "c" + std::to_string(i);
+		c.nick = "n" + std::to_string(i);
+		c.chan = "ch" + std::to_string(i % n_channels);
+		sim.hub.client_send(c.ep, "CONNECT " + c.host + "\n");
+		sim.hub.client_send(c.ep, "NICK " + c.host + " " + c.nick + "\n");
+		sim.clients.push_back(c);
+	}
+	uint64_t setup_steps = sim.settle();
+
+	// JOIN needs the nick to be known along the path
+	for (auto &c : sim.clients) {
+		sim.hub.client_send(c.ep, "JOIN " + c.host + " " + c.chan + "\n");
+	}
+	setup_steps += sim.settle();
+	std::chrono::duration<double> setup_time = std::chrono::steady_clock::now() - start;
+	std::ostringstream topology;
+	sim.depth_report(topology);
+	sim.servers[0]->topology_report(topology);
+
+	// every server in turn moves under the shallowest parent with room
+	uint64_t rebalance_steps = 0, rebalance_lines = 0;
+	size_t moved = 0;
+	std::ostringstream rebalanced_topology;
+	if (rebalanced) {
+		uint64_t lines_before = sim.hub.server_lines;
+		for (size_t i = 1; i < n_servers; i++) {
+			moved += sim.servers[i]->rebalance();
+			rebalance_steps += sim.settle();
+		}
+		rebalance_lines = sim.hub.server_lines - lines_before;
+		sim.depth_report(rebalanced_topology);
+		sim.servers[0]->topology_report(rebalanced_topology);
+	}
+
+	// the subtree of one server loses its parent and links again
+	uint64_t relink_steps = 0, relink_lines = 0;
+	std::chrono::duration<double> relink_time(0);
+	if (relinked > 0) {
+		sim.servers[relinked]->disconnect_parent();
+		sim.settle();
+		uint64_t lines_before = sim.hub.server_lines;
+		auto relink_start = std::chrono::steady_clock::now();
+		sim.servers[relinked]->connect_parent("s" + std::to_string((relinked - 1) / fanout), DEFAULT_PORT);
+		relink_steps = sim.settle();
+		relink_time = std::chrono::steady_clock::now() - relink_start;
+		relink_lines = sim.hub.server_lines - lines_before;
+		if (!sim.servers[relinked]->linked()) {
+			std::cerr << "ibrcsim: s" << relinked << " did not link" << std::endl;
+		}
+	}
+
+	// the root dies with its clients, the standby takes over
+	size_t root = 0;
+	uint64_t takeover_steps = 0, takeover_lines = 0;
+	std::chrono::duration<double> takeover_time(0);
+	std::ostringstream replication;
+	if (root_fails) {
+		sim.servers[0]->replication_report(replication);
+		sim.down[0] = true;
+		sim.hub.fail(sim.nets[0]);
+		root = 1;
+		uint64_t lines_before = sim.hub.server_lines;
+		auto takeover_start = std::chrono::steady_clock::now();
+		takeover_steps = sim.settle();
+		// every server has linked again, the rest of the old root's peers go
+		sim.servers[root]->end_takeover();
+		takeover_steps += sim.settle();
+		takeover_time = std::chrono::steady_clock::now() - takeover_start;
+		takeover_lines = sim.hub.server_lines - lines_before;
+		replication << "; ";
+		sim.servers[root]->replication_report(replication);
+	}
+
+	// channel traffic from random clients
+	uint64_t sent_before = sim.hub.client_lines_sent;
+	uint64_t server_before = sim.hub.server_lines;
+	uint64_t delivered_before = sim.hub.client_lines_received;
+	uint64_t root_before = sim.nets[root]->received;
+	uint64_t total_in_before = 0;
+	for (auto net : sim.nets) {
+		total_in_before += net->received;
+	}
+	sim.server_time = std::chrono::duration<double>(0);
+
+	for (size_t i = 0; i < n_messages && !sim.clients.empty(); i++) {
+		vclient &c = sim.clients[rng() % sim.clients.size()];
+		std::ostringstream msg;
+		msg << "MSG " << c.host << " " << c.nick << " " << c.chan
+			<< " hello t=" << sim.hub.step() << "\n";
+		sim.hub.client_send(c.ep, msg.str());
+		if (i % 64 == 63) {
+			sim.settle();
+		}
+	}
+	sim.settle();
+
+	uint64_t sent = sim.hub.client_lines_sent - sent_before;
+	uint64_t relayed = sim.hub.server_lines - server_before;
+	uint64_t delivered = sim.hub.client_lines_received - delivered_before;
+	uint64_t root_in = sim.nets[root]->received - root_before;
+	uint64_t total_in = 0;
+	for (auto net : sim.nets) {
+		total_in += net->received;
+	}
+	total_in -= total_in_before;
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "servers " << n_servers << " fan-out " << fanout
+		<< " clients " << n_clients << " channels " << n_channels << std::endl;
+	std::cout << "setup: " << setup_steps << " steps, " << setup_time.count() << " s" << std::endl;
+	std::cout << "topology (" << tree << "): " << topology.str() << std::endl;
+	if (rebalanced) {
+		std::cout << "rebalance: " << moved << " servers moved, " << rebalance_steps << " steps, "
+			<< rebalance_lines << " lines between servers" << std::endl;
+		std::cout << "topology after rebalance: " << rebalanced_topology.str() << std::endl;
+	}
+	if (relinked > 0) {
+		std::cout << "relink of s" << relinked << ": " << relink_steps << " steps, "
+			<< relink_lines << " lines between servers, " << relink_time.count() << " s" << std::endl;
+	}
+	if (root_fails) {
+		std::cout << "takeover by s1: " << takeover_steps << " steps, " << takeover_lines
+			<< " lines between servers, " << takeover_time.count() << " s" << std::endl;
+		std::cout << "replication: " << replication.str() << std::endl;
+	}
+	std::cout << "messages sent by clients: " << sent << std::endl;
+	std::cout << "lines between servers: " << relayed
+		<< " (" << (sent ? static_cast<double>(relayed) / static_cast<double>(sent) : 0) << " per message)" << std::endl;
+	std::cout << "lines delivered to clients: " << delivered << std::endl;
+	std::cout << "amplification: "
+		<< (sent ? static_cast<double>(relayed + delivered) / static_cast<double>(sent) : 0)
+		<< " lines per message" << std::endl;
+	std::cout << "MSG latency: mean "
+		<< (sim.msgs_received ? static_cast<double>(sim.msg_steps) / static_cast<double>(sim.msgs_received) : 0)
+		<< " hops, max " << sim.msg_steps_max << " hops" << std::endl;
+	std::cout << "per hop: "
+		<< (total_in ? sim.server_time.count() * 1e6 / static_cast<double>(total_in) : 0)
+		<< " us server time per line received" << std::endl;
+	std::cout << "root load: " << root_in << " lines received, "
+		<< (total_in ? 100.0 * static_cast<double>(root_in) / static_cast<double>(total_in) : 0)
+		<< "% of all server input" << std::endl;
+	std::cout << "root handlers: ";
+	sim.servers[root]->handler_report(std::cout);
+	std::cout << std::endl;
+
+	// a hot channel between the two leaves farthest apart
+	if (hot > 0) {
+		auto ancestors = [&parent_of](size_t i) {
+			std::vector<size_t> up = { i };
+			while (i != 0) {
+				i = parent_of[i];
+				up.push_back(i);
+			}
+			return up;
+		};
+		auto distance = [&ancestors](size_t i, size_t j) {
+			auto a = ancestors(i), b = ancestors(j);
+			size_t common = 0;
+			while (common < a.size() && common < b.size()
+					&& a[a.size() - 1 - common] == b[b.size() - 1 - common]) {
+				common++;
+			}
+			return a.size() + b.size() - 2 * common;
+		};
+		size_t a = 0, b = 0;
+		for (size_t i = 0; i < n_servers; i++) {
+			if (ancestors(i).size() >= ancestors(a).size()) {
+				a = i;
+			}
+		}
+		for (size_t j = 0; j < n_servers; j++) {
+			if (distance(a, j) > distance(a, b)) {
+				b = j;
+			}
+		}
+		std::vector<vclient> hot_clients;
+		for (size_t i = 0; i < 2 * hot; i++) {
+			vclient c;
+			c.ep = sim.hub.connect_client("s" + std::to_string(i % 2 == 0 ? a : b), DEFAULT_PORT);
+			c.host = "h" + std::to_string(i);
+			c.nick = "hn" + std::to_string(i);
+			c.chan = "hot";
+			sim.hub.client_send(c.ep, "CONNECT " + c.host + "\n");
+			sim.hub.client_send(c.ep, "NICK " + c.host + " " + c.nick + "\n");
+			hot_clients.push_back(c);
+		}
+		sim.settle();
+		for (auto &c : hot_clients) {
+			sim.hub.client_send(c.ep, "JOIN " + c.host + " " + c.chan + "\n");
+		}
+		sim.settle();
+
+		// a window for the leaves to find the channel hot, one for the
+		// other leaf to count it by origin
+		auto send_hot = [&](size_t count) {
+			for (size_t i = 0; i < count; i++) {
+				vclient &c = hot_clients[i % 2 + 2 * (rng() % hot)];
+				sim.hub.client_send(c.ep, "MSG " + c.host + " " + c.nick + " " + c.chan
+					+ " hot t=" + std::to_string(sim.hub.step()) + "\n");
+				if (i % 64 == 63) {
+					sim.settle();
+				}
+			}
+			sim.settle();
+		};
+		for (int window = 0; window < 2; window++) {
+			send_hot(2 * shortcut_threshold + 2);
+			for (auto s : sim.servers) {
+				s->check_shortcuts();
+			}
+			sim.settle();
+		}
+
+		sim.msgs_received = 0;
+		sim.msg_steps = 0;
+		sim.msg_steps_max = 0;
+		sim.server_time = std::chrono::duration<double>(0);
+		uint64_t hot_server_before = sim.hub.server_lines;
+		send_hot(n_messages);
+		uint64_t hot_relayed = sim.hub.server_lines - hot_server_before;
+		double n = static_cast<double>(n_messages ? n_messages : 1);
+
+		std::cout << "hot channel: " << hot << " clients each on s" << a << " and s" << b << ", "
+			<< distance(a, b) << " links apart, shortcut threshold " << shortcut_threshold << std::endl;
+		std::cout << "hot lines between servers: " << static_cast<double>(hot_relayed) / n
+			<< " per message" << std::endl;
+		std::cout << "hot lines delivered to clients: " << sim.msgs_received << std::endl;
+		std::cout << "hot MSG latency: mean "
+			<< (sim.msgs_received ? static_cast<double>(sim.msg_steps) / static_cast<double>(sim.msgs_received) : 0)
+			<< " hops, max " << sim.msg_steps_max << " hops" << std::endl;
+		std::cout << "hot server time: " << sim.server_time.count() * 1e6 / n << " us per message" << std::endl;
+		for (size_t i : { static_cast<size_t>(0), a, b }) {
+			std::cout << "shortcuts of s" << i << ": ";
+			sim.servers[i]->shortcut_report(std::cout);
+			std::cout << std::endl;
+		}
+	}
+
+	return 0;
+}
@@ -12,20 +12,20 @@ echo "please enter y-number:"
 read user
 
 # create root server
-${term} "ssh ${1}@${hostbase}01 ~/ibrc/ibrcd" &
+${term} "ssh ${user}@${hostbase}01 ~/ibrc/ibrcd -k ${portbase}01" &
 
-connected=(1)
-# connect other servers
+connected=(01)
+# connect other servers, the seed recommends their parent
 for i in `seq -f "%02g" $1 $2 | shuf `; do
-  destnum=`shuf -e ${connected} | head -n 1`
+  destnum=`shuf -e ${connected[@]} | head -n 1`
   ibr-wake ${hostbase}$i
-  ${term} "ssh ${user}@${hostbase}$i ~/ibrc/ibrcd -h ${hostbase}${destnum} -k ${portbase}$i" &
+  ${term} "ssh ${user}@${hostbase}$i ~/ibrc/ibrcd -A -h ${hostbase}${destnum} -p ${portbase}${destnum} -k ${portbase}$i" &
   connected+=($i)
 done
 
 # connect clients
 for i in `seq -f "%02g" $3 $4`; do
-  destnum=`shuf -e ${connected} | head -n 1`
+  destnum=`shuf -e ${connected[@]} | head -n 1`
   ibr-wake ${hostbase}$i
-  ${term} "ssh ${user}@${hostbase}$i ~/ibrc/ibrcc ${hostbase}${destnum} ${portbase}00" &
+  ${term} "ssh ${user}@${hostbase}$i ~/ibrc/ibrcc ${hostbase}${destnum} ${portbase}${destnum}" &
 done
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+# merges the trace files written by ibrcd -t into one chrome trace, open
+# the result in chrome://tracing or ui.perfetto.dev
+# usage: trace_merge.sh trace... > merged.json
+
+echo "["
+for f in "$@"; do
+  tail -n +2 "$f"
+done | sed '$ s/,$//'
+echo "]"